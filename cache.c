@@ -0,0 +1,208 @@
+#include "check_mqtt.h"
+#include "cache.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// FNV-1a (64 bit), every string including its terminating 0 byte so ("ab", "c") and ("a", "bc") differ
+static uint64_t cache_hash_string(uint64_t hash, const char *str) {
+    if (!str) {
+        str = "";
+    }
+    do {
+        hash ^= (unsigned char) *str;
+        hash *= 1099511628211ULL;
+    } while (*str++);
+    return hash;
+}
+
+static uint64_t cache_hash_long(uint64_t hash, long value) {
+    char buffer[32];
+
+    snprintf(buffer, sizeof(buffer), "%ld", value);
+    return cache_hash_string(hash, buffer);
+}
+
+// Everything that changes what is measured, but not how the result is evaluated: checks with
+// different thresholds or output formats share the measurement. The password is left out, so
+// it can't be derived from the file name.
+static uint64_t cache_key(const struct configuration *cfg) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    hash = cache_hash_string(hash, cfg->host);
+    hash = cache_hash_long(hash, cfg->port);
+    hash = cache_hash_string(hash, cfg->topic);
+    hash = cache_hash_long(hash, cfg->qos);
+    hash = cache_hash_long(hash, cfg->keep_alive);
+    hash = cache_hash_long(hash, cfg->timeout);
+    hash = cache_hash_string(hash, cfg->user);
+    hash = cache_hash_long(hash, cfg->ssl);
+    hash = cache_hash_long(hash, cfg->insecure);
+    hash = cache_hash_string(hash, cfg->ca);
+    hash = cache_hash_string(hash, cfg->cadir);
+    hash = cache_hash_string(hash, cfg->cert);
+    hash = cache_hash_string(hash, cfg->key);
+    hash = cache_hash_string(hash, cfg->psk_identity);
+    hash = cache_hash_string(hash, cfg->tls_version);
+    hash = cache_hash_string(hash, cfg->ciphers);
+    hash = cache_hash_string(hash, cfg->curves);
+    hash = cache_hash_long(hash, cfg->sys_stats);
+    return hash;
+}
+
+// Open and lock the cache file of the broker. The exclusive lock is held until the result has
+// been written, so concurrent checks wait here while one of them probes the broker. Waiting is
+// limited to the timeout of the check, CACHE_LOCK_TIMEOUT is returned if the lock isn't released.
+int cache_open(const struct configuration *cfg) {
+    char *file;
+    size_t len;
+    struct stat st;
+    struct timespec start;
+    struct timespec now;
+    struct timespec retry;
+    int fd;
+
+    // <dir>/check_mqtt-<key>.cache
+    len = strlen(cfg->cache_dir) + 35;
+    file = (char *) malloc(len);
+    if (!file) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for cache file name\n", len);
+        return -1;
+    }
+    snprintf(file, len, "%s/check_mqtt-%016llx.cache", cfg->cache_dir, (unsigned long long) cache_key(cfg));
+
+    fd = open(file, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+    if (fd == -1) {
+        fprintf(stderr, "Can't open cache file %s, errno=%d (%s)\n", file, errno, strerror(errno));
+        free(file);
+        return -1;
+    }
+
+    // the cache directory may be shared, don't trust results written by other users
+    if ((fstat(fd, &st) == -1) || !S_ISREG(st.st_mode) || (st.st_uid != geteuid())) {
+        fprintf(stderr, "Ignoring cache file %s, it is not a regular file owned by the current user\n", file);
+        close(fd);
+        free(file);
+        return -1;
+    }
+    free(file);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    retry.tv_sec = 0;
+    retry.tv_nsec = CACHE_LOCK_RETRY_MS * 1000000L;
+
+    while (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        if ((errno != EWOULDBLOCK) && (errno != EINTR)) {
+            fprintf(stderr, "Can't lock cache file, errno=%d (%s)\n", errno, strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timespec2double_ms(get_delay(start, now)) >= (double) cfg->timeout * 1000.0) {
+            close(fd);
+            return CACHE_LOCK_TIMEOUT;
+        }
+        nanosleep(&retry, NULL);
+    }
+    return fd;
+}
+
+// Restore the cached result if it is younger than the TTL
+int cache_read(struct configuration *cfg, int fd, volatile int *error) {
+    struct cache_record record;
+    struct timespec now;
+    int64_t age_ns;
+    int i;
+
+    if (pread(fd, (void *) &record, sizeof(struct cache_record), 0) != (ssize_t) sizeof(struct cache_record)) {
+        return -1;
+    }
+    if ((record.magic != CACHE_MAGIC) || (record.version != CACHE_VERSION) || (record.key_hash != cache_key(cfg))) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    age_ns = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec - record.written_ns;
+    if ((age_ns < 0) || (age_ns >= (int64_t) cfg->cache_ttl * 1000000000LL)) {
+        return -1;
+    }
+
+    *error = record.error;
+    cfg->mqtt_error = record.mqtt_error;
+    cfg->mqtt_connect_result = record.connect_result;
+    cfg->payload_received = record.payload_received ? true : false;
+    cfg->start_time = record.start_time;
+    cfg->start_wall_time = record.start_wall_time;
+    cfg->connack_time = record.connack_time;
+    cfg->suback_time = record.suback_time;
+    cfg->send_time = record.send_time;
+    cfg->receive_time = record.receive_time;
+    for (i = 0; i < SYS_STAT_COUNT; i++) {
+        cfg->sys_stat_values[i].value = record.sys_stat_value[i];
+        cfg->sys_stat_values[i].received = record.sys_stat_received[i] ? true : false;
+    }
+    cfg->tls_handshake_done = record.tls_handshake_done ? true : false;
+    cfg->tls_handshake = record.tls_handshake;
+    memcpy((void *) cfg->tls_protocol, (void *) record.tls_protocol, sizeof(cfg->tls_protocol));
+    cfg->tls_protocol[sizeof(cfg->tls_protocol) - 1] = 0;
+    memcpy((void *) cfg->tls_cipher, (void *) record.tls_cipher, sizeof(cfg->tls_cipher));
+    cfg->tls_cipher[sizeof(cfg->tls_cipher) - 1] = 0;
+
+    return 0;
+}
+
+int cache_write(const struct configuration *cfg, int fd, int error) {
+    struct cache_record record;
+    struct timespec now;
+    ssize_t written;
+    int i;
+
+    memset((void *) &record, 0, sizeof(struct cache_record));
+    record.magic = CACHE_MAGIC;
+    record.version = CACHE_VERSION;
+    record.key_hash = cache_key(cfg);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.written_ns = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+
+    record.error = error;
+    record.mqtt_error = cfg->mqtt_error;
+    record.connect_result = cfg->mqtt_connect_result;
+    record.payload_received = cfg->payload_received;
+    record.start_time = cfg->start_time;
+    record.start_wall_time = cfg->start_wall_time;
+    record.connack_time = cfg->connack_time;
+    record.suback_time = cfg->suback_time;
+    record.send_time = cfg->send_time;
+    record.receive_time = cfg->receive_time;
+    for (i = 0; i < SYS_STAT_COUNT; i++) {
+        record.sys_stat_value[i] = cfg->sys_stat_values[i].value;
+        record.sys_stat_received[i] = cfg->sys_stat_values[i].received;
+    }
+    record.tls_handshake_done = cfg->tls_handshake_done;
+    record.tls_handshake = cfg->tls_handshake;
+    memcpy((void *) record.tls_protocol, (void *) cfg->tls_protocol, sizeof(record.tls_protocol));
+    memcpy((void *) record.tls_cipher, (void *) cfg->tls_cipher, sizeof(record.tls_cipher));
+
+    // readers hold the same lock, so the record is never read while it is being written
+    written = pwrite(fd, (void *) &record, sizeof(struct cache_record), 0);
+    if (written != (ssize_t) sizeof(struct cache_record)) {
+        return written == -1 ? errno : EIO;
+    }
+    return 0;
+}
+
+void cache_close(int fd) {
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
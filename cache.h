@@ -0,0 +1,45 @@
+#ifndef __CHECK_MQTT_CACHE_H__
+#define __CHECK_MQTT_CACHE_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#define CACHE_MAGIC 0x4843434d
+#define CACHE_VERSION 1
+// cache_open gave up waiting for the check that holds the lock
+#define CACHE_LOCK_TIMEOUT -2
+// interval between attempts to lock the cache file
+#define CACHE_LOCK_RETRY_MS 10
+
+// Result of a round trip probe shared by concurrent checks against the same broker. The file is
+// only read by the binary that wrote it, so the record is stored in host byte order and layout.
+struct cache_record {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key_hash;
+    int64_t written_ns;
+    int32_t error;
+    int32_t mqtt_error;
+    int32_t connect_result;
+    int32_t payload_received;
+    struct timespec start_time;
+    struct timespec start_wall_time;
+    struct timespec connack_time;
+    struct timespec suback_time;
+    struct timespec send_time;
+    struct timespec receive_time;
+    double sys_stat_value[SYS_STAT_COUNT];
+    int32_t sys_stat_received[SYS_STAT_COUNT];
+    int32_t tls_handshake_done;
+    double tls_handshake;
+    char tls_protocol[32];
+    char tls_cipher[64];
+};
+
+int cache_open(const struct configuration *);
+int cache_read(struct configuration *, int, volatile int *);
+int cache_write(const struct configuration *, int, int);
+void cache_close(int);
+
+#endif /* __CHECK_MQTT_CACHE_H__ */
+
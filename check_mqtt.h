@@ -0,0 +1,263 @@
+#ifndef __CHECK_MQTT_CONFIG_H__
+#define __CHECK_MQTT_CONFIG_H__
+
+#if DEBUG_BUILD == 1
+#define DEBUG
+#else
+#undef DEBUG
+#endif /* DEBUG_BUILD == 1 */
+
+#define CHECK_MQTT_VERSION "1.0.0"
+
+#define DEFAULT_TIMEOUT 15
+#define DEFAULT_PORT 1883
+#define DEFAULT_QOS 0
+#define DEFAULT_TOPIC "nagios/check_mqtt"
+#define DEFAULT_WARN_MS 250
+#define DEFAULT_CRITICAL_MS 500
+#define DEFAULT_KEEP_ALIVE 1
+#define DEFAULT_CADIR "/etc/ssl/certs"
+#define MQTT_UID_PREFIX "check_mqtt-"
+#define DEFAULT_LOAD_CONNECTIONS 4
+#define DEFAULT_LOAD_RATES "0,100,1000"
+#define DEFAULT_LOAD_PAYLOAD_SIZE 64
+#define DEFAULT_LOAD_STEP 4
+#define DEFAULT_PROBE_INTERVAL 100
+#define DEFAULT_INFLIGHT_WINDOW 20
+#define DEFAULT_INFLIGHT_MESSAGES 1000
+#define DEFAULT_TRACE_MAX_SIZE 16777216
+#define DEFAULT_SHARED_CONSUMERS 4
+#define DEFAULT_SHARED_GROUP "check_mqtt"
+#define DEFAULT_SHARED_MESSAGES 100
+#define DEFAULT_SUB_COUNTS "100,1000,10000"
+#define DEFAULT_SUB_SHAPE "8,1,1"
+#define DEFAULT_SUB_CONNECTIONS 1
+#define DEFAULT_SUB_MATCHING 1
+#define DEFAULT_SUB_PROBES 20
+#define DEFAULT_SESSION_MESSAGES 100
+#define DEFAULT_WILL_KEEP_ALIVE 5
+#define DEFAULT_PROPAGATION_INTERVAL 5
+#define DEFAULT_PROPAGATION_PROBES 10
+#define DEFAULT_PING_COUNT 10
+#define DEFAULT_V5_PROBES 10
+#define DEFAULT_CACHE_DIR "/tmp"
+#define DEFAULT_SLOW_RATE 200
+#define DEFAULT_SLOW_READ_RATE 20
+#define DEFAULT_SLOW_MESSAGES 1000
+
+#define MODE_RTT 0
+#define MODE_LOAD 1
+#define MODE_INFLIGHT 2
+#define MODE_SHARED 3
+#define MODE_SUBSCRIPTIONS 4
+#define MODE_SESSION 5
+#define MODE_WILL 6
+#define MODE_PROPAGATION 7
+#define MODE_PING 8
+#define MODE_V5 9
+#define MODE_SLOW 10
+
+#define OUTPUT_NAGIOS 0
+#define OUTPUT_OPENMETRICS 1
+#define OUTPUT_JSON 2
+
+// long options without a short option
+#define OPT_LOAD_CONNECTIONS 0x100
+#define OPT_LOAD_RATES 0x101
+#define OPT_LOAD_PAYLOAD_SIZE 0x102
+#define OPT_LOAD_STEP 0x103
+#define OPT_PROBE_INTERVAL 0x104
+#define OPT_SYS_STATS 0x105
+#define OPT_SYS_THRESHOLD 0x106
+#define OPT_INFLIGHT_WINDOW 0x107
+#define OPT_INFLIGHT_MESSAGES 0x108
+#define OPT_TRACE 0x109
+#define OPT_TRACE_MAX_SIZE 0x10a
+#define OPT_ALL_ADDRESSES 0x10b
+#define OPT_BIND 0x10c
+#define OPT_SHARED_CONSUMERS 0x10d
+#define OPT_SHARED_GROUP 0x10e
+#define OPT_SHARED_MESSAGES 0x10f
+#define OPT_SUB_COUNTS 0x110
+#define OPT_SUB_SHAPE 0x111
+#define OPT_SUB_CONNECTIONS 0x112
+#define OPT_SUB_MATCHING 0x113
+#define OPT_SUB_PROBES 0x114
+#define OPT_SESSION_ID 0x115
+#define OPT_SESSION_MESSAGES 0x116
+#define OPT_WILL_KEEP_ALIVE 0x117
+#define OPT_WILL_SILENT 0x118
+#define OPT_PROPAGATION_INTERVAL 0x119
+#define OPT_PROPAGATION_PROBES 0x11a
+#define OPT_PING_COUNT 0x11b
+#define OPT_OUTPUT 0x11c
+#define OPT_TEXTFILE 0x11d
+#define OPT_V5_PROBES 0x11e
+#define OPT_SELF_STATS 0x11f
+#define OPT_PSK_IDENTITY 0x120
+#define OPT_PSK_FILE 0x121
+#define OPT_TLS_VERSION 0x122
+#define OPT_CIPHERS 0x123
+#define OPT_CURVES 0x124
+#define OPT_CACHE_TTL 0x125
+#define OPT_CACHE_DIR 0x126
+#define OPT_SLOW_RATE 0x127
+#define OPT_SLOW_READ_RATE 0x128
+#define OPT_SLOW_MESSAGES 0x129
+
+#define NAGIOS_OK 0
+#define NAGIOS_WARNING 1
+#define NAGIOS_CRITICAL 2
+#define NAGIOS_UNKNOWN 3
+
+#define ERROR_TIMEOUT 0x01
+#define ERROR_MQTT_CONNECT_FAILED 0x02
+#define ERROR_MQTT_SUBSCRIBE_FAILED 0x03
+#define ERROR_MQTT_PUBLISH_FAILED 0x04
+#define ERROR_OOM 0x05
+
+#define HAVE_MEMSET
+#define HAVE_MEMCPY
+#define HAVE_STDBOOL_H
+#define HAVE_SIGACTION
+#define HAVE_CLOCK_GETTIME
+#define HAVE_OPENSSL
+
+#ifndef HAVE_CLOCK_GETTIME
+#error "OS support for clock_gettime is mandatory"
+#endif
+
+#define READ_BUFFER_SIZE 1024
+
+#ifdef HAVE_STDBOOL_H
+#include <stdbool.h>
+#else /* HAVE_STDBOOL_H */
+typedef char bool;
+#define true 1
+#define false 0
+#endif /* HAVE_STDBOOL_H */
+
+#include <limits.h>
+
+#ifndef HOST_NAME_MAX
+// Single UNIX Specification v2 says "Host names are limited to 255 bytes"
+#define HOST_NAME_MAX 255
+
+#endif /* HOST_NAME_MAX */
+
+#include <getopt.h>
+#include <mosquitto.h>
+#include <time.h>
+
+// number of broker statistics in the table in sys_stats.c
+#define SYS_STAT_COUNT 8
+
+struct sys_stat_value {
+    double value;
+    bool received;
+    bool threshold;
+    double warn;
+    double critical;
+};
+
+// resource usage of the plugin itself, times in milliseconds and peak RSS in kilobytes
+struct self_stat_values {
+    bool collected;
+    double user;
+    double system;
+    long voluntary_switches;
+    long involuntary_switches;
+    long max_rss;
+    bool setup_reached;
+    double setup;
+};
+
+struct configuration {
+    char *host;
+    unsigned int port;
+    char *cert;
+    char *key;
+    char *ca;
+    char *cadir;
+    bool insecure;
+    int qos;
+    char *topic;
+    unsigned int timeout;
+    bool ssl;
+    char *user;
+    char *password;
+    unsigned int warn;
+    unsigned int critical;
+    char *payload;
+    int mqtt_connect_result;
+    int mqtt_error;
+    bool payload_received;
+    int keep_alive;
+    struct timespec start_time;
+    struct timespec start_wall_time;
+    struct timespec connack_time;
+    struct timespec suback_time;
+    struct timespec send_time;
+    struct timespec receive_time;
+    struct mosquitto *mqtt_handle;
+    int mode;
+    unsigned int load_connections;
+    long *load_rates;
+    size_t load_rates_count;
+    unsigned int load_payload_size;
+    unsigned int load_step;
+    unsigned int probe_interval;
+    bool sys_stats;
+    struct sys_stat_value sys_stat_values[SYS_STAT_COUNT];
+    int probe_mid;
+    unsigned int inflight_window;
+    unsigned long inflight_messages;
+    char *trace_file;
+    unsigned long trace_max_size;
+    bool all_addresses;
+    char *bind;
+    unsigned int shared_consumers;
+    char *shared_group;
+    unsigned long shared_messages;
+    long *sub_counts;
+    size_t sub_counts_count;
+    long *sub_shape;
+    size_t sub_shape_count;
+    unsigned int sub_connections;
+    long sub_matching;
+    unsigned long sub_probes;
+    char *session_id;
+    unsigned long session_messages;
+    int will_keep_alive;
+    bool will_silent;
+    unsigned int propagation_interval;
+    unsigned long propagation_probes;
+    unsigned long ping_count;
+    int output_format;
+    char *textfile;
+    unsigned long v5_probes;
+    bool self_stats;
+    struct timespec process_start;
+    struct self_stat_values self_stat_values;
+    char *psk;
+    char *psk_identity;
+    char *tls_version;
+    char *ciphers;
+    char *curves;
+    bool tls_handshake_done;
+    struct timespec tls_handshake_start;
+    double tls_handshake;
+    char tls_protocol[32];
+    char tls_cipher[64];
+    unsigned int cache_ttl;
+    char *cache_dir;
+    unsigned long slow_rate;
+    unsigned long slow_read_rate;
+    unsigned long slow_messages;
+};
+
+#include <setjmp.h>
+static jmp_buf state;
+
+#endif /* __CHECK_MQTT_CONFIG_H__ */
+
@@ -0,0 +1,318 @@
+#include "check_mqtt.h"
+#include "inflight_test.h"
+#include "mqtt_functions.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// message ids are 16 bit, the send time is looked up by message id
+#define INFLIGHT_MID_COUNT 65536
+// resolution of the window occupancy time series
+#define INFLIGHT_SAMPLE_MS 100
+#define INFLIGHT_PAYLOAD_SIZE 64
+
+static const double inflight_buckets[] = { 1.0, 2.0, 5.0, 10.0, 20.0, 50.0, 100.0, 200.0, 500.0 };
+#define INFLIGHT_BUCKET_COUNT (sizeof(inflight_buckets) / sizeof(double))
+
+struct inflight_sample {
+    double occupancy_sum;
+    double duration;
+    unsigned long acked;
+};
+
+struct inflight_test {
+    struct configuration *cfg;
+    struct mosquitto *handle;
+    bool connected;
+    bool failed;
+    int connect_result;
+    struct timespec *send_time;
+    bool *pending;
+    double *latency;
+    unsigned long sent;
+    unsigned long acked;
+    unsigned int outstanding;
+    unsigned int max_outstanding;
+    unsigned long histogram[INFLIGHT_BUCKET_COUNT + 1];
+    struct inflight_sample *samples;
+    size_t sample_count;
+    size_t max_samples;
+    struct timespec start;
+    struct timespec last_tick;
+    struct timespec end;
+    char payload[INFLIGHT_PAYLOAD_SIZE];
+};
+
+static void inflight_connect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct inflight_test *test = (struct inflight_test *) userdata;
+
+    if (result) {
+        test->connect_result = result;
+        test->failed = true;
+        return;
+    }
+    test->connected = true;
+}
+
+static void inflight_disconnect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct inflight_test *test = (struct inflight_test *) userdata;
+
+    test->cfg->mqtt_error = result;
+    test->failed = true;
+}
+
+// called by libmosquitto after PUBACK (QoS 1) or PUBCOMP (QoS 2) has been received
+static void inflight_publish_callback(struct mosquitto *mosq, void *userdata, int mid) {
+    struct inflight_test *test = (struct inflight_test *) userdata;
+    struct timespec now;
+    double latency;
+    size_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ((mid < 0) || (mid >= INFLIGHT_MID_COUNT) || !test->pending[mid]) {
+        return;
+    }
+    test->pending[mid] = false;
+
+    latency = timespec2double_ms(get_delay(test->send_time[mid], now));
+    test->latency[test->acked] = latency;
+    test->acked++;
+    test->outstanding--;
+
+    for (i = 0; i < INFLIGHT_BUCKET_COUNT; i++) {
+        if (latency < inflight_buckets[i]) {
+            break;
+        }
+    }
+    test->histogram[i]++;
+
+    if (test->sample_count < test->max_samples) {
+        test->samples[test->sample_count].acked++;
+    }
+}
+
+static int inflight_connect_tick(void *userdata, const struct timespec *now) {
+    struct inflight_test *test = (struct inflight_test *) userdata;
+
+    if (test->failed) {
+        return -1;
+    }
+    return test->connected ? 1 : 0;
+}
+
+static int inflight_run_tick(void *userdata, const struct timespec *now) {
+    struct inflight_test *test = (struct inflight_test *) userdata;
+    struct configuration *cfg = test->cfg;
+    struct inflight_sample *sample;
+    double dt;
+    int mid;
+
+    if (test->failed) {
+        return -1;
+    }
+
+    // time weighted window occupancy for the current sample interval
+    dt = timespec2double_ms(get_delay(test->last_tick, *now));
+    test->last_tick = *now;
+    if (test->sample_count < test->max_samples) {
+        sample = &test->samples[test->sample_count];
+        sample->occupancy_sum += (double) test->outstanding * dt;
+        sample->duration += dt;
+        if (sample->duration >= (double) INFLIGHT_SAMPLE_MS) {
+            test->sample_count++;
+        }
+    }
+
+    if (test->acked == cfg->inflight_messages) {
+        test->end = *now;
+        return 1;
+    }
+
+    while ((test->outstanding < cfg->inflight_window) && (test->sent < cfg->inflight_messages)) {
+        cfg->mqtt_error = mosquitto_publish(test->handle, &mid, cfg->topic, INFLIGHT_PAYLOAD_SIZE, (void *) test->payload, cfg->qos, false);
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &test->send_time[mid]);
+        test->pending[mid] = true;
+        test->sent++;
+        test->outstanding++;
+        if (test->outstanding > test->max_outstanding) {
+            test->max_outstanding = test->outstanding;
+        }
+    }
+
+    return 0;
+}
+
+static void inflight_free(struct inflight_test *test) {
+    if (test->handle) {
+        mosquitto_destroy(test->handle);
+    }
+    if (test->send_time) {
+        free(test->send_time);
+    }
+    if (test->pending) {
+        free(test->pending);
+    }
+    if (test->latency) {
+        free(test->latency);
+    }
+    if (test->samples) {
+        free(test->samples);
+    }
+}
+
+static int inflight_report(struct inflight_test *test, bool timed_out) {
+    struct configuration *cfg = test->cfg;
+    double duration;
+    double rate;
+    double p50;
+    double p99;
+    double occupancy_sum = 0.0;
+    double occupancy_time = 0.0;
+    double occupancy;
+    size_t i;
+    int exit_code;
+
+    if (timed_out) {
+        clock_gettime(CLOCK_MONOTONIC, &test->end);
+    }
+
+    duration = timespec2double_ms(get_delay(test->start, test->end));
+    rate = duration > 0.0 ? (double) test->acked * 1000.0 / duration : 0.0;
+
+    qsort((void *) test->latency, test->acked, sizeof(double), compare_double);
+    p50 = percentile(test->latency, test->acked, 50.0);
+    p99 = percentile(test->latency, test->acked, 99.0);
+
+    for (i = 0; (i <= test->sample_count) && (i < test->max_samples); i++) {
+        occupancy_sum += test->samples[i].occupancy_sum;
+        occupancy_time += test->samples[i].duration;
+    }
+    occupancy = occupancy_time > 0.0 ? occupancy_sum / occupancy_time : 0.0;
+
+    if (timed_out || !test->acked) {
+        exit_code = NAGIOS_CRITICAL;
+        fprintf(stdout, "Timeout after %d seconds, %lu of %lu messages acknowledged |", cfg->timeout, test->acked, cfg->inflight_messages);
+    } else {
+        if (p99 >= (double) cfg->critical) {
+            exit_code = NAGIOS_CRITICAL;
+        } else if (p99 >= (double) cfg->warn) {
+            exit_code = NAGIOS_WARNING;
+        } else {
+            exit_code = NAGIOS_OK;
+        }
+        fprintf(stdout, "%.0f msg/s acknowledged with a window of %u QoS %d messages |", rate, cfg->inflight_window, cfg->qos);
+    }
+
+    fprintf(stdout, " ack_rate=%.1f;;;0 ack_p50=%.3fms;;;0 ack_p99=%.3fms;%d;%d;0 ack_max=%.3fms;;;0 window_occupancy=%.2f;;;0;%u window_occupancy_max=%u;;;0;%u unacked=%lu;;;0\n",
+            rate, p50, p99, cfg->warn, cfg->critical, test->acked ? test->latency[test->acked - 1] : 0.0,
+            occupancy, cfg->inflight_window, test->max_outstanding, cfg->inflight_window, cfg->inflight_messages - test->acked);
+
+    // long output: ack latency histogram and window occupancy over time
+    for (i = 0; i <= INFLIGHT_BUCKET_COUNT; i++) {
+        if (i < INFLIGHT_BUCKET_COUNT) {
+            fprintf(stdout, "ack latency < %gms: %lu\n", inflight_buckets[i], test->histogram[i]);
+        } else {
+            fprintf(stdout, "ack latency >= %gms: %lu\n", inflight_buckets[i - 1], test->histogram[i]);
+        }
+    }
+    for (i = 0; (i <= test->sample_count) && (i < test->max_samples); i++) {
+        if (test->samples[i].duration <= 0.0) {
+            continue;
+        }
+        fprintf(stdout, "t=%.1fs: window occupancy %.1f, %.0f msg/s acknowledged\n", (double) (i * INFLIGHT_SAMPLE_MS) / 1000.0,
+                test->samples[i].occupancy_sum / test->samples[i].duration, (double) test->samples[i].acked * 1000.0 / test->samples[i].duration);
+    }
+
+    return exit_code;
+}
+
+int inflight_test(struct configuration *cfg) {
+    struct inflight_test test;
+    struct timespec connect_start;
+    char *mqttid;
+    int exit_code = NAGIOS_CRITICAL;
+    int rc;
+
+    memset((void *) &test, 0, sizeof(struct inflight_test));
+    test.cfg = cfg;
+    memset((void *) test.payload, 'X', INFLIGHT_PAYLOAD_SIZE);
+
+    test.max_samples = (size_t) cfg->timeout * 1000 / INFLIGHT_SAMPLE_MS + 1;
+    test.send_time = (struct timespec *) calloc(INFLIGHT_MID_COUNT, sizeof(struct timespec));
+    test.pending = (bool *) calloc(INFLIGHT_MID_COUNT, sizeof(bool));
+    test.latency = (double *) calloc(cfg->inflight_messages, sizeof(double));
+    test.samples = (struct inflight_sample *) calloc(test.max_samples, sizeof(struct inflight_sample));
+    if (!test.send_time || !test.pending || !test.latency || !test.samples) {
+        fprintf(stdout, "Memory allocation failed | ack_rate=U;;;0\n");
+        inflight_free(&test);
+        return NAGIOS_CRITICAL;
+    }
+
+    mqttid = mqtt_client_id();
+    if (!mqttid) {
+        inflight_free(&test);
+        return NAGIOS_CRITICAL;
+    }
+
+    mosquitto_lib_init();
+
+    test.handle = mqtt_new_handle(cfg, mqttid, true, (void *) &test);
+    free(mqttid);
+    if (!test.handle) {
+        fprintf(stdout, "%s | ack_rate=U;;;0\n", mosquitto_strerror(cfg->mqtt_error));
+        goto leave;
+    }
+
+    // the window is limited by us, not by the default in-flight limit of the library
+    mosquitto_max_inflight_messages_set(test.handle, cfg->inflight_window);
+
+    mosquitto_connect_callback_set(test.handle, inflight_connect_callback);
+    mosquitto_disconnect_callback_set(test.handle, inflight_disconnect_callback);
+    mosquitto_publish_callback_set(test.handle, inflight_publish_callback);
+
+    clock_gettime(CLOCK_MONOTONIC, &connect_start);
+    cfg->mqtt_error = mosquitto_connect_async(test.handle, cfg->host, cfg->port, cfg->keep_alive);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        fprintf(stdout, "%s | ack_rate=U;;;0\n", mosquitto_strerror(cfg->mqtt_error));
+        goto leave;
+    }
+
+    rc = mqtt_loop_run(&test.handle, 1, cfg->timeout * 1000, 10, inflight_connect_tick, (void *) &test);
+    if (rc != MQTT_LOOP_DONE) {
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds | ack_rate=U;;;0\n", cfg->timeout);
+        } else if (test.connect_result) {
+            fprintf(stdout, "%s | ack_rate=U;;;0\n", mosquitto_connack_string(test.connect_result));
+        } else {
+            fprintf(stdout, "%s | ack_rate=U;;;0\n", mosquitto_strerror(cfg->mqtt_error));
+        }
+        goto leave;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &test.start);
+    test.last_tick = test.start;
+
+    // the run phase gets what is left of the timeout after connecting
+    rc = mqtt_loop_run(&test.handle, 1, remaining_ms(connect_start, cfg->timeout), 1, inflight_run_tick, (void *) &test);
+    if (rc == MQTT_LOOP_ERROR) {
+        fprintf(stdout, "%s after %lu acknowledged messages | ack_rate=U;;;0\n", mosquitto_strerror(cfg->mqtt_error), test.acked);
+        goto leave;
+    }
+
+    exit_code = inflight_report(&test, rc == MQTT_LOOP_TIMEOUT);
+
+leave:
+    inflight_free(&test);
+    mosquitto_lib_cleanup();
+    return exit_code;
+}
+
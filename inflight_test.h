@@ -0,0 +1,7 @@
+#ifndef __CHECK_MQTT_INFLIGHT_TEST_H__
+#define __CHECK_MQTT_INFLIGHT_TEST_H__
+
+int inflight_test(struct configuration *);
+
+#endif /* __CHECK_MQTT_INFLIGHT_TEST_H__ */
+
@@ -0,0 +1,449 @@
+#include "check_mqtt.h"
+#include "load_test.h"
+#include "mqtt_functions.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// upper limit of load messages published in a single loop iteration, keeps the probe responsive
+#define LOAD_MAX_BURST 64
+// <uuid>:<step>:<sequence>
+#define LOAD_PROBE_PAYLOAD_SIZE 64
+
+struct load_test;
+
+struct load_client {
+    struct load_test *test;
+    struct mosquitto *handle;
+    char *topic;
+    bool subscribed;
+    bool failed;
+};
+
+struct load_step_result {
+    long rate;
+    unsigned long probes_sent;
+    unsigned long probes_received;
+    unsigned long load_published;
+    unsigned long load_received;
+    double p50;
+    double p99;
+    double p999;
+};
+
+struct load_test {
+    struct configuration *cfg;
+    // index 0 is the probe connection, the load generators follow
+    struct load_client *clients;
+    struct mosquitto **handles;
+    size_t count;
+    char *load_payload;
+    size_t max_probes;
+    struct timespec *probe_send_time;
+    double *rtt;
+    bool *probe_received;
+    unsigned int step;
+    struct timespec step_start;
+    double next_probe_ms;
+    size_t next_publisher;
+    struct load_step_result *results;
+    int connect_result;
+};
+
+static void load_connect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct load_client *client = (struct load_client *) userdata;
+
+    if (result) {
+        client->test->connect_result = result;
+        client->failed = true;
+        return;
+    }
+
+    client->test->cfg->mqtt_error = mosquitto_subscribe(mosq, NULL, client->topic, client->test->cfg->qos);
+    if (client->test->cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        client->failed = true;
+    }
+}
+
+static void load_disconnect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct load_client *client = (struct load_client *) userdata;
+
+#ifdef DEBUG
+    printf("DEBUG: load_disconnect_callback: result=%d (%s)\n", result, mosquitto_strerror(result));
+#endif
+
+    client->test->cfg->mqtt_error = result;
+    client->failed = true;
+}
+
+static void load_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos) {
+    struct load_client *client = (struct load_client *) userdata;
+
+    client->subscribed = true;
+}
+
+static void load_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg) {
+    struct load_client *client = (struct load_client *) userdata;
+    struct load_test *test = client->test;
+    struct timespec now;
+    char buffer[LOAD_PROBE_PAYLOAD_SIZE];
+    char *remain;
+    unsigned long step;
+    unsigned long seq;
+    size_t prefix_len;
+
+    if (client != &test->clients[0]) {
+        test->results[test->step].load_received++;
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ((msg->payloadlen <= 0) || (msg->payloadlen >= LOAD_PROBE_PAYLOAD_SIZE)) {
+        return;
+    }
+    memcpy((void *) buffer, msg->payload, msg->payloadlen);
+    buffer[msg->payloadlen] = 0;
+
+    prefix_len = strlen(test->cfg->payload);
+    if (strncmp(buffer, test->cfg->payload, prefix_len) || (buffer[prefix_len] != ':')) {
+        return;
+    }
+
+    step = strtoul(buffer + prefix_len + 1, &remain, 10);
+    if (*remain != ':') {
+        return;
+    }
+    seq = strtoul(remain + 1, &remain, 10);
+
+    // late responses from a previous step are not accounted to the current load level
+    if ((step != test->step) || (seq >= test->results[test->step].probes_sent)) {
+        return;
+    }
+
+    // QoS 1 can deliver a probe more than once
+    if (test->probe_received[seq]) {
+        return;
+    }
+    test->probe_received[seq] = true;
+
+    test->rtt[test->results[test->step].probes_received] = timespec2double_ms(get_delay(test->probe_send_time[seq], now));
+    test->results[test->step].probes_received++;
+}
+
+static int load_connect_tick(void *userdata, const struct timespec *now) {
+    struct load_test *test = (struct load_test *) userdata;
+    size_t i;
+    bool done = true;
+
+    for (i = 0; i < test->count; i++) {
+        if (test->clients[i].failed) {
+            return -1;
+        }
+        if (!test->clients[i].subscribed) {
+            done = false;
+        }
+    }
+    return done ? 1 : 0;
+}
+
+static void load_publish_probe(struct load_test *test) {
+    struct load_step_result *result = &test->results[test->step];
+    char payload[LOAD_PROBE_PAYLOAD_SIZE];
+    int len;
+
+    len = snprintf(payload, sizeof(payload), "%s:%u:%lu", test->cfg->payload, test->step, result->probes_sent);
+    test->cfg->mqtt_error = mosquitto_publish(test->clients[0].handle, NULL, test->cfg->topic, len, (void *) payload, test->cfg->qos, false);
+    if (test->cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &test->probe_send_time[result->probes_sent]);
+    result->probes_sent++;
+}
+
+static int load_step_tick(void *userdata, const struct timespec *now) {
+    struct load_test *test = (struct load_test *) userdata;
+    struct load_step_result *result = &test->results[test->step];
+    struct load_client *client;
+    double elapsed;
+    double probe_window;
+    unsigned long target;
+    unsigned int burst;
+    size_t i;
+
+    for (i = 0; i < test->count; i++) {
+        if (test->clients[i].failed) {
+            return -1;
+        }
+    }
+
+    elapsed = timespec2double_ms(get_delay(test->step_start, *now));
+    probe_window = (double) test->cfg->load_step * 1000.0;
+
+    // keep the load running during the grace period so outstanding probes see the same load level
+    if (result->rate > 0) {
+        target = (unsigned long) ((double) result->rate * elapsed / 1000.0);
+        for (burst = 0; (result->load_published < target) && (burst < LOAD_MAX_BURST); burst++) {
+            client = &test->clients[1 + test->next_publisher % (test->count - 1)];
+            test->next_publisher++;
+
+            if (mosquitto_publish(client->handle, NULL, client->topic, (int) test->cfg->load_payload_size, (void *) test->load_payload, test->cfg->qos, false) != MOSQ_ERR_SUCCESS) {
+                break;
+            }
+            result->load_published++;
+        }
+    }
+
+    if (elapsed < probe_window) {
+        if ((elapsed >= test->next_probe_ms) && (result->probes_sent < test->max_probes)) {
+            load_publish_probe(test);
+            test->next_probe_ms += (double) test->cfg->probe_interval;
+        }
+        return 0;
+    }
+
+    // grace period for probes still in flight
+    if ((result->probes_received < result->probes_sent) && (elapsed < probe_window + (double) test->cfg->critical)) {
+        return 0;
+    }
+    return 1;
+}
+
+static void load_free(struct load_test *test) {
+    size_t i;
+
+    if (test->clients) {
+        for (i = 0; i < test->count; i++) {
+            if (test->clients[i].handle) {
+                mosquitto_destroy(test->clients[i].handle);
+            }
+            // the probe connection uses the configured topic
+            if ((i > 0) && test->clients[i].topic) {
+                free(test->clients[i].topic);
+            }
+        }
+        free(test->clients);
+    }
+
+    if (test->handles) {
+        free(test->handles);
+    }
+
+    if (test->load_payload) {
+        free(test->load_payload);
+    }
+
+    if (test->probe_send_time) {
+        free(test->probe_send_time);
+    }
+
+    if (test->rtt) {
+        free(test->rtt);
+    }
+
+    if (test->probe_received) {
+        free(test->probe_received);
+    }
+
+    if (test->results) {
+        free(test->results);
+    }
+}
+
+static int load_setup(struct load_test *test) {
+    struct configuration *cfg = test->cfg;
+    char *mqttid;
+    size_t topic_len;
+    size_t i;
+
+    test->count = cfg->load_connections + 1;
+    test->max_probes = (size_t) cfg->load_step * 1000 / cfg->probe_interval + 1;
+
+    test->clients = (struct load_client *) calloc(test->count, sizeof(struct load_client));
+    test->handles = (struct mosquitto **) calloc(test->count, sizeof(struct mosquitto *));
+    test->load_payload = (char *) malloc(cfg->load_payload_size + 1);
+    test->probe_send_time = (struct timespec *) calloc(test->max_probes, sizeof(struct timespec));
+    test->rtt = (double *) calloc(test->max_probes, sizeof(double));
+    test->probe_received = (bool *) calloc(test->max_probes, sizeof(bool));
+    test->results = (struct load_step_result *) calloc(cfg->load_rates_count, sizeof(struct load_step_result));
+    if (!test->clients || !test->handles || !test->load_payload || !test->probe_send_time || !test->rtt || !test->probe_received || !test->results) {
+        fprintf(stderr, "Unable to allocate memory for load test\n");
+        return -1;
+    }
+    memset((void *) test->load_payload, 'X', cfg->load_payload_size);
+    test->load_payload[cfg->load_payload_size] = 0;
+
+    for (i = 0; i < test->count; i++) {
+        test->clients[i].test = test;
+
+        if (i == 0) {
+            test->clients[i].topic = cfg->topic;
+        } else {
+            // <topic>/load/<n>
+            topic_len = strlen(cfg->topic) + 6 + 10 + 1;
+            test->clients[i].topic = (char *) malloc(topic_len);
+            if (!test->clients[i].topic) {
+                fprintf(stderr, "Unable to allocate %ld bytes of memory for MQTT topic\n", topic_len);
+                return -1;
+            }
+            snprintf(test->clients[i].topic, topic_len, "%s/load/%lu", cfg->topic, (unsigned long) i);
+        }
+
+        mqttid = mqtt_client_id();
+        if (!mqttid) {
+            return -1;
+        }
+        test->clients[i].handle = mqtt_new_handle(cfg, mqttid, true, (void *) &test->clients[i]);
+        free(mqttid);
+        if (!test->clients[i].handle) {
+            return -1;
+        }
+        test->handles[i] = test->clients[i].handle;
+
+        mosquitto_connect_callback_set(test->clients[i].handle, load_connect_callback);
+        mosquitto_disconnect_callback_set(test->clients[i].handle, load_disconnect_callback);
+        mosquitto_subscribe_callback_set(test->clients[i].handle, load_subscribe_callback);
+        mosquitto_message_callback_set(test->clients[i].handle, load_message_callback);
+
+        cfg->mqtt_error = mosquitto_connect_async(test->clients[i].handle, cfg->host, cfg->port, cfg->keep_alive);
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int load_report(struct load_test *test) {
+    struct configuration *cfg = test->cfg;
+    struct load_step_result *result;
+    struct load_step_result *worst = NULL;
+    unsigned int i;
+    int exit_code;
+    double rate;
+
+    exit_code = NAGIOS_OK;
+    for (i = 0; i < cfg->load_rates_count; i++) {
+        result = &test->results[i];
+        if (!result->probes_received) {
+            exit_code = NAGIOS_CRITICAL;
+            continue;
+        }
+        if (!worst || (result->p99 > worst->p99)) {
+            worst = result;
+        }
+    }
+
+    if (worst && (exit_code == NAGIOS_OK)) {
+        if (worst->p99 >= (double) cfg->critical) {
+            exit_code = NAGIOS_CRITICAL;
+        } else if (worst->p99 >= (double) cfg->warn) {
+            exit_code = NAGIOS_WARNING;
+        }
+    }
+
+    if (exit_code == NAGIOS_CRITICAL && (!worst || worst->p99 < (double) cfg->critical)) {
+        fprintf(stdout, "No probe response received during at least one load step |");
+    } else {
+        fprintf(stdout, "p99 probe RTT %.1fms at %ld msg/s (worst of %lu load steps) |", worst->p99, worst->rate, (unsigned long) cfg->load_rates_count);
+    }
+
+    for (i = 0; i < cfg->load_rates_count; i++) {
+        result = &test->results[i];
+        if (result->probes_received) {
+            fprintf(stdout, " rtt_p50_%ld=%.3fms;;;0 rtt_p99_%ld=%.3fms;%d;%d;0 rtt_p999_%ld=%.3fms;;;0",
+                    result->rate, result->p50, result->rate, result->p99, cfg->warn, cfg->critical, result->rate, result->p999);
+        } else {
+            fprintf(stdout, " rtt_p50_%ld=U;;;0 rtt_p99_%ld=U;%d;%d;0 rtt_p999_%ld=U;;;0",
+                    result->rate, result->rate, cfg->warn, cfg->critical, result->rate);
+        }
+        fprintf(stdout, " probe_loss_%ld=%lu;;;0", result->rate, result->probes_sent - result->probes_received);
+    }
+    fprintf(stdout, "\n");
+
+    // long output: one line per load step
+    for (i = 0; i < cfg->load_rates_count; i++) {
+        result = &test->results[i];
+        rate = (double) result->load_received / ((double) cfg->load_step + (double) cfg->critical / 1000.0);
+        fprintf(stdout, "load %ld msg/s (%.0f msg/s delivered): p50=%.1fms p99=%.1fms p999=%.1fms, %lu of %lu probes received\n",
+                result->rate, rate, result->p50, result->p99, result->p999, result->probes_received, result->probes_sent);
+    }
+
+    return exit_code;
+}
+
+int load_test(struct configuration *cfg) {
+    struct load_test test;
+    struct load_step_result *result;
+    struct timespec start;
+    int exit_code = NAGIOS_CRITICAL;
+    int rc;
+
+    memset((void *) &test, 0, sizeof(struct load_test));
+    test.cfg = cfg;
+
+    // connection setup and all load steps share the timeout
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    mosquitto_lib_init();
+
+    if (load_setup(&test) != 0) {
+        fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    rc = mqtt_loop_run(test.handles, test.count, remaining_ms(start, cfg->timeout), 10, load_connect_tick, (void *) &test);
+    if (rc == MQTT_LOOP_TIMEOUT) {
+        fprintf(stdout, "Timeout after %d seconds while connecting load generators | mqtt_rtt=U;%d;%d;0\n", cfg->timeout, cfg->warn, cfg->critical);
+        goto leave;
+    }
+    if (rc != MQTT_LOOP_DONE) {
+        if (test.connect_result) {
+            fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_connack_string(test.connect_result), cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        }
+        goto leave;
+    }
+
+    for (test.step = 0; test.step < cfg->load_rates_count; test.step++) {
+        result = &test.results[test.step];
+        result->rate = cfg->load_rates[test.step];
+
+        clock_gettime(CLOCK_MONOTONIC, &test.step_start);
+        test.next_probe_ms = 0.0;
+        memset((void *) test.probe_received, 0, test.max_probes * sizeof(bool));
+
+        rc = mqtt_loop_run(test.handles, test.count, remaining_ms(start, cfg->timeout), 1, load_step_tick, (void *) &test);
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds at %ld msg/s | mqtt_rtt=U;%d;%d;0\n", cfg->timeout, result->rate, cfg->warn, cfg->critical);
+            goto leave;
+        }
+        if (rc != MQTT_LOOP_DONE) {
+            fprintf(stdout, "Connection lost at %ld msg/s: %s | mqtt_rtt=U;%d;%d;0\n", result->rate, mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+            goto leave;
+        }
+
+        qsort((void *) test.rtt, result->probes_received, sizeof(double), compare_double);
+        result->p50 = percentile(test.rtt, result->probes_received, 50.0);
+        result->p99 = percentile(test.rtt, result->probes_received, 99.0);
+        result->p999 = percentile(test.rtt, result->probes_received, 99.9);
+
+#ifdef DEBUG
+        printf("DEBUG: load_test: step %u finished, %lu load messages published, %lu probes sent, %lu received\n", test.step, result->load_published, result->probes_sent, result->probes_received);
+#endif
+    }
+
+    exit_code = load_report(&test);
+
+leave:
+    load_free(&test);
+    mosquitto_lib_cleanup();
+    return exit_code;
+}
+
@@ -3,6 +3,23 @@
 #include "util.h"
 #include "mqtt_functions.h"
 #include "sig_handler.h"
+#include "load_test.h"
+#include "sys_stats.h"
+#include "self_stats.h"
+#include "tls_info.h"
+#include "inflight_test.h"
+#include "shared_sub.h"
+#include "sub_scale.h"
+#include "session_test.h"
+#include "will_test.h"
+#include "propagation_test.h"
+#include "ping_test.h"
+#include "v5_test.h"
+#include "slow_test.h"
+#include "trace.h"
+#include "multi_probe.h"
+#include "cache.h"
+#include "output.h"
 
 #include <errno.h>
 #include <getopt.h>
@@ -15,7 +32,7 @@
 #include <signal.h>
 #include <unistd.h>
 
-const char *const short_opts = "hH:p:c:k:C:iQ:T:t:su:P:w:W:K:f:";
+const char *const short_opts = "hH:p:c:k:C:iQ:T:t:su:P:w:W:K:f:m:";
 const struct option long_opts[] = {
     { "help", no_argument, NULL, 'h' },
     { "host", required_argument, NULL, 'H' },
@@ -35,32 +52,190 @@ const struct option long_opts[] = {
     { "critical", required_argument, NULL, 'W' },
     { "keepalive", required_argument, NULL, 'K' },
     { "password-file", required_argument, NULL, 'f' },
+    { "mode", required_argument, NULL, 'm' },
+    { "load-connections", required_argument, NULL, OPT_LOAD_CONNECTIONS },
+    { "load-rates", required_argument, NULL, OPT_LOAD_RATES },
+    { "load-payload-size", required_argument, NULL, OPT_LOAD_PAYLOAD_SIZE },
+    { "load-step", required_argument, NULL, OPT_LOAD_STEP },
+    { "probe-interval", required_argument, NULL, OPT_PROBE_INTERVAL },
+    { "sys-stats", no_argument, NULL, OPT_SYS_STATS },
+    { "sys-threshold", required_argument, NULL, OPT_SYS_THRESHOLD },
+    { "inflight-window", required_argument, NULL, OPT_INFLIGHT_WINDOW },
+    { "inflight-messages", required_argument, NULL, OPT_INFLIGHT_MESSAGES },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "trace-max-size", required_argument, NULL, OPT_TRACE_MAX_SIZE },
+    { "all-addresses", no_argument, NULL, OPT_ALL_ADDRESSES },
+    { "bind", required_argument, NULL, OPT_BIND },
+    { "shared-consumers", required_argument, NULL, OPT_SHARED_CONSUMERS },
+    { "shared-group", required_argument, NULL, OPT_SHARED_GROUP },
+    { "shared-messages", required_argument, NULL, OPT_SHARED_MESSAGES },
+    { "sub-counts", required_argument, NULL, OPT_SUB_COUNTS },
+    { "sub-shape", required_argument, NULL, OPT_SUB_SHAPE },
+    { "sub-connections", required_argument, NULL, OPT_SUB_CONNECTIONS },
+    { "sub-matching", required_argument, NULL, OPT_SUB_MATCHING },
+    { "sub-probes", required_argument, NULL, OPT_SUB_PROBES },
+    { "session-id", required_argument, NULL, OPT_SESSION_ID },
+    { "session-messages", required_argument, NULL, OPT_SESSION_MESSAGES },
+    { "will-keepalive", required_argument, NULL, OPT_WILL_KEEP_ALIVE },
+    { "will-silent", no_argument, NULL, OPT_WILL_SILENT },
+    { "propagation-interval", required_argument, NULL, OPT_PROPAGATION_INTERVAL },
+    { "propagation-probes", required_argument, NULL, OPT_PROPAGATION_PROBES },
+    { "ping-count", required_argument, NULL, OPT_PING_COUNT },
+    { "output", required_argument, NULL, OPT_OUTPUT },
+    { "textfile", required_argument, NULL, OPT_TEXTFILE },
+    { "v5-probes", required_argument, NULL, OPT_V5_PROBES },
+    { "self-stats", no_argument, NULL, OPT_SELF_STATS },
+    { "psk-identity", required_argument, NULL, OPT_PSK_IDENTITY },
+    { "psk-file", required_argument, NULL, OPT_PSK_FILE },
+    { "tls-version", required_argument, NULL, OPT_TLS_VERSION },
+    { "ciphers", required_argument, NULL, OPT_CIPHERS },
+    { "curves", required_argument, NULL, OPT_CURVES },
+    { "cache-ttl", required_argument, NULL, OPT_CACHE_TTL },
+    { "cache-dir", required_argument, NULL, OPT_CACHE_DIR },
+    { "slow-rate", required_argument, NULL, OPT_SLOW_RATE },
+    { "slow-read-rate", required_argument, NULL, OPT_SLOW_READ_RATE },
+    { "slow-messages", required_argument, NULL, OPT_SLOW_MESSAGES },
     { NULL, 0, NULL, 0 },
 };
 
 static sigjmp_buf state;
 
+// Evaluate and print the result of a single round trip probe, error is 0 if the probe finished
+static int rtt_report(struct configuration *config, int error) {
+    int exit_code;
+    double rtt;
+
+    switch (error) {
+        case 0: {
+                    if (config->payload_received) {
+                        rtt = timespec2double_ms(get_delay(config->send_time, config->receive_time));
+
+                        if (rtt >= (double) config->critical) {
+                            exit_code = NAGIOS_CRITICAL;
+                        } else if (rtt >= (double) config->warn) {
+                            exit_code = NAGIOS_WARNING;
+                        } else {
+                            exit_code = NAGIOS_OK;
+                        }
+
+                        if (config->sys_stats && (sys_stats_state(config) > exit_code)) {
+                            exit_code = sys_stats_state(config);
+                        }
+
+                        if (config->output_format == OUTPUT_NAGIOS) {
+                            fprintf(stdout, "Response received after %.1fms", rtt);
+                            if (config->tls_handshake_done) {
+                                fprintf(stdout, " (%s, %s)", config->tls_protocol, config->tls_cipher);
+                            }
+                            fprintf(stdout, " | mqtt_rtt=%.3fms;%d;%d;0", rtt, config->warn, config->critical);
+                        }
+                    } else {
+                        exit_code = NAGIOS_CRITICAL;
+                        if (config->output_format == OUTPUT_NAGIOS) {
+                            fprintf(stdout, "No response received | mqtt_rtt=U;%d;%d;0", config->warn, config->critical);
+                        }
+                    }
+
+                    if (config->output_format == OUTPUT_NAGIOS) {
+                        if (config->sys_stats) {
+                            sys_stats_print_perfdata(config, stdout);
+                        }
+                        if (config->self_stats) {
+                            self_stats_print_perfdata(config, stdout);
+                        }
+                        if (config->ssl || config->cert) {
+                            tls_info_print_perfdata(config, stdout);
+                        }
+                        fprintf(stdout, "\n");
+                    }
+                    return exit_code;
+                }
+        case ERROR_TIMEOUT: {
+                                if (config->output_format == OUTPUT_NAGIOS) {
+                                    fprintf(stdout, "Timeout after %d seconds | mqtt_rtt=U;%d;%d;0\n", config->timeout, config->warn, config->critical);
+                                }
+                                return NAGIOS_CRITICAL;
+                            }
+        case ERROR_MQTT_CONNECT_FAILED: {
+                                            if (config->output_format != OUTPUT_NAGIOS) {
+                                                return NAGIOS_CRITICAL;
+                                            }
+
+                                            // XXX: Print connect errors
+                                            switch (config->mqtt_connect_result) {
+                                                case 0: {
+                                                            fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(config->mqtt_error), config->warn, config->critical);
+                                                            break;
+                                                        }
+                                                case 1: {
+                                                            fprintf(stdout, "connection refused (unacceptable protocol version)\n");
+                                                            break;
+                                                        }
+                                                case 2: {
+                                                            fprintf(stdout, "connection refused (identifier rejected)\n");
+                                                            break;
+                                                        }
+                                                case 3: {
+                                                            fprintf(stdout, "connection refused (broker unavailable)\n");
+                                                            break;
+                                                        }
+                                                default: {
+                                                             fprintf(stdout, "reserved return code %d\n", config->mqtt_connect_result);
+                                                             break;
+                                                         }
+                                            }
+                                            return NAGIOS_CRITICAL;
+                                        }
+        case ERROR_MQTT_SUBSCRIBE_FAILED:
+        case ERROR_MQTT_PUBLISH_FAILED: {
+                                            if (config->output_format == OUTPUT_NAGIOS) {
+                                                fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(config->mqtt_error), config->warn, config->critical);
+                                            }
+                                            return NAGIOS_CRITICAL;
+                                        }
+        case ERROR_OOM: {
+                            if (config->output_format == OUTPUT_NAGIOS) {
+                                fprintf(stdout, "Memory allocation failed | mqtt_rtt=U;%d;%d;0\n", config->warn, config->critical);
+                            }
+                            return NAGIOS_CRITICAL;
+                        }
+        default: {
+                     if (config->output_format == OUTPUT_NAGIOS) {
+                         printf("Unknown error condition | mqtt_rtt=U;%d;%d;0\n", config->warn, config->critical);
+                     }
+                     return NAGIOS_UNKNOWN;
+                 }
+    }
+}
+
 int main(int argc, char **argv) {
     struct configuration *config;
     int exit_code;
+    volatile int error;
+    volatile int cache_fd;
+    volatile bool cached;
     int opt_idx;
     int opt_rc;
     long temp_long;
     int rc;
-    struct timespec delay;
-    double rtt;
+    size_t i;
+    struct timespec wait_start;
 #ifdef HAVE_SIGACTION
     struct sigaction action;
     sigset_t mask;
 #endif
 
     exit_code = NAGIOS_UNKNOWN;
+    error = 0;
+    cache_fd = -1;
+    cached = false;
     config = (struct configuration *) malloc(sizeof(struct configuration));
     if (!config) {
         fprintf(stderr, "Failed to allocate %ld bytes of memory for configuration\n", sizeof(struct configuration));
         exit(NAGIOS_UNKNOWN);
     }
     memset((void *)config, 0, sizeof(struct configuration));
+    clock_gettime(CLOCK_MONOTONIC, &config->process_start);
 
     // set defaults
     config->port = DEFAULT_PORT;
@@ -71,6 +246,29 @@ int main(int argc, char **argv) {
     config->warn = DEFAULT_WARN_MS;
     config->critical = DEFAULT_CRITICAL_MS;
     config->keep_alive = DEFAULT_KEEP_ALIVE;
+    config->mode = MODE_RTT;
+    config->load_connections = DEFAULT_LOAD_CONNECTIONS;
+    config->load_payload_size = DEFAULT_LOAD_PAYLOAD_SIZE;
+    config->load_step = DEFAULT_LOAD_STEP;
+    config->probe_interval = DEFAULT_PROBE_INTERVAL;
+    config->inflight_window = DEFAULT_INFLIGHT_WINDOW;
+    config->inflight_messages = DEFAULT_INFLIGHT_MESSAGES;
+    config->trace_max_size = DEFAULT_TRACE_MAX_SIZE;
+    config->shared_consumers = DEFAULT_SHARED_CONSUMERS;
+    config->shared_messages = DEFAULT_SHARED_MESSAGES;
+    config->sub_connections = DEFAULT_SUB_CONNECTIONS;
+    config->sub_matching = DEFAULT_SUB_MATCHING;
+    config->sub_probes = DEFAULT_SUB_PROBES;
+    config->session_messages = DEFAULT_SESSION_MESSAGES;
+    config->will_keep_alive = DEFAULT_WILL_KEEP_ALIVE;
+    config->propagation_interval = DEFAULT_PROPAGATION_INTERVAL;
+    config->propagation_probes = DEFAULT_PROPAGATION_PROBES;
+    config->ping_count = DEFAULT_PING_COUNT;
+    config->output_format = OUTPUT_NAGIOS;
+    config->v5_probes = DEFAULT_V5_PROBES;
+    config->slow_rate = DEFAULT_SLOW_RATE;
+    config->slow_read_rate = DEFAULT_SLOW_READ_RATE;
+    config->slow_messages = DEFAULT_SLOW_MESSAGES;
 
     for (;;) {
         opt_rc = getopt_long(argc, argv, short_opts, long_opts, &opt_idx);
@@ -166,6 +364,7 @@ int main(int argc, char **argv) {
                               goto leave;
                           }
                           config->qos = (int) temp_long;
+                          break;
                       }
             case 'T': {
                           if (config->topic) {
@@ -261,7 +460,495 @@ int main(int argc, char **argv) {
                           }
                           break;
                       }
-                          
+            case 'm': {
+                          config->mode = parse_mode(optarg);
+                          if (config->mode == -1) {
+                              fprintf(stderr, "Invalid mode %s\n", optarg);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_LOAD_CONNECTIONS: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if ((temp_long < 0) || (temp_long > 1024)) {
+                              fprintf(stderr, "Invalid number of load connections %ld (valid range is 0 - 1024)\n", temp_long);
+                              goto leave;
+                          }
+                          config->load_connections = (unsigned int) temp_long;
+                          break;
+                      }
+            case OPT_LOAD_RATES: {
+                          if (config->load_rates) {
+                              free(config->load_rates);
+                          }
+                          config->load_rates = str2long_list(optarg, &config->load_rates_count);
+                          if (!config->load_rates) {
+                              goto leave;
+                          }
+                          for (i = 0; i < config->load_rates_count; i++) {
+                              if (config->load_rates[i] < 0) {
+                                  fprintf(stderr, "Invalid load rate %ld (must be >= 0)\n", config->load_rates[i]);
+                                  goto leave;
+                              }
+                          }
+                          break;
+                      }
+            case OPT_LOAD_PAYLOAD_SIZE: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if ((temp_long < 0) || (temp_long > 268435455)) {
+                              fprintf(stderr, "Invalid payload size %ld (valid range is 0 - 268435455)\n", temp_long);
+                              goto leave;
+                          }
+                          config->load_payload_size = (unsigned int) temp_long;
+                          break;
+                      }
+            case OPT_LOAD_STEP: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long <= 0) {
+                              fprintf(stderr, "Invalid load step duration %ld (must be > 0)\n", temp_long);
+                              goto leave;
+                          }
+                          config->load_step = (unsigned int) temp_long;
+                          break;
+                      }
+            case OPT_PROBE_INTERVAL: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long <= 0) {
+                              fprintf(stderr, "Invalid probe interval %ld (must be > 0)\n", temp_long);
+                              goto leave;
+                          }
+                          config->probe_interval = (unsigned int) temp_long;
+                          break;
+                      }
+            case OPT_SYS_STATS: {
+                          config->sys_stats = true;
+                          break;
+                      }
+            case OPT_SYS_THRESHOLD: {
+                          if (sys_stats_set_threshold(config, optarg) != 0) {
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_INFLIGHT_WINDOW: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          // message ids are 16 bit, so at most 65535 messages can be outstanding
+                          if ((temp_long <= 0) || (temp_long > 65535)) {
+                              fprintf(stderr, "Invalid in-flight window %ld (valid range is 1 - 65535)\n", temp_long);
+                              goto leave;
+                          }
+                          config->inflight_window = (unsigned int) temp_long;
+                          break;
+                      }
+            case OPT_INFLIGHT_MESSAGES: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long <= 0) {
+                              fprintf(stderr, "Invalid number of messages %ld (must be > 0)\n", temp_long);
+                              goto leave;
+                          }
+                          config->inflight_messages = (unsigned long) temp_long;
+                          break;
+                      }
+            case OPT_TRACE: {
+                          if (config->trace_file) {
+                              free(config->trace_file);
+                          }
+                          config->trace_file = strdup(optarg);
+                          if (!config->trace_file) {
+                              fprintf(stderr, "Unable to allocate %ld bytes of memory for trace file name\n", strlen(optarg) + 1);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_TRACE_MAX_SIZE: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long < (long) sizeof(struct trace_record)) {
+                              fprintf(stderr, "Invalid trace file size %ld (must be >= %ld)\n", temp_long, sizeof(struct trace_record));
+                              goto leave;
+                          }
+                          config->trace_max_size = (unsigned long) temp_long;
+                          break;
+                      }
+            case OPT_ALL_ADDRESSES: {
+                          config->all_addresses = true;
+                          break;
+                      }
+            case OPT_BIND: {
+                          if (config->bind) {
+                              free(config->bind);
+                          }
+                          config->bind = strdup(optarg);
+                          if (!config->bind) {
+                              fprintf(stderr, "Unable to allocate %ld bytes of memory for bind address list\n", strlen(optarg) + 1);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_SHARED_CONSUMERS: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if ((temp_long <= 0) || (temp_long > 1024)) {
+                              fprintf(stderr, "Invalid number of consumers %ld (valid range is 1 - 1024)\n", temp_long);
+                              goto leave;
+                          }
+                          config->shared_consumers = (unsigned int) temp_long;
+                          break;
+                      }
+            case OPT_SHARED_GROUP: {
+                          // the share name must not contain topic separators or wildcards
+                          if ((*optarg == 0) || strpbrk(optarg, "/+#")) {
+                              fprintf(stderr, "Invalid share name %s\n", optarg);
+                              goto leave;
+                          }
+                          if (config->shared_group) {
+                              free(config->shared_group);
+                          }
+                          config->shared_group = strdup(optarg);
+                          if (!config->shared_group) {
+                              fprintf(stderr, "Unable to allocate %ld bytes of memory for share name\n", strlen(optarg) + 1);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_SHARED_MESSAGES: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long <= 0) {
+                              fprintf(stderr, "Invalid number of messages %ld (must be > 0)\n", temp_long);
+                              goto leave;
+                          }
+                          config->shared_messages = (unsigned long) temp_long;
+                          break;
+                      }
+            case OPT_SUB_COUNTS: {
+                          if (config->sub_counts) {
+                              free(config->sub_counts);
+                          }
+                          config->sub_counts = str2long_list(optarg, &config->sub_counts_count);
+                          if (!config->sub_counts) {
+                              goto leave;
+                          }
+                          // the subscription tree only grows, every count adds to the previous one
+                          for (i = 0; i < config->sub_counts_count; i++) {
+                              if ((config->sub_counts[i] <= 0) || (i && (config->sub_counts[i] <= config->sub_counts[i - 1]))) {
+                                  fprintf(stderr, "Invalid subscription count %ld (must be > 0 and ascending)\n", config->sub_counts[i]);
+                                  goto leave;
+                              }
+                          }
+                          break;
+                      }
+            case OPT_SUB_SHAPE: {
+                          if (config->sub_shape) {
+                              free(config->sub_shape);
+                          }
+                          config->sub_shape = str2long_list(optarg, &config->sub_shape_count);
+                          if (!config->sub_shape) {
+                              goto leave;
+                          }
+                          if ((config->sub_shape_count != 3) || (config->sub_shape[0] < 0) || (config->sub_shape[1] < 0) || (config->sub_shape[2] < 0)
+                                  || (config->sub_shape[0] + config->sub_shape[1] + config->sub_shape[2] == 0)) {
+                              fprintf(stderr, "Invalid subscription shape %s (expecting <exact>,<single>,<multi> weights >= 0)\n", optarg);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_SUB_CONNECTIONS: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if ((temp_long <= 0) || (temp_long > 1024)) {
+                              fprintf(stderr, "Invalid number of connections %ld (valid range is 1 - 1024)\n", temp_long);
+                              goto leave;
+                          }
+                          config->sub_connections = (unsigned int) temp_long;
+                          break;
+                      }
+            case OPT_SUB_MATCHING: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if ((temp_long <= 0) || (temp_long > 1024)) {
+                              fprintf(stderr, "Invalid number of matching filters %ld (valid range is 1 - 1024)\n", temp_long);
+                              goto leave;
+                          }
+                          config->sub_matching = temp_long;
+                          break;
+                      }
+            case OPT_SUB_PROBES: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long <= 0) {
+                              fprintf(stderr, "Invalid number of probes %ld (must be > 0)\n", temp_long);
+                              goto leave;
+                          }
+                          config->sub_probes = (unsigned long) temp_long;
+                          break;
+                      }
+            case OPT_SESSION_ID: {
+                          // MQTT 3.1.1 limits client ids to 65535 bytes
+                          if ((*optarg == 0) || (strlen(optarg) > 65535)) {
+                              fprintf(stderr, "Invalid client id for session\n");
+                              goto leave;
+                          }
+                          if (config->session_id) {
+                              free(config->session_id);
+                          }
+                          config->session_id = strdup(optarg);
+                          if (!config->session_id) {
+                              fprintf(stderr, "Unable to allocate %ld bytes of memory for session client id\n", strlen(optarg) + 1);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_SESSION_MESSAGES: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long <= 0) {
+                              fprintf(stderr, "Invalid number of messages %ld (must be > 0)\n", temp_long);
+                              goto leave;
+                          }
+                          config->session_messages = (unsigned long) temp_long;
+                          break;
+                      }
+            case OPT_WILL_KEEP_ALIVE: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          // libmosquitto rejects keepalive values below 5 seconds
+                          if ((temp_long < 5) || (temp_long > 65535)) {
+                              fprintf(stderr, "Invalid keep alive value %ld (valid range is 5 - 65535)\n", temp_long);
+                              goto leave;
+                          }
+                          config->will_keep_alive = (int) temp_long;
+                          break;
+                      }
+            case OPT_WILL_SILENT: {
+                          config->will_silent = true;
+                          break;
+                      }
+            case OPT_PROPAGATION_INTERVAL: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if ((temp_long <= 0) || (temp_long > 60000)) {
+                              fprintf(stderr, "Invalid propagation probe interval %ld (valid range is 1 - 60000)\n", temp_long);
+                              goto leave;
+                          }
+                          config->propagation_interval = (unsigned int) temp_long;
+                          break;
+                      }
+            case OPT_PROPAGATION_PROBES: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long <= 0) {
+                              fprintf(stderr, "Invalid number of probes %ld (must be > 0)\n", temp_long);
+                              goto leave;
+                          }
+                          config->propagation_probes = (unsigned long) temp_long;
+                          break;
+                      }
+            case OPT_PING_COUNT: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long <= 0) {
+                              fprintf(stderr, "Invalid number of pings %ld (must be > 0)\n", temp_long);
+                              goto leave;
+                          }
+                          config->ping_count = (unsigned long) temp_long;
+                          break;
+                      }
+            case OPT_OUTPUT: {
+                          config->output_format = parse_output_format(optarg);
+                          if (config->output_format == -1) {
+                              fprintf(stderr, "Invalid output format %s\n", optarg);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_TEXTFILE: {
+                          if (config->textfile) {
+                              free(config->textfile);
+                          }
+                          config->textfile = strdup(optarg);
+                          if (!config->textfile) {
+                              fprintf(stderr, "Unable to allocate %ld bytes of memory for textfile name\n", strlen(optarg) + 1);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_V5_PROBES: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long <= 0) {
+                              fprintf(stderr, "Invalid number of probes %ld (must be > 0)\n", temp_long);
+                              goto leave;
+                          }
+                          config->v5_probes = (unsigned long) temp_long;
+                          break;
+                      }
+            case OPT_SELF_STATS: {
+                          config->self_stats = true;
+                          break;
+                      }
+            case OPT_PSK_IDENTITY: {
+                          if (config->psk_identity) {
+                              free(config->psk_identity);
+                          }
+                          config->psk_identity = strdup(optarg);
+                          if (!config->psk_identity) {
+                              fprintf(stderr, "Unable to allocate %ld bytes of memory for PSK identity\n", strlen(optarg) + 1);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_PSK_FILE: {
+                          rc = read_psk_from_file(optarg, config);
+                          if (rc != 0) {
+                              fprintf(stderr, "Can't read hexadecimal pre-shared key from %s, errno=%d (%s)\n", optarg, rc, strerror(rc));
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_TLS_VERSION: {
+                          if (strcmp(optarg, "tlsv1.1") && strcmp(optarg, "tlsv1.2") && strcmp(optarg, "tlsv1.3")) {
+                              fprintf(stderr, "Invalid TLS version %s (valid versions are tlsv1.1, tlsv1.2 or tlsv1.3)\n", optarg);
+                              goto leave;
+                          }
+                          if (config->tls_version) {
+                              free(config->tls_version);
+                          }
+                          config->tls_version = strdup(optarg);
+                          if (!config->tls_version) {
+                              fprintf(stderr, "Unable to allocate %ld bytes of memory for TLS version\n", strlen(optarg) + 1);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_CIPHERS: {
+                          if (config->ciphers) {
+                              free(config->ciphers);
+                          }
+                          config->ciphers = strdup(optarg);
+                          if (!config->ciphers) {
+                              fprintf(stderr, "Unable to allocate %ld bytes of memory for cipher list\n", strlen(optarg) + 1);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_CURVES: {
+#ifndef HAVE_OPENSSL
+                          fprintf(stderr, "Selection of curves requires OpenSSL support at build time\n");
+                          goto leave;
+#endif /* HAVE_OPENSSL */
+                          if (config->curves) {
+                              free(config->curves);
+                          }
+                          config->curves = strdup(optarg);
+                          if (!config->curves) {
+                              fprintf(stderr, "Unable to allocate %ld bytes of memory for list of curves\n", strlen(optarg) + 1);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_CACHE_TTL: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long < 0) {
+                              fprintf(stderr, "Invalid cache TTL %ld (must be >= 0)\n", temp_long);
+                              goto leave;
+                          }
+                          config->cache_ttl = (unsigned int) temp_long;
+                          break;
+                      }
+            case OPT_CACHE_DIR: {
+                          if (config->cache_dir) {
+                              free(config->cache_dir);
+                          }
+                          config->cache_dir = strdup(optarg);
+                          if (!config->cache_dir) {
+                              fprintf(stderr, "Unable to allocate %ld bytes of memory for cache directory\n", strlen(optarg) + 1);
+                              goto leave;
+                          }
+                          break;
+                      }
+            case OPT_SLOW_RATE: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if ((temp_long <= 0) || (temp_long > 100000)) {
+                              fprintf(stderr, "Invalid publish rate %ld (valid range is 1 - 100000)\n", temp_long);
+                              goto leave;
+                          }
+                          config->slow_rate = (unsigned long) temp_long;
+                          break;
+                      }
+            case OPT_SLOW_READ_RATE: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if ((temp_long <= 0) || (temp_long > 100000)) {
+                              fprintf(stderr, "Invalid read rate %ld (valid range is 1 - 100000)\n", temp_long);
+                              goto leave;
+                          }
+                          config->slow_read_rate = (unsigned long) temp_long;
+                          break;
+                      }
+            case OPT_SLOW_MESSAGES: {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              goto leave;
+                          }
+                          if (temp_long <= 0) {
+                              fprintf(stderr, "Invalid number of messages %ld (must be > 0)\n", temp_long);
+                              goto leave;
+                          }
+                          config->slow_messages = (unsigned long) temp_long;
+                          break;
+                      }
+
             default: {
                          fprintf(stderr, "Unknown argument\n");
                          goto leave;
@@ -292,6 +979,42 @@ int main(int argc, char **argv) {
             goto leave;
         }
     }
+    if (!config->load_rates) {
+        config->load_rates = str2long_list(DEFAULT_LOAD_RATES, &config->load_rates_count);
+        if (!config->load_rates) {
+            goto leave;
+        }
+    }
+
+    if (!config->sub_counts) {
+        config->sub_counts = str2long_list(DEFAULT_SUB_COUNTS, &config->sub_counts_count);
+        if (!config->sub_counts) {
+            goto leave;
+        }
+    }
+
+    if (!config->sub_shape) {
+        config->sub_shape = str2long_list(DEFAULT_SUB_SHAPE, &config->sub_shape_count);
+        if (!config->sub_shape) {
+            goto leave;
+        }
+    }
+
+    if (!config->shared_group) {
+        config->shared_group = strdup(DEFAULT_SHARED_GROUP);
+        if (!config->shared_group) {
+            fprintf(stderr, "Unable to allocate %ld bytes of memory for share name\n", strlen(DEFAULT_SHARED_GROUP) + 1);
+            goto leave;
+        }
+    }
+
+    if (!config->cache_dir) {
+        config->cache_dir = strdup(DEFAULT_CACHE_DIR);
+        if (!config->cache_dir) {
+            fprintf(stderr, "Unable to allocate %ld bytes of memory for cache directory\n", strlen(DEFAULT_CACHE_DIR) + 1);
+            goto leave;
+        }
+    }
 
     // sanity checks
     if (config->warn > config->critical) {
@@ -299,6 +1022,24 @@ int main(int argc, char **argv) {
         goto leave;
     }
 
+    // TLS-PSK requires both identity and key, it replaces certificate based TLS
+    if ((config->psk_identity && !config->psk) || (!config->psk_identity && config->psk)) {
+        fprintf(stderr, "TLS-PSK requires PSK identity and PSK file\n");
+        goto leave;
+    }
+    if (config->psk && (config->cert || config->key || config->ca)) {
+        fprintf(stderr, "TLS-PSK and certificate based TLS are mutually exclusive\n");
+        goto leave;
+    }
+    if (config->psk) {
+        config->ssl = true;
+    }
+
+    if ((config->tls_version || config->ciphers || config->curves) && !config->ssl) {
+        fprintf(stderr, "TLS version, ciphers and curves require SSL/TLS (--ssl or TLS-PSK)\n");
+        goto leave;
+    }
+
     // User/password authentication and authentication with SSL client certificate are mutually exclusive
     if ((config->user || config->password) && (config->cert || config->key)) {
         fprintf(stderr, "User/password authentication and authentication using SSL certificate are mutually exclusive\n");
@@ -306,7 +1047,7 @@ int main(int argc, char **argv) {
     }
 
     // Note: The library allows for username and no password to send only username
-    if (!config->user) {
+    if (!config->user && !config->psk) {
         // SSL authentication requires certificate and key file
         if ((!config->cert) || (!config->key)) {
             fprintf(stderr, "SSL authentication requires certificate and key file\n");
@@ -319,10 +1060,152 @@ int main(int argc, char **argv) {
         goto leave;
     }
 
+    if ((config->mode == MODE_INFLIGHT) && (config->qos == 0)) {
+        fprintf(stderr, "In-flight mode requires QoS 1 or 2\n");
+        goto leave;
+    }
+
+    // the messages are published for --shared-messages intervals plus the grace period for outstanding deliveries,
+    // connecting and subscribing need time on top
+    if ((config->mode == MODE_SHARED) && (config->shared_messages * config->probe_interval + config->critical >= (unsigned long) config->timeout * 1000)) {
+        fprintf(stderr, "%lu messages every %u ms don't fit into the timeout of %u seconds\n", config->shared_messages, config->probe_interval, config->timeout);
+        goto leave;
+    }
+
+    if ((config->mode == MODE_SUBSCRIPTIONS) && (config->sub_matching > config->sub_counts[0])) {
+        fprintf(stderr, "Number of matching filters must not exceed the first subscription count\n");
+        goto leave;
+    }
+
+    // every step probes for --sub-probes intervals plus the grace period for outstanding probes, subscribing needs time on top
+    if ((config->mode == MODE_SUBSCRIPTIONS) && (config->sub_counts_count * (config->sub_probes * config->probe_interval + config->critical) >= (unsigned long) config->timeout * 1000)) {
+        fprintf(stderr, "%lu steps of %lu probes every %u ms don't fit into the timeout of %u seconds\n",
+                (unsigned long) config->sub_counts_count, config->sub_probes, config->probe_interval, config->timeout);
+        goto leave;
+    }
+
+    // the broker has to detect the killed connection within 1.5 times the keepalive, a late will is critical
+    // once it exceeds the bound by the critical threshold
+    if ((config->mode == MODE_WILL) && (1500UL * config->will_keep_alive + config->critical >= (unsigned long) config->timeout * 1000)) {
+        fprintf(stderr, "The last will bound of 1.5 times the keepalive of %d seconds doesn't fit into the timeout of %u seconds\n", config->will_keep_alive, config->timeout);
+        goto leave;
+    }
+
+    // the steady state probes run for --propagation-probes intervals plus the grace period for outstanding probes,
+    // subscribing and waiting for the subscription need time on top
+    if ((config->mode == MODE_PROPAGATION) && (config->propagation_probes * config->probe_interval + config->critical >= (unsigned long) config->timeout * 1000)) {
+        fprintf(stderr, "%lu probes every %u ms don't fit into the timeout of %u seconds\n", config->propagation_probes, config->probe_interval, config->timeout);
+        goto leave;
+    }
+
+    // a request is only sent after the previous response has been received or counted as lost
+    if ((config->mode == MODE_V5) && (config->v5_probes * (config->probe_interval > config->critical ? config->probe_interval : config->critical) >= (unsigned long) config->timeout * 1000)) {
+        fprintf(stderr, "%lu requests every %u ms with a critical threshold of %u ms don't fit into the timeout of %u seconds\n",
+                config->v5_probes, config->probe_interval, config->critical, config->timeout);
+        goto leave;
+    }
+
+    // a PINGREQ is only sent after the previous one has been answered or counted as lost
+    if ((config->mode == MODE_PING) && (config->ping_count * (config->probe_interval > config->critical ? config->probe_interval : config->critical) >= (unsigned long) config->timeout * 1000)) {
+        fprintf(stderr, "%lu pings every %u ms with a critical threshold of %u ms don't fit into the timeout of %u seconds\n",
+                config->ping_count, config->probe_interval, config->critical, config->timeout);
+        goto leave;
+    }
+
+    if ((config->mode == MODE_SLOW) && (config->slow_read_rate >= config->slow_rate)) {
+        fprintf(stderr, "Read rate of the slow consumer must be lower than the publish rate\n");
+        goto leave;
+    }
+
+    // the drain after the stream needs time as well
+    if ((config->mode == MODE_SLOW) && (config->slow_messages * 1000 / config->slow_rate >= (unsigned long) config->timeout * 1000)) {
+        fprintf(stderr, "Publishing %lu messages at %lu/s doesn't fit into the timeout of %u seconds\n", config->slow_messages, config->slow_rate, config->timeout);
+        goto leave;
+    }
+
+    // broker and client statistics are only collected by the single rtt probe
+    if ((config->sys_stats || config->self_stats) && ((config->mode != MODE_RTT) || config->all_addresses || config->bind)) {
+        fprintf(stderr, "Options --sys-stats and --self-stats are only supported in rtt mode without --all-addresses or --bind\n");
+        goto leave;
+    }
+
+    // the other modes only report in the Nagios format and write no trace records
+    if (((config->output_format != OUTPUT_NAGIOS) || config->textfile || config->cache_ttl || config->trace_file) && ((config->mode != MODE_RTT) || config->all_addresses || config->bind)) {
+        fprintf(stderr, "Options --output, --textfile, --cache-ttl and --trace are only supported in rtt mode without --all-addresses or --bind\n");
+        goto leave;
+    }
+
+    if (config->mode == MODE_LOAD) {
+        for (i = 0; i < config->load_rates_count; i++) {
+            if ((config->load_rates[i] > 0) && (config->load_connections == 0)) {
+                fprintf(stderr, "Load rates > 0 require at least one load connection\n");
+                goto leave;
+            }
+        }
+
+        // every step runs for --load-step seconds plus the grace period for outstanding probes
+        if (config->load_rates_count * ((unsigned long) config->load_step * 1000 + config->critical) >= (unsigned long) config->timeout * 1000) {
+            fprintf(stderr, "%lu load steps of %u seconds don't fit into the timeout of %u seconds\n",
+                    (unsigned long) config->load_rates_count, config->load_step, config->timeout);
+            goto leave;
+        }
+    }
+
 #ifdef DEBUG
     print_configuration(config);
 #endif
 
+    // these modes drive their own event loop and apply --timeout themselves, the alarm below only covers the rtt probe
+    switch (config->mode) {
+        case MODE_LOAD: {
+                            exit_code = load_test(config);
+                            goto leave;
+                        }
+        case MODE_INFLIGHT: {
+                                exit_code = inflight_test(config);
+                                goto leave;
+                            }
+        case MODE_SHARED: {
+                              exit_code = shared_subscription_test(config);
+                              goto leave;
+                          }
+        case MODE_SUBSCRIPTIONS: {
+                                     exit_code = sub_scale_test(config);
+                                     goto leave;
+                                 }
+        case MODE_SESSION: {
+                               exit_code = session_test(config);
+                               goto leave;
+                           }
+        case MODE_WILL: {
+                            exit_code = will_test(config);
+                            goto leave;
+                        }
+        case MODE_PROPAGATION: {
+                                   exit_code = propagation_test(config);
+                                   goto leave;
+                               }
+        case MODE_PING: {
+                            exit_code = ping_test(config);
+                            goto leave;
+                        }
+        case MODE_V5: {
+                          exit_code = v5_test(config);
+                          goto leave;
+                      }
+        case MODE_SLOW: {
+                            exit_code = slow_test(config);
+                            goto leave;
+                        }
+        default: {
+                     if (config->all_addresses || config->bind) {
+                         exit_code = multi_probe(config);
+                         goto leave;
+                     }
+                     break;
+                 }
+    }
+
 #ifdef HAVE_SIGACTION
     sigemptyset(&mask);
     action.sa_handler = (void *) alarm_handler;
@@ -341,80 +1224,103 @@ int main(int argc, char **argv) {
     }
 #endif
 
-    alarm(config->timeout);
+    // only one check probes the broker, concurrent checks wait for its result. The lock is taken
+    // before the alarm is armed, cache_open limits the wait to the timeout itself.
+    clock_gettime(CLOCK_MONOTONIC, &wait_start);
+    if (config->cache_ttl) {
+        cache_fd = cache_open(config);
+        if (cache_fd == CACHE_LOCK_TIMEOUT) {
+            cache_fd = -1;
+            error = ERROR_TIMEOUT;
+            goto report;
+        }
+        if ((cache_fd != -1) && (cache_read(config, cache_fd, &error) == 0)) {
+            cached = true;
+            goto report;
+        }
+    }
+
+    // the time spent waiting for the lock counts against the timeout
+    alarm((remaining_ms(wait_start, config->timeout) + 999) / 1000);
 
     switch (setjmp(state)) {
         case 0: {
                     if (mqtt_connect(config) == -1) {
-                        exit_code = NAGIOS_CRITICAL;
-
-                        if (config->mqtt_connect_result) {
-                            // XXX: Print connect errors
-                            switch (config->mqtt_connect_result) {
-                                case 1: {
-                                            fprintf(stdout, "connection refused (unacceptable protocol version)\n");
-                                            break;
-                                        }
-                                case 2: {
-                                            fprintf(stdout, "connection refused (identifier rejected)\n");
-                                            break;
-                                        }
-                                case 3: {
-                                            fprintf(stdout, "connection refused (broker unavailable)\n");
-                                            break;
-                                        }
-                                default: {
-                                             fprintf(stdout, "reserved return code %d\n", config->mqtt_connect_result);
-                                             break;
-                                         }
-                            }
-                        } else {
-                            fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(config->mqtt_error), config->warn, config->critical);
-                        }
+                        error = ERROR_MQTT_CONNECT_FAILED;
                     } else {
-                        if (config->payload_received) {
-                            delay = get_delay(config->send_time, config->receive_time);
-                            rtt = timespec2double_ms(delay);
-                            fprintf(stdout, "Response received after %.1fms | mqtt_rtt=%.3fms;%d;%d;0\n", rtt, rtt, config->warn, config->critical);
-
-                            if (rtt >= (double) config->critical) {
-                                exit_code = NAGIOS_CRITICAL;
-                            } else if (rtt >= (double) config->warn) {
-                                exit_code = NAGIOS_WARNING;
-                            } else {
-                                exit_code = NAGIOS_OK;
-                            }
-                        } else {
-                            fprintf(stdout, "No response received | mqtt_rtt=U;%d;%d;0\n", config->warn, config->critical);
-                            exit_code = NAGIOS_CRITICAL;
-                        }
-                    };
+                        error = 0;
+                    }
                     break;
                 }
         case ERROR_TIMEOUT: {
-                                fprintf(stdout, "Timeout after %d seconds | mqtt_rtt=U;%d;%d;0\n", config->timeout, config->warn, config->critical);
-                                exit_code = NAGIOS_CRITICAL;
+                                error = ERROR_TIMEOUT;
                                 break;
                             }
-        case ERROR_MQTT_CONNECT_FAILED:
-        case ERROR_MQTT_SUBSCRIBE_FAILED:
+        case ERROR_MQTT_CONNECT_FAILED: {
+                                            error = ERROR_MQTT_CONNECT_FAILED;
+                                            break;
+                                        }
+        case ERROR_MQTT_SUBSCRIBE_FAILED: {
+                                              error = ERROR_MQTT_SUBSCRIBE_FAILED;
+                                              break;
+                                          }
         case ERROR_MQTT_PUBLISH_FAILED: {
-                                            fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(config->mqtt_error), config->warn, config->critical);
-                                            exit_code = NAGIOS_CRITICAL;
+                                            error = ERROR_MQTT_PUBLISH_FAILED;
                                             break;
                                         }
         case ERROR_OOM: {
-                            fprintf(stdout, "Memory allocation failed | mqtt_rtt=U;%d;%d;0\n", config->warn, config->critical);
-                            exit_code = NAGIOS_CRITICAL;
+                            error = ERROR_OOM;
                             break;
                         }
         default: {
-                     printf("Unknown error condition | mqtt_rtt=U;%d;%d;0\n", config->warn, config->critical);
-                     exit_code = NAGIOS_UNKNOWN;
+                     error = -1;
                      break;
                  }
     }
 
+    alarm(0);
+
+report:
+    if (cache_fd != -1) {
+        if (!cached) {
+            rc = cache_write(config, cache_fd, error);
+            if (rc != 0) {
+                fprintf(stderr, "Can't write cached result, errno=%d (%s)\n", rc, strerror(rc));
+            }
+        }
+        cache_close(cache_fd);
+    }
+
+    if (config->self_stats) {
+        self_stats_collect(config, cached);
+    }
+
+    exit_code = rtt_report(config, error);
+
+    if (config->output_format != OUTPUT_NAGIOS) {
+        rc = output_print(config, config->output_format, exit_code, error);
+        if (rc != 0) {
+            fprintf(stderr, "Can't write result, errno=%d (%s)\n", rc, strerror(rc));
+        }
+    }
+
+    if (config->textfile) {
+        rc = output_textfile(config, exit_code, error);
+        if (rc != 0) {
+            fprintf(stderr, "Can't write metrics to %s, errno=%d (%s)\n", config->textfile, rc, strerror(rc));
+        }
+    }
+
+    // the result has already been reported, writing the trace record doesn't delay the probe
+    // a cached result has already been traced by the check that probed the broker
+    if (config->trace_file && !cached) {
+        fflush(stdout);
+        rc = trace_write(config, exit_code);
+        if (rc != 0) {
+            fprintf(stderr, "Can't write trace record to %s, errno=%d (%s)\n", config->trace_file, rc, strerror(rc));
+        }
+    }
+
 leave:
     if (config) {
         free_configuration(config);
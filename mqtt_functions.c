@@ -1,6 +1,8 @@
 #include "check_mqtt.h"
 #include "mqtt_functions.h"
 #include "util.h"
+#include "sys_stats.h"
+#include "tls_info.h"
 
 #include <setjmp.h>
 #include <mosquitto.h>
@@ -11,17 +13,26 @@
 void mqtt_connect_callback(struct mosquitto *mosq, void *userdata, int result) {
     struct configuration *cfg = (struct configuration *) userdata;
 
+    clock_gettime(CLOCK_MONOTONIC, &cfg->connack_time);
+
     cfg->mqtt_connect_result = result;
     if (result) {
         longjmp(state, ERROR_MQTT_CONNECT_FAILED);
     }
 
+    // subscribe to the broker statistics first, their retained values arrive before the SUBACK of the probe topic
+    if (cfg->sys_stats) {
+        if (sys_stats_subscribe(cfg, mosq) != 0) {
+            longjmp(state, ERROR_MQTT_SUBSCRIBE_FAILED);
+        }
+    }
+
 #ifdef DEBUG
     printf("DEBUG: mqtt_connect_callback: result=%d\n", result);
     printf("DEBUG: mqtt_connect_callback: subscribing to topic %s\n", cfg->topic);
 #endif
 
-    cfg->mqtt_error = mosquitto_subscribe(mosq, NULL, cfg->topic, cfg->qos);
+    cfg->mqtt_error = mosquitto_subscribe(mosq, &cfg->probe_mid, cfg->topic, cfg->qos);
 
 #ifdef DEBUG
     printf("DEBUG: mqtt_connect_callback: subscribe returned %d (%s)\n", cfg->mqtt_error, mosquitto_strerror(cfg->mqtt_error));
@@ -45,6 +56,13 @@ void mqtt_disconnect_callback(struct mosquitto *mosq, void *userdata, int result
 void mqtt_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos) {
     struct configuration *cfg = (struct configuration *) userdata;
 
+    // only the subscription of the probe topic triggers the probe
+    if (mid != cfg->probe_mid) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &cfg->suback_time);
+
 #ifdef DEBUG
     printf("DEBUG: mqtt_subscribe_callback: subscribed to topic\n");
     printf("DEBUG: mqtt_subscribe_callback: Publishing payload %s\n", cfg->payload);
@@ -65,23 +83,14 @@ void mqtt_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, in
 
 void mqtt_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg) {
     struct configuration *cfg = (struct configuration *) userdata;
-    char *response;
 
-    // Note: struct mosquitto_message * will be released by libmosquitto as soon as this
-    //       callback finnishes
-    response = (char *) malloc(msg->payloadlen + 1);
-    if (!response) {
-        longjmp(state, ERROR_OOM);
+    if (cfg->sys_stats && sys_stats_message(cfg, msg)) {
+        return;
     }
-    memset((void *) response, 0, msg->payloadlen + 1);
-
-    memcpy((void *) response, msg->payload, msg->payloadlen);
-
-#ifdef DEBUG
-        printf("DEBUG: mqtt_message_callback: received message: %s\n", response);
-#endif
 
-    if (!strcmp(cfg->payload, response)) {
+    // Note: The payload is compared in place, struct mosquitto_message * will be released by
+    //       libmosquitto as soon as this callback finnishes
+    if ((msg->payloadlen == (int) strlen(cfg->payload) + 1) && !memcmp(msg->payload, (void *) cfg->payload, msg->payloadlen)) {
         // this is our probe payload, measure receive time and exit MQTT loop
         clock_gettime(CLOCK_MONOTONIC, &cfg->receive_time);
 
@@ -89,7 +98,6 @@ void mqtt_message_callback(struct mosquitto *mosq, void *userdata, const struct
         printf("DEBUG: mqtt_message_callback: received response matches our probe\n");
 #endif
 
-        free(response);
         cfg->payload_received = true;
 
 #ifdef DEBUG
@@ -100,15 +108,13 @@ void mqtt_message_callback(struct mosquitto *mosq, void *userdata, const struct
     }
 
 #ifdef DEBUG
-    printf("DEBUG: mqtt_message_callback: received response is not the payload we sent earlier (%s != %s)\n", response, cfg->payload);
+    printf("DEBUG: mqtt_message_callback: received response is not the payload we sent earlier (%.*s != %s)\n", msg->payloadlen, (char *) msg->payload, cfg->payload);
 #endif
 
-    free(response);
-
     // keep on listening until the timeout has been reached or we received our payload
 }
 
-int mqtt_connect(struct configuration *cfg) {
+char *mqtt_client_id(void) {
     char *mqttid;
     char *mqtt_uuid;
     size_t mqttid_len = strlen(MQTT_UID_PREFIX) + 36 + 1;
@@ -116,7 +122,7 @@ int mqtt_connect(struct configuration *cfg) {
     mqttid = (char *) malloc(mqttid_len);
     if (!mqttid) {
         fprintf(stderr, "Unable to allocate %ld bytes of memory for MQTT ID\n", mqttid_len);
-        return -1;
+        return NULL;
     }
     memset((void *) mqttid, 0, mqttid_len);
 
@@ -124,88 +130,119 @@ int mqtt_connect(struct configuration *cfg) {
     if (!mqtt_uuid) {
         fprintf(stderr, "Unable to allocate 37 bytes of memory for UUID\n");
         free(mqttid);
-        return -1;
+        return NULL;
     }
 
     snprintf(mqttid, mqttid_len, "%s%s", MQTT_UID_PREFIX, mqtt_uuid);
     free(mqtt_uuid);
 
-    mosquitto_lib_init(); // always return MOSQ_ERR_SUCCESS
+    return mqttid;
+}
 
-    // initialize MQTT structure, clean messages and subscriptions on disconnect
-    cfg->mqtt_handle = mosquitto_new(mqttid, true, (void *) cfg);
+struct mosquitto *mqtt_new_handle(struct configuration *cfg, const char *mqttid, bool clean_session, void *userdata) {
+    struct mosquitto *handle;
+
+    handle = mosquitto_new(mqttid, clean_session, userdata);
 
 #ifdef DEBUG
-    printf("DEBUG: mqtt_connect: mosquitto_new returned new MQTT connection structure at 0x%0x\n", cfg->mqtt_handle);
+    printf("DEBUG: mqtt_new_handle: mosquitto_new returned new MQTT connection structure at 0x%0x\n", handle);
 #endif
 
-    if (!cfg->mqtt_handle) {
+    if (!handle) {
         fprintf(stderr, "Unable to initialise MQTT structure\n");
-        free(mqttid);
-        return -1;
+        cfg->mqtt_error = MOSQ_ERR_NOMEM;
+        return NULL;
     }
 
     // we are not threaded
-    mosquitto_threaded_set(cfg->mqtt_handle, false);
+    mosquitto_threaded_set(handle, false);
 
     // configure basic SSL
     if (cfg->ssl) {
         if (cfg->insecure) {
-            cfg->mqtt_error = mosquitto_tls_opts_set(cfg->mqtt_handle, SSL_VERIFY_NONE, NULL, NULL);
+            cfg->mqtt_error = mosquitto_tls_opts_set(handle, SSL_VERIFY_NONE, cfg->tls_version, cfg->ciphers);
         } else {
-            cfg->mqtt_error = mosquitto_tls_opts_set(cfg->mqtt_handle, SSL_VERIFY_PEER, NULL, NULL);
+            cfg->mqtt_error = mosquitto_tls_opts_set(handle, SSL_VERIFY_PEER, cfg->tls_version, cfg->ciphers);
         }
         if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
-            free(mqttid);
-            mosquitto_lib_cleanup();
-            return -1;
+            mosquitto_destroy(handle);
+            return NULL;
         }
 
-        cfg->mqtt_error = mosquitto_tls_set(cfg->mqtt_handle, cfg->ca, cfg->cadir, cfg->cert, cfg->key, NULL);
+        // pre-shared key and certificate based TLS are mutually exclusive
+        if (cfg->psk) {
+            cfg->mqtt_error = mosquitto_tls_psk_set(handle, cfg->psk, cfg->psk_identity, NULL);
+        } else {
+            cfg->mqtt_error = mosquitto_tls_set(handle, cfg->ca, cfg->cadir, cfg->cert, cfg->key, NULL);
+        }
         if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
-            free(mqttid);
-            mosquitto_lib_cleanup();
-            return -1;
+            mosquitto_destroy(handle);
+            return NULL;
         }
     }
 
-    // XXX: There is a third option, "pre-shared key over TLS" - mosquitto_tls_psk_set
     if (cfg->user) {
 
 #ifdef DEBUG
-        printf("DEBUG: mqtt_connect: setting up username/password authentication\n");
+        printf("DEBUG: mqtt_new_handle: setting up username/password authentication\n");
 #endif
 
-        cfg->mqtt_error = mosquitto_username_pw_set(cfg->mqtt_handle, cfg->user, cfg->password);
+        cfg->mqtt_error = mosquitto_username_pw_set(handle, cfg->user, cfg->password);
 
 #ifdef DEBUG
-        printf("DEBUG: mqtt_connect: mosquitto_username_pw_set returned %d (%s)\n", cfg->mqtt_error, mosquitto_strerror(cfg->mqtt_error));
+        printf("DEBUG: mqtt_new_handle: mosquitto_username_pw_set returned %d (%s)\n", cfg->mqtt_error, mosquitto_strerror(cfg->mqtt_error));
 #endif
 
         if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
-            free(mqttid);
-            mosquitto_lib_cleanup();
-            return -1;
+            mosquitto_destroy(handle);
+            return NULL;
         }
     } else if (cfg->cert) {
 
 #ifdef DEBUG
-        printf("DEBUG: mqtt_connect: setting up SSL certificate authentication\n");
+        printf("DEBUG: mqtt_new_handle: setting up SSL certificate authentication\n");
 #endif
 
-        cfg->mqtt_error = mosquitto_tls_set(cfg->mqtt_handle, cfg->ca, cfg->cadir, cfg->cert, cfg->key, NULL);
+        cfg->mqtt_error = mosquitto_tls_set(handle, cfg->ca, cfg->cadir, cfg->cert, cfg->key, NULL);
 
 #ifdef DEBUG
-        printf("DEBUG: mqtt_connect: mosquitto_tls_set returned %d (%s)\n", cfg->mqtt_error, mosquitto_strerror(cfg->mqtt_error));
+        printf("DEBUG: mqtt_new_handle: mosquitto_tls_set returned %d (%s)\n", cfg->mqtt_error, mosquitto_strerror(cfg->mqtt_error));
 #endif
 
         if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
-            free(mqttid);
-            mosquitto_lib_cleanup();
-            return -1;
+            mosquitto_destroy(handle);
+            return NULL;
+        }
+    }
+
+    if (cfg->ssl || cfg->cert) {
+        if (tls_info_setup(cfg, handle) != 0) {
+            mosquitto_destroy(handle);
+            return NULL;
         }
     }
 
+    return handle;
+}
+
+int mqtt_connect(struct configuration *cfg) {
+    char *mqttid;
+
+    mqttid = mqtt_client_id();
+    if (!mqttid) {
+        return -1;
+    }
+
+    mosquitto_lib_init(); // always return MOSQ_ERR_SUCCESS
+
+    // initialize MQTT structure, clean messages and subscriptions on disconnect
+    cfg->mqtt_handle = mqtt_new_handle(cfg, mqttid, true, (void *) cfg);
+    if (!cfg->mqtt_handle) {
+        free(mqttid);
+        mosquitto_lib_cleanup();
+        return -1;
+    }
+
 #ifdef DEBUGG
     printf("DEBUG: mqtt_connect: installing callback functions\n");
 #endif
@@ -216,6 +253,9 @@ int mqtt_connect(struct configuration *cfg) {
     mosquitto_subscribe_callback_set(cfg->mqtt_handle, mqtt_subscribe_callback);
     mosquitto_message_callback_set(cfg->mqtt_handle, mqtt_message_callback);
 
+    clock_gettime(CLOCK_REALTIME, &cfg->start_wall_time);
+    clock_gettime(CLOCK_MONOTONIC, &cfg->start_time);
+
     cfg->mqtt_error = mosquitto_connect(cfg->mqtt_handle, cfg->host, cfg->port, cfg->keep_alive);
 
 #ifdef DEBUG
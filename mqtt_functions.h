@@ -3,14 +3,19 @@
 
 #include <mosquitto.h>
 
+// same values as in OpenSSL's ssl.h, which is only included where the TLS session itself is accessed
+#ifndef SSL_VERIFY_NONE
 #define SSL_VERIFY_NONE 0
 #define SSL_VERIFY_PEER 1
+#endif
 
 void mqtt_connect_callback(struct mosquitto *, void *, int);
 void mqtt_disconnect_callback(struct mosquitto *, void *, int);
 void mqtt_subscribe_callback(struct mosquitto *, void *, int, int, const int*);
 void mqtt_message_callback(struct mosquitto *, void *, const struct mosquitto_message *);
 
+char *mqtt_client_id(void);
+struct mosquitto *mqtt_new_handle(struct configuration *, const char *, bool, void *);
 int mqtt_connect(struct configuration *);
 
 #endif /* __CHECK_MQTT_MQTT_FUNCTIONS_H__ */
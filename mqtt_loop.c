@@ -0,0 +1,111 @@
+#include "check_mqtt.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <errno.h>
+#include <mosquitto.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Drive all MQTT handles from a single non-blocking poll() loop.
+//
+// Handles without an open socket (not connected yet or disconnected) are skipped, so a failing
+// connection never stalls the others. The loop ends if the tick function returns a non-zero value,
+// if poll() fails or if timeout_ms milliseconds have elapsed (a timeout of 0 means no timeout).
+// poll_ms is the upper limit for a single poll() call and therefore the resolution of the tick function.
+int mqtt_loop_run(struct mosquitto **handles, size_t count, unsigned int timeout_ms, int poll_ms, mqtt_loop_tick_t tick, void *userdata) {
+    struct pollfd *fds;
+    struct mosquitto **polled;
+    struct timespec start;
+    struct timespec now;
+    size_t i;
+    nfds_t nfds;
+    int sock;
+    int rc;
+    double elapsed;
+
+    fds = (struct pollfd *) malloc((count + 1) * sizeof(struct pollfd));
+    if (!fds) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for poll structure\n", (count + 1) * sizeof(struct pollfd));
+        return MQTT_LOOP_ERROR;
+    }
+
+    polled = (struct mosquitto **) malloc((count + 1) * sizeof(struct mosquitto *));
+    if (!polled) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for MQTT handle list\n", (count + 1) * sizeof(struct mosquitto *));
+        free(fds);
+        return MQTT_LOOP_ERROR;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (tick) {
+            rc = tick(userdata, &now);
+            if (rc != 0) {
+                free(polled);
+                free(fds);
+                return rc > 0 ? MQTT_LOOP_DONE : MQTT_LOOP_ERROR;
+            }
+        }
+
+        elapsed = timespec2double_ms(get_delay(start, now));
+        if (timeout_ms && (elapsed >= (double) timeout_ms)) {
+            free(polled);
+            free(fds);
+            return MQTT_LOOP_TIMEOUT;
+        }
+
+        nfds = 0;
+        for (i = 0; i < count; i++) {
+            if (!handles[i]) {
+                continue;
+            }
+
+            sock = mosquitto_socket(handles[i]);
+            if (sock == -1) {
+                continue;
+            }
+
+            fds[nfds].fd = sock;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            if (mosquitto_want_write(handles[i])) {
+                fds[nfds].events |= POLLOUT;
+            }
+            polled[nfds] = handles[i];
+            nfds++;
+        }
+
+        rc = poll(fds, nfds, poll_ms);
+        if (rc == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll failed, errno=%d (%s)\n", errno, strerror(errno));
+            free(polled);
+            free(fds);
+            return MQTT_LOOP_ERROR;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            // errors are reported through the disconnect callback of the handle
+            if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                mosquitto_loop_read(polled[i], 1);
+            }
+            if ((fds[i].revents & POLLOUT) && (mosquitto_socket(polled[i]) != -1)) {
+                mosquitto_loop_write(polled[i], 1);
+            }
+            mosquitto_loop_misc(polled[i]);
+        }
+    }
+
+    // never reached
+    return MQTT_LOOP_ERROR;
+}
+
@@ -0,0 +1,18 @@
+#ifndef __CHECK_MQTT_MQTT_LOOP_H__
+#define __CHECK_MQTT_MQTT_LOOP_H__
+
+#include <mosquitto.h>
+#include <stddef.h>
+#include <time.h>
+
+#define MQTT_LOOP_DONE 0
+#define MQTT_LOOP_TIMEOUT 1
+#define MQTT_LOOP_ERROR -1
+
+// called once per loop iteration, return 0 to continue, > 0 to leave the loop and < 0 on error
+typedef int (*mqtt_loop_tick_t)(void *, const struct timespec *);
+
+int mqtt_loop_run(struct mosquitto **, size_t, unsigned int, int, mqtt_loop_tick_t, void *);
+
+#endif /* __CHECK_MQTT_MQTT_LOOP_H__ */
+
@@ -0,0 +1,487 @@
+#include "check_mqtt.h"
+#include "multi_probe.h"
+#include "mqtt_functions.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct multi_probe {
+    struct configuration *cfg;
+    const struct multi_probe_target *target;
+    struct mosquitto *handle;
+    char *payload;
+    int sub_mid;
+    int connect_result;
+    int mqtt_error;
+    bool received;
+    bool failed;
+    struct timespec start_time;
+    struct timespec connack_time;
+    struct timespec suback_time;
+    struct timespec send_time;
+    struct timespec receive_time;
+};
+
+struct multi_probe_run {
+    struct multi_probe *probes;
+    struct mosquitto **handles;
+    size_t count;
+};
+
+static void multi_probe_connect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct multi_probe *probe = (struct multi_probe *) userdata;
+
+    clock_gettime(CLOCK_MONOTONIC, &probe->connack_time);
+
+    probe->connect_result = result;
+    if (result) {
+        probe->failed = true;
+        return;
+    }
+
+    probe->mqtt_error = mosquitto_subscribe(mosq, &probe->sub_mid, probe->cfg->topic, probe->cfg->qos);
+    if (probe->mqtt_error != MOSQ_ERR_SUCCESS) {
+        probe->failed = true;
+    }
+}
+
+static void multi_probe_disconnect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct multi_probe *probe = (struct multi_probe *) userdata;
+
+    // disconnect after the probe has been received is expected
+    if (!probe->received) {
+        probe->mqtt_error = result;
+        probe->failed = true;
+    }
+}
+
+static void multi_probe_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos) {
+    struct multi_probe *probe = (struct multi_probe *) userdata;
+
+    if (mid != probe->sub_mid) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &probe->suback_time);
+
+    probe->mqtt_error = mosquitto_publish(mosq, NULL, probe->cfg->topic, (int) strlen(probe->payload) + 1, (void *) probe->payload, probe->cfg->qos, false);
+    if (probe->mqtt_error != MOSQ_ERR_SUCCESS) {
+        probe->failed = true;
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &probe->send_time);
+}
+
+static void multi_probe_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg) {
+    struct multi_probe *probe = (struct multi_probe *) userdata;
+
+    // all probes share the topic, only our own payload counts
+    if ((msg->payloadlen != (int) strlen(probe->payload) + 1) || memcmp(msg->payload, (void *) probe->payload, msg->payloadlen)) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &probe->receive_time);
+    probe->received = true;
+    mosquitto_disconnect(mosq);
+}
+
+static int multi_probe_tick(void *userdata, const struct timespec *now) {
+    struct multi_probe_run *run = (struct multi_probe_run *) userdata;
+    size_t i;
+
+    for (i = 0; i < run->count; i++) {
+        if (!run->probes[i].received && !run->probes[i].failed) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int multi_probe_state(const struct configuration *cfg, const struct multi_probe *probe, double *rtt) {
+    if (!probe->received) {
+        return NAGIOS_CRITICAL;
+    }
+
+    *rtt = timespec2double_ms(get_delay(probe->send_time, probe->receive_time));
+    if (*rtt >= (double) cfg->critical) {
+        return NAGIOS_CRITICAL;
+    }
+    if (*rtt >= (double) cfg->warn) {
+        return NAGIOS_WARNING;
+    }
+    return NAGIOS_OK;
+}
+
+static const char *multi_probe_error(const struct multi_probe *probe, bool timed_out) {
+    if (probe->connect_result) {
+        return mosquitto_connack_string(probe->connect_result);
+    }
+    if (probe->failed) {
+        return mosquitto_strerror(probe->mqtt_error);
+    }
+    return timed_out ? "timeout" : "no response received";
+}
+
+static void multi_probe_print_phase(const char *name, const char *label, const struct timespec start, const struct timespec ts) {
+    if (!ts.tv_sec && !ts.tv_nsec) {
+        fprintf(stdout, " 'mqtt_%s[%s]'=U;;;0", name, label);
+    } else {
+        fprintf(stdout, " 'mqtt_%s[%s]'=%.3fms;;;0", name, label, timespec2double_ms(get_delay(start, ts)));
+    }
+}
+
+static int multi_probe_report(const struct configuration *cfg, struct multi_probe_run *run, bool timed_out) {
+    struct multi_probe *probe;
+    struct multi_probe *worst = NULL;
+    double rtt;
+    double worst_rtt = 0.0;
+    int worst_state = NAGIOS_OK;
+    int state;
+    size_t failed = 0;
+    size_t i;
+
+    for (i = 0; i < run->count; i++) {
+        probe = &run->probes[i];
+        // a failed path is always worse than a slow one
+        rtt = 1.0e+12;
+        state = multi_probe_state(cfg, probe, &rtt);
+        if (!probe->received) {
+            failed++;
+        }
+        if (!worst || (state > worst_state) || ((state == worst_state) && (rtt > worst_rtt))) {
+            worst = probe;
+            worst_state = state;
+            worst_rtt = rtt;
+        }
+    }
+
+    if (failed) {
+        fprintf(stdout, "%lu of %lu paths failed, %s: %s |", (unsigned long) failed, (unsigned long) run->count,
+                worst->target->label, multi_probe_error(worst, timed_out));
+    } else {
+        fprintf(stdout, "Response received on %lu paths, worst %.1fms via %s |", (unsigned long) run->count, worst_rtt, worst->target->label);
+    }
+
+    // mqtt_rtt is the worst path, so existing graphs keep working
+    if (failed) {
+        fprintf(stdout, " mqtt_rtt=U;%d;%d;0", cfg->warn, cfg->critical);
+    } else {
+        fprintf(stdout, " mqtt_rtt=%.3fms;%d;%d;0", worst_rtt, cfg->warn, cfg->critical);
+    }
+
+    for (i = 0; i < run->count; i++) {
+        probe = &run->probes[i];
+        multi_probe_print_phase("connack", probe->target->label, probe->start_time, probe->connack_time);
+        multi_probe_print_phase("suback", probe->target->label, probe->start_time, probe->suback_time);
+        if (probe->received) {
+            fprintf(stdout, " 'mqtt_rtt[%s]'=%.3fms;%d;%d;0", probe->target->label,
+                    timespec2double_ms(get_delay(probe->send_time, probe->receive_time)), cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, " 'mqtt_rtt[%s]'=U;%d;%d;0", probe->target->label, cfg->warn, cfg->critical);
+        }
+    }
+    fprintf(stdout, "\n");
+
+    // long output: one line per path
+    for (i = 0; i < run->count; i++) {
+        probe = &run->probes[i];
+        rtt = 0.0;
+        state = multi_probe_state(cfg, probe, &rtt);
+        if (probe->received) {
+            fprintf(stdout, "%s: %s, response received after %.1fms\n", probe->target->label,
+                    state == NAGIOS_OK ? "OK" : (state == NAGIOS_WARNING ? "WARNING" : "CRITICAL"), rtt);
+        } else {
+            fprintf(stdout, "%s: CRITICAL, %s\n", probe->target->label, multi_probe_error(probe, timed_out));
+        }
+    }
+
+    return worst_state;
+}
+
+int multi_probe_run(struct configuration *cfg, const struct multi_probe_target *targets, size_t count) {
+    struct multi_probe_run run;
+    struct multi_probe *probe;
+    char *mqttid;
+    int exit_code = NAGIOS_CRITICAL;
+    int rc;
+    size_t i;
+
+    memset((void *) &run, 0, sizeof(struct multi_probe_run));
+    run.count = count;
+    run.probes = (struct multi_probe *) calloc(count, sizeof(struct multi_probe));
+    run.handles = (struct mosquitto **) calloc(count, sizeof(struct mosquitto *));
+    if (!run.probes || !run.handles) {
+        fprintf(stdout, "Memory allocation failed | mqtt_rtt=U;%d;%d;0\n", cfg->warn, cfg->critical);
+        free(run.probes);
+        free(run.handles);
+        return NAGIOS_CRITICAL;
+    }
+
+    mosquitto_lib_init();
+
+    for (i = 0; i < count; i++) {
+        probe = &run.probes[i];
+        probe->cfg = cfg;
+        probe->target = &targets[i];
+
+        probe->payload = uuidgen();
+        mqttid = mqtt_client_id();
+        if (!probe->payload || !mqttid) {
+            free(mqttid);
+            fprintf(stdout, "Memory allocation failed | mqtt_rtt=U;%d;%d;0\n", cfg->warn, cfg->critical);
+            goto leave;
+        }
+
+        probe->handle = mqtt_new_handle(cfg, mqttid, true, (void *) probe);
+        free(mqttid);
+        if (!probe->handle) {
+            fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+            goto leave;
+        }
+        run.handles[i] = probe->handle;
+
+        // the broker is contacted by its address, so the host name in the server certificate can't match.
+        // The certificate chain is still verified against --ca/--cadir.
+        if (cfg->all_addresses && cfg->ssl && !cfg->psk) {
+            cfg->mqtt_error = mosquitto_tls_insecure_set(probe->handle, true);
+            if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+                fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+                goto leave;
+            }
+        }
+
+        mosquitto_connect_callback_set(probe->handle, multi_probe_connect_callback);
+        mosquitto_disconnect_callback_set(probe->handle, multi_probe_disconnect_callback);
+        mosquitto_subscribe_callback_set(probe->handle, multi_probe_subscribe_callback);
+        mosquitto_message_callback_set(probe->handle, multi_probe_message_callback);
+    }
+
+    // start all connections before entering the loop, so all paths are measured at the same time
+    for (i = 0; i < count; i++) {
+        probe = &run.probes[i];
+        clock_gettime(CLOCK_MONOTONIC, &probe->start_time);
+        probe->mqtt_error = mosquitto_connect_bind_async(probe->handle, probe->target->host, cfg->port, cfg->keep_alive, probe->target->bind);
+        if (probe->mqtt_error != MOSQ_ERR_SUCCESS) {
+            probe->failed = true;
+        }
+    }
+
+    rc = mqtt_loop_run(run.handles, run.count, cfg->timeout * 1000, 10, multi_probe_tick, (void *) &run);
+    exit_code = multi_probe_report(cfg, &run, rc == MQTT_LOOP_TIMEOUT);
+
+leave:
+    for (i = 0; i < count; i++) {
+        if (run.probes[i].handle) {
+            mosquitto_destroy(run.probes[i].handle);
+        }
+        if (run.probes[i].payload) {
+            free(run.probes[i].payload);
+        }
+    }
+    free(run.probes);
+    free(run.handles);
+    mosquitto_lib_cleanup();
+    return exit_code;
+}
+
+// Resolve host once, every distinct address becomes a target
+int multi_probe_resolve(const char *host, struct multi_probe_target **targets, size_t *count) {
+    struct addrinfo hints;
+    struct addrinfo *result;
+    struct addrinfo *ai;
+    struct multi_probe_target *new_targets;
+    char address[NI_MAXHOST];
+    size_t i;
+    int rc;
+
+    memset((void *) &hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    rc = getaddrinfo(host, NULL, &hints, &result);
+    if (rc != 0) {
+        fprintf(stderr, "Can't resolve %s: %s\n", host, gai_strerror(rc));
+        return -1;
+    }
+
+    for (ai = result; ai; ai = ai->ai_next) {
+        if (getnameinfo(ai->ai_addr, ai->ai_addrlen, address, sizeof(address), NULL, 0, NI_NUMERICHOST) != 0) {
+            continue;
+        }
+
+        for (i = 0; i < *count; i++) {
+            if (!strcmp((*targets)[i].host, address)) {
+                break;
+            }
+        }
+        if (i < *count) {
+            continue;
+        }
+
+        new_targets = (struct multi_probe_target *) realloc((void *) *targets, (*count + 1) * sizeof(struct multi_probe_target));
+        if (!new_targets) {
+            fprintf(stderr, "Unable to allocate memory for address list\n");
+            freeaddrinfo(result);
+            return -1;
+        }
+        *targets = new_targets;
+
+        memset((void *) &(*targets)[*count], 0, sizeof(struct multi_probe_target));
+        (*targets)[*count].host = strdup(address);
+        (*targets)[*count].label = strdup(address);
+        (*count)++;
+        if (!(*targets)[*count - 1].host || !(*targets)[*count - 1].label) {
+            fprintf(stderr, "Unable to allocate memory for address list\n");
+            freeaddrinfo(result);
+            return -1;
+        }
+    }
+
+    freeaddrinfo(result);
+
+    if (!*count) {
+        fprintf(stderr, "No usable address found for %s\n", host);
+        return -1;
+    }
+    return 0;
+}
+
+void multi_probe_free_targets(struct multi_probe_target *targets, size_t count) {
+    size_t i;
+
+    if (!targets) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (targets[i].host) {
+            free(targets[i].host);
+        }
+        if (targets[i].bind) {
+            free(targets[i].bind);
+        }
+        if (targets[i].label) {
+            free(targets[i].label);
+        }
+    }
+    free(targets);
+}
+
+// Every target is probed through every local address of the comma separated list binds,
+// numeric is set if the targets are resolved addresses instead of the host name
+static int multi_probe_bind_targets(const char *binds, bool numeric, const struct multi_probe_target *targets, size_t count, struct multi_probe_target **result, size_t *result_count) {
+    struct multi_probe_target *new_targets;
+    struct multi_probe_target *target;
+    char *copy;
+    char *token;
+    char *saveptr;
+    size_t label_len;
+    size_t i;
+
+    copy = strdup(binds);
+    if (!copy) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for bind address list\n", strlen(binds) + 1);
+        return -1;
+    }
+
+    for (token = strtok_r(copy, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        for (i = 0; i < count; i++) {
+            // an IPv4 source can't reach an IPv6 address and vice versa
+            if (numeric && ((strchr(targets[i].host, ':') != NULL) != (strchr(token, ':') != NULL))) {
+                continue;
+            }
+
+            new_targets = (struct multi_probe_target *) realloc((void *) *result, (*result_count + 1) * sizeof(struct multi_probe_target));
+            if (!new_targets) {
+                fprintf(stderr, "Unable to allocate memory for bind address list\n");
+                free(copy);
+                return -1;
+            }
+            *result = new_targets;
+            target = &(*result)[*result_count];
+            memset((void *) target, 0, sizeof(struct multi_probe_target));
+            (*result_count)++;
+
+            target->host = strdup(targets[i].host);
+            target->bind = strdup(token);
+
+            // the path is named by the source address, or <address>@<source> if all addresses are probed
+            label_len = strlen(targets[i].label) + strlen(token) + 2;
+            target->label = (char *) malloc(label_len);
+            if (!target->host || !target->bind || !target->label) {
+                fprintf(stderr, "Unable to allocate memory for bind address list\n");
+                free(copy);
+                return -1;
+            }
+            if (numeric) {
+                snprintf(target->label, label_len, "%s@%s", targets[i].label, token);
+            } else {
+                snprintf(target->label, label_len, "%s", token);
+            }
+        }
+    }
+
+    free(copy);
+
+    if (!*result_count) {
+        fprintf(stderr, "No usable combination of broker and bind addresses\n");
+        return -1;
+    }
+    return 0;
+}
+
+int multi_probe(struct configuration *cfg) {
+    struct multi_probe_target *targets = NULL;
+    struct multi_probe_target *paths = NULL;
+    size_t count = 0;
+    size_t path_count = 0;
+    int exit_code;
+
+    if (cfg->all_addresses) {
+        if (multi_probe_resolve(cfg->host, &targets, &count) != 0) {
+            fprintf(stdout, "Can't resolve %s | mqtt_rtt=U;%d;%d;0\n", cfg->host, cfg->warn, cfg->critical);
+            multi_probe_free_targets(targets, count);
+            return NAGIOS_CRITICAL;
+        }
+    } else {
+        targets = (struct multi_probe_target *) calloc(1, sizeof(struct multi_probe_target));
+        if (!targets) {
+            fprintf(stdout, "Memory allocation failed | mqtt_rtt=U;%d;%d;0\n", cfg->warn, cfg->critical);
+            return NAGIOS_CRITICAL;
+        }
+        count = 1;
+        targets[0].host = strdup(cfg->host);
+        targets[0].label = strdup(cfg->host);
+        if (!targets[0].host || !targets[0].label) {
+            fprintf(stdout, "Memory allocation failed | mqtt_rtt=U;%d;%d;0\n", cfg->warn, cfg->critical);
+            multi_probe_free_targets(targets, count);
+            return NAGIOS_CRITICAL;
+        }
+    }
+
+    if (cfg->bind) {
+        if (multi_probe_bind_targets(cfg->bind, cfg->all_addresses, targets, count, &paths, &path_count) != 0) {
+            fprintf(stdout, "Invalid bind address list %s | mqtt_rtt=U;%d;%d;0\n", cfg->bind, cfg->warn, cfg->critical);
+            multi_probe_free_targets(paths, path_count);
+            multi_probe_free_targets(targets, count);
+            return NAGIOS_CRITICAL;
+        }
+        exit_code = multi_probe_run(cfg, paths, path_count);
+        multi_probe_free_targets(paths, path_count);
+    } else {
+        exit_code = multi_probe_run(cfg, targets, count);
+    }
+
+    multi_probe_free_targets(targets, count);
+    return exit_code;
+}
+
@@ -0,0 +1,21 @@
+#ifndef __CHECK_MQTT_MULTI_PROBE_H__
+#define __CHECK_MQTT_MULTI_PROBE_H__
+
+#include <stddef.h>
+
+struct multi_probe_target {
+    // address or host name to connect to
+    char *host;
+    // local address to bind to, NULL to let the kernel choose
+    char *bind;
+    // name of the path in the output
+    char *label;
+};
+
+int multi_probe_resolve(const char *, struct multi_probe_target **, size_t *);
+void multi_probe_free_targets(struct multi_probe_target *, size_t);
+int multi_probe_run(struct configuration *, const struct multi_probe_target *, size_t);
+int multi_probe(struct configuration *);
+
+#endif /* __CHECK_MQTT_MULTI_PROBE_H__ */
+
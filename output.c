@@ -0,0 +1,339 @@
+#include "check_mqtt.h"
+#include "output.h"
+#include "sys_stats.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// large enough for all metrics including broker statistics and a long host name
+#define OUTPUT_BUFFER_SIZE 16384
+
+struct output_buffer {
+    char *data;
+    size_t size;
+    size_t len;
+    bool overflow;
+};
+
+// the result is formatted into this buffer and written with a single write()
+static char output_data[OUTPUT_BUFFER_SIZE];
+
+static const char *output_status[] = { "OK", "WARNING", "CRITICAL", "UNKNOWN" };
+
+static void output_append(struct output_buffer *buffer, const char *fmt, ...) {
+    va_list ap;
+    int rc;
+
+    if (buffer->overflow) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    rc = vsnprintf(buffer->data + buffer->len, buffer->size - buffer->len, fmt, ap);
+    va_end(ap);
+
+    if ((rc < 0) || ((size_t) rc >= buffer->size - buffer->len)) {
+        buffer->overflow = true;
+        return;
+    }
+    buffer->len += rc;
+}
+
+// label values (OpenMetrics) and strings (JSON) share the escaping of backslash, double quote and newline.
+// OpenMetrics has no escape for other control characters, they are replaced by '?'.
+static void output_append_escaped(struct output_buffer *buffer, const char *str, int format) {
+    for (; *str; str++) {
+        switch (*str) {
+            case '\\': {
+                           output_append(buffer, "\\\\");
+                           break;
+                       }
+            case '"': {
+                          output_append(buffer, "\\\"");
+                          break;
+                      }
+            case '\n': {
+                           output_append(buffer, "\\n");
+                           break;
+                       }
+            default: {
+                         if ((unsigned char) *str >= 0x20) {
+                             output_append(buffer, "%c", *str);
+                         } else if (format == OUTPUT_JSON) {
+                             output_append(buffer, "\\u%04x", (unsigned char) *str);
+                         } else {
+                             output_append(buffer, "?");
+                         }
+                         break;
+                     }
+        }
+    }
+}
+
+// seconds between two points in time of the probe, NAN if the later one has not been reached
+static double output_interval(const struct timespec start, const struct timespec end) {
+    if ((!start.tv_sec && !start.tv_nsec) || (!end.tv_sec && !end.tv_nsec)) {
+        return NAN;
+    }
+    return timespec2double_ms(get_delay(start, end)) / 1000.0;
+}
+
+static void output_metric(struct output_buffer *buffer, const char *labels, const char *name, const char *help, double value) {
+    output_append(buffer, "# HELP check_mqtt_%s %s\n# TYPE check_mqtt_%s gauge\ncheck_mqtt_%s%s ", name, help, name, name, labels);
+    if (isnan(value)) {
+        output_append(buffer, "NaN\n");
+    } else {
+        output_append(buffer, "%.9g\n", value);
+    }
+}
+
+static void output_json_value(struct output_buffer *buffer, const char *name, double value) {
+    if (isnan(value)) {
+        output_append(buffer, ",\"%s\":null", name);
+    } else {
+        output_append(buffer, ",\"%s\":%.9g", name, value);
+    }
+}
+
+static void output_openmetrics(struct output_buffer *buffer, const struct configuration *cfg, int result, int error, bool eof) {
+    const struct self_stat_values *v;
+    char labels[1024];
+    char tls_labels[1024];
+    struct output_buffer label_buffer;
+    const char *name;
+    char metric[64];
+    char help[128];
+    int i;
+
+    // {host="<host>",port="<port>",qos="<qos>",tls="<true|false>"}
+    label_buffer.data = labels;
+    label_buffer.size = sizeof(labels);
+    label_buffer.len = 0;
+    label_buffer.overflow = false;
+    output_append(&label_buffer, "{host=\"");
+    output_append_escaped(&label_buffer, cfg->host, OUTPUT_OPENMETRICS);
+    output_append(&label_buffer, "\",port=\"%u\",qos=\"%d\",tls=\"%s\"}", cfg->port, cfg->qos, (cfg->ssl || cfg->cert) ? "true" : "false");
+    if (label_buffer.overflow) {
+        buffer->overflow = true;
+        return;
+    }
+
+    output_metric(buffer, labels, "up", "1 if the probe message has been received", cfg->payload_received ? 1.0 : 0.0);
+    output_metric(buffer, labels, "status", "Nagios state of the check (0 OK, 1 WARNING, 2 CRITICAL, 3 UNKNOWN)", (double) result);
+    output_metric(buffer, labels, "error", "Internal error code of the probe, 0 if the probe finished", (double) error);
+    output_metric(buffer, labels, "mqtt_error", "libmosquitto error code of the last MQTT operation", (double) cfg->mqtt_error);
+    output_metric(buffer, labels, "connack_code", "Return code of the CONNACK packet", (double) cfg->mqtt_connect_result);
+    output_metric(buffer, labels, "start_timestamp_seconds", "Start of the probe in seconds since the epoch",
+            (cfg->start_wall_time.tv_sec || cfg->start_wall_time.tv_nsec) ? (double) cfg->start_wall_time.tv_sec + (double) cfg->start_wall_time.tv_nsec * 1.0e-09 : NAN);
+    output_metric(buffer, labels, "connect_seconds", "Time from connect to CONNACK", output_interval(cfg->start_time, cfg->connack_time));
+    output_metric(buffer, labels, "subscribe_seconds", "Time from CONNACK to SUBACK", output_interval(cfg->connack_time, cfg->suback_time));
+    output_metric(buffer, labels, "publish_seconds", "Time from SUBACK to publishing the probe message", output_interval(cfg->suback_time, cfg->send_time));
+    output_metric(buffer, labels, "rtt_seconds", "Round trip time of the probe message", cfg->payload_received ? output_interval(cfg->send_time, cfg->receive_time) : NAN);
+    output_metric(buffer, labels, "warning_threshold_seconds", "Warning threshold of the round trip time", (double) cfg->warn / 1000.0);
+    output_metric(buffer, labels, "critical_threshold_seconds", "Critical threshold of the round trip time", (double) cfg->critical / 1000.0);
+
+    if (cfg->sys_stats) {
+        for (i = 0; i < SYS_STAT_COUNT; i++) {
+            name = sys_stats_name(i);
+            snprintf(metric, sizeof(metric), "sys_%s", name);
+            snprintf(help, sizeof(help), "Broker statistic %s from $SYS/broker/", name);
+            output_metric(buffer, labels, metric, help, cfg->sys_stat_values[i].received ? cfg->sys_stat_values[i].value : NAN);
+        }
+    }
+
+    if (cfg->ssl || cfg->cert) {
+        output_metric(buffer, labels, "tls_handshake_seconds", "Duration of the TLS handshake", cfg->tls_handshake_done ? cfg->tls_handshake / 1000.0 : NAN);
+
+        // negotiated protocol and cipher as labels of an info metric
+        if (cfg->tls_handshake_done) {
+            label_buffer.data = tls_labels;
+            label_buffer.size = sizeof(tls_labels);
+            label_buffer.len = 0;
+            label_buffer.overflow = false;
+            output_append(&label_buffer, "%.*s,protocol=\"", (int) strlen(labels) - 1, labels);
+            output_append_escaped(&label_buffer, cfg->tls_protocol, OUTPUT_OPENMETRICS);
+            output_append(&label_buffer, "\",cipher=\"");
+            output_append_escaped(&label_buffer, cfg->tls_cipher, OUTPUT_OPENMETRICS);
+            output_append(&label_buffer, "\"}");
+            if (label_buffer.overflow) {
+                buffer->overflow = true;
+                return;
+            }
+            output_metric(buffer, tls_labels, "tls_info", "Negotiated TLS protocol and cipher", 1.0);
+        }
+    }
+
+    if (cfg->self_stats) {
+        v = &cfg->self_stat_values;
+        output_metric(buffer, labels, "self_user_cpu_seconds", "User CPU time of the check", v->collected ? v->user / 1000.0 : NAN);
+        output_metric(buffer, labels, "self_system_cpu_seconds", "System CPU time of the check", v->collected ? v->system / 1000.0 : NAN);
+        output_metric(buffer, labels, "self_voluntary_context_switches", "Voluntary context switches of the check", v->collected ? (double) v->voluntary_switches : NAN);
+        output_metric(buffer, labels, "self_involuntary_context_switches", "Involuntary context switches of the check", v->collected ? (double) v->involuntary_switches : NAN);
+        output_metric(buffer, labels, "self_max_rss_bytes", "Peak resident set size of the check", v->collected ? (double) v->max_rss * 1024.0 : NAN);
+        output_metric(buffer, labels, "self_setup_seconds", "Time from the start of the check until connecting", v->setup_reached ? v->setup / 1000.0 : NAN);
+    }
+
+    if (eof) {
+        output_append(buffer, "# EOF\n");
+    }
+}
+
+static void output_json(struct output_buffer *buffer, const struct configuration *cfg, int result, int error) {
+    const struct self_stat_values *v;
+    const char *mqtt_error;
+    int i;
+
+    mqtt_error = mosquitto_strerror(cfg->mqtt_error);
+
+    output_append(buffer, "{\"host\":\"");
+    output_append_escaped(buffer, cfg->host, OUTPUT_JSON);
+    output_append(buffer, "\",\"port\":%u,\"qos\":%d,\"tls\":%s", cfg->port, cfg->qos, (cfg->ssl || cfg->cert) ? "true" : "false");
+    output_append(buffer, ",\"status\":%d,\"status_text\":\"%s\"", result, ((result >= 0) && (result <= NAGIOS_UNKNOWN)) ? output_status[result] : "UNKNOWN");
+    output_append(buffer, ",\"up\":%s,\"error\":%d,\"mqtt_error\":%d,\"mqtt_error_text\":\"", cfg->payload_received ? "true" : "false", error, cfg->mqtt_error);
+    output_append_escaped(buffer, mqtt_error ? mqtt_error : "", OUTPUT_JSON);
+    output_append(buffer, "\",\"connack_code\":%d", cfg->mqtt_connect_result);
+    output_json_value(buffer, "start_timestamp_seconds",
+            (cfg->start_wall_time.tv_sec || cfg->start_wall_time.tv_nsec) ? (double) cfg->start_wall_time.tv_sec + (double) cfg->start_wall_time.tv_nsec * 1.0e-09 : NAN);
+    output_json_value(buffer, "connect_seconds", output_interval(cfg->start_time, cfg->connack_time));
+    output_json_value(buffer, "subscribe_seconds", output_interval(cfg->connack_time, cfg->suback_time));
+    output_json_value(buffer, "publish_seconds", output_interval(cfg->suback_time, cfg->send_time));
+    output_json_value(buffer, "rtt_seconds", cfg->payload_received ? output_interval(cfg->send_time, cfg->receive_time) : NAN);
+    if (cfg->ssl || cfg->cert) {
+        if (cfg->tls_handshake_done) {
+            output_append(buffer, ",\"tls_protocol\":\"");
+            output_append_escaped(buffer, cfg->tls_protocol, OUTPUT_JSON);
+            output_append(buffer, "\",\"tls_cipher\":\"");
+            output_append_escaped(buffer, cfg->tls_cipher, OUTPUT_JSON);
+            output_append(buffer, "\"");
+        } else {
+            output_append(buffer, ",\"tls_protocol\":null,\"tls_cipher\":null");
+        }
+        output_json_value(buffer, "tls_handshake_seconds", cfg->tls_handshake_done ? cfg->tls_handshake / 1000.0 : NAN);
+    }
+    output_json_value(buffer, "warning_threshold_seconds", (double) cfg->warn / 1000.0);
+    output_json_value(buffer, "critical_threshold_seconds", (double) cfg->critical / 1000.0);
+
+    if (cfg->sys_stats) {
+        output_append(buffer, ",\"sys\":{");
+        for (i = 0; i < SYS_STAT_COUNT; i++) {
+            if (cfg->sys_stat_values[i].received) {
+                output_append(buffer, "%s\"%s\":%.9g", i ? "," : "", sys_stats_name(i), cfg->sys_stat_values[i].value);
+            } else {
+                output_append(buffer, "%s\"%s\":null", i ? "," : "", sys_stats_name(i));
+            }
+        }
+        output_append(buffer, "}");
+    }
+
+    if (cfg->self_stats) {
+        v = &cfg->self_stat_values;
+        output_append(buffer, ",\"self\":{\"collected\":%s", v->collected ? "true" : "false");
+        output_json_value(buffer, "user_cpu_seconds", v->collected ? v->user / 1000.0 : NAN);
+        output_json_value(buffer, "system_cpu_seconds", v->collected ? v->system / 1000.0 : NAN);
+        output_json_value(buffer, "voluntary_context_switches", v->collected ? (double) v->voluntary_switches : NAN);
+        output_json_value(buffer, "involuntary_context_switches", v->collected ? (double) v->involuntary_switches : NAN);
+        output_json_value(buffer, "max_rss_bytes", v->collected ? (double) v->max_rss * 1024.0 : NAN);
+        output_json_value(buffer, "setup_seconds", v->setup_reached ? v->setup / 1000.0 : NAN);
+        output_append(buffer, "}");
+    }
+    output_append(buffer, "}\n");
+}
+
+static int output_write_all(int fd, const char *data, size_t len) {
+    ssize_t rc;
+
+    // a single write() for regular files and pipes, loop only if interrupted or short
+    while (len) {
+        rc = write(fd, data, len);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        data += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+int output_print(const struct configuration *cfg, int format, int result, int error) {
+    struct output_buffer buffer;
+
+    buffer.data = output_data;
+    buffer.size = sizeof(output_data);
+    buffer.len = 0;
+    buffer.overflow = false;
+
+    if (format == OUTPUT_JSON) {
+        output_json(&buffer, cfg, result, error);
+    } else {
+        output_openmetrics(&buffer, cfg, result, error, true);
+    }
+    if (buffer.overflow) {
+        return ENOBUFS;
+    }
+
+    fflush(stdout);
+    return output_write_all(STDOUT_FILENO, buffer.data, buffer.len);
+}
+
+// Write the metrics in the text format of the node_exporter textfile collector. The file is
+// written to a temporary file in the same directory and renamed, so the collector never reads
+// a partially written file.
+int output_textfile(const struct configuration *cfg, int result, int error) {
+    struct output_buffer buffer;
+    char *tmp;
+    size_t len;
+    int fd;
+    int rc;
+
+    buffer.data = output_data;
+    buffer.size = sizeof(output_data);
+    buffer.len = 0;
+    buffer.overflow = false;
+
+    // the textfile collector doesn't accept the OpenMetrics # EOF marker
+    output_openmetrics(&buffer, cfg, result, error, false);
+    if (buffer.overflow) {
+        return ENOBUFS;
+    }
+
+    // <file>.<pid>.tmp
+    len = strlen(cfg->textfile) + 32;
+    tmp = (char *) malloc(len);
+    if (!tmp) {
+        return ENOMEM;
+    }
+    snprintf(tmp, len, "%s.%ld.tmp", cfg->textfile, (long) getpid());
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        rc = errno;
+        free(tmp);
+        return rc;
+    }
+
+    rc = output_write_all(fd, buffer.data, buffer.len);
+    if (close(fd) == -1 && !rc) {
+        rc = errno;
+    }
+    if (!rc && (rename(tmp, cfg->textfile) == -1)) {
+        rc = errno;
+    }
+    if (rc) {
+        unlink(tmp);
+    }
+
+    free(tmp);
+    return rc;
+}
+
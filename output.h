@@ -0,0 +1,8 @@
+#ifndef __CHECK_MQTT_OUTPUT_H__
+#define __CHECK_MQTT_OUTPUT_H__
+
+int output_print(const struct configuration *, int, int, int);
+int output_textfile(const struct configuration *, int, int);
+
+#endif /* __CHECK_MQTT_OUTPUT_H__ */
+
@@ -0,0 +1,337 @@
+#include "check_mqtt.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#endif /* HAVE_OPENSSL */
+
+#include "ping_test.h"
+#include "mqtt_functions.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <errno.h>
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// debug messages of libmosquitto for the keepalive packets, see ping_log_callback
+#define PING_LOG_PINGREQ "sending PINGREQ"
+#define PING_LOG_PINGRESP "received PINGRESP"
+
+struct ping_test {
+    struct configuration *cfg;
+    struct mosquitto *handle;
+    bool connected;
+    bool failed;
+    int connect_result;
+    struct timespec connect_start;
+    double connect_time;
+    // PINGRESP packets to skip before the response to our own PINGREQ, e.g. answers
+    // to keepalive pings of the library or late answers to pings counted as lost
+    unsigned int skip_before;
+    unsigned int skip_after;
+    bool outstanding;
+    // a PINGREQ that couldn't be written completely, it is finished on the next tick
+    bool sending;
+    size_t written;
+    struct timespec ping_time;
+    double *rtt;
+    unsigned long sent;
+    unsigned long received;
+    unsigned long lost;
+    struct timespec start;
+    double next_ping_ms;
+};
+
+// libmosquitto has no API to send a PINGREQ on demand, but it logs every PINGREQ it sends
+// and every PINGRESP it receives. If a library version words these messages differently,
+// no PINGRESP is ever seen and the check reports all pings as lost.
+static void ping_log_callback(struct mosquitto *mosq, void *userdata, int level, const char *str) {
+    struct ping_test *test = (struct ping_test *) userdata;
+    struct timespec now;
+
+    if (level != MOSQ_LOG_DEBUG) {
+        return;
+    }
+
+    if (strstr(str, PING_LOG_PINGREQ)) {
+        if (test->outstanding) {
+            test->skip_after++;
+        } else {
+            test->skip_before++;
+        }
+        return;
+    }
+
+    if (!strstr(str, PING_LOG_PINGRESP)) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (test->skip_before) {
+        test->skip_before--;
+        return;
+    }
+    if (!test->outstanding) {
+        return;
+    }
+
+    test->rtt[test->received] = timespec2double_ms(get_delay(test->ping_time, now));
+    test->received++;
+    test->outstanding = false;
+    test->skip_before = test->skip_after;
+    test->skip_after = 0;
+}
+
+static void ping_connect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct ping_test *test = (struct ping_test *) userdata;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (result) {
+        test->connect_result = result;
+        test->failed = true;
+        return;
+    }
+    test->connect_time = timespec2double_ms(get_delay(test->connect_start, now));
+    test->connected = true;
+}
+
+static void ping_disconnect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct ping_test *test = (struct ping_test *) userdata;
+
+    test->cfg->mqtt_error = result;
+    test->failed = true;
+}
+
+// Write a PINGREQ packet (fixed header 0xc0, remaining length 0) directly to the connection.
+// This is only started if libmosquitto has no pending output, so the packet can't be interleaved
+// with a partially written packet of the library. The connection is non-blocking, if the packet
+// can't be written completely 1 is returned and the write is continued on the next call.
+static int ping_send(struct ping_test *test) {
+    static const unsigned char pingreq[2] = { 0xc0, 0x00 };
+    ssize_t rc;
+    int sock;
+#ifdef HAVE_OPENSSL
+    SSL *ssl;
+    int ssl_error;
+#endif /* HAVE_OPENSSL */
+
+#ifdef HAVE_OPENSSL
+    ssl = (SSL *) mosquitto_ssl_get(test->handle);
+    if (ssl) {
+        // OpenSSL writes the whole record or nothing, a retry must pass the same buffer again
+        rc = SSL_write(ssl, (const void *) pingreq, sizeof(pingreq));
+        if (rc <= 0) {
+            ssl_error = SSL_get_error(ssl, (int) rc);
+            if ((ssl_error == SSL_ERROR_WANT_WRITE) || (ssl_error == SSL_ERROR_WANT_READ)) {
+                return 1;
+            }
+            test->cfg->mqtt_error = MOSQ_ERR_TLS;
+            return -1;
+        }
+        return 0;
+    }
+#endif /* HAVE_OPENSSL */
+
+    sock = mosquitto_socket(test->handle);
+    if (sock == -1) {
+        test->cfg->mqtt_error = MOSQ_ERR_NO_CONN;
+        return -1;
+    }
+    rc = send(sock, (const void *) (pingreq + test->written), sizeof(pingreq) - test->written, MSG_NOSIGNAL);
+    if (rc == -1) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+            return 1;
+        }
+        test->cfg->mqtt_error = MOSQ_ERR_ERRNO;
+        return -1;
+    }
+    test->written += (size_t) rc;
+    if (test->written < sizeof(pingreq)) {
+        return 1;
+    }
+    test->written = 0;
+    return 0;
+}
+
+static int ping_connect_tick(void *userdata, const struct timespec *now) {
+    struct ping_test *test = (struct ping_test *) userdata;
+
+    if (test->failed) {
+        return -1;
+    }
+    return test->connected ? 1 : 0;
+}
+
+static int ping_run_tick(void *userdata, const struct timespec *now) {
+    struct ping_test *test = (struct ping_test *) userdata;
+    struct configuration *cfg = test->cfg;
+    double elapsed;
+    int rc;
+
+    if (test->failed) {
+        return -1;
+    }
+
+    // a ping without response within the critical threshold is lost, a late response is skipped
+    if (test->outstanding && (timespec2double_ms(get_delay(test->ping_time, *now)) >= (double) cfg->critical)) {
+        test->outstanding = false;
+        test->lost++;
+        test->skip_before += 1 + test->skip_after;
+        test->skip_after = 0;
+    }
+
+    if (test->outstanding) {
+        return 0;
+    }
+    if (test->sent == cfg->ping_count) {
+        return 1;
+    }
+
+    if (!test->sending) {
+        elapsed = timespec2double_ms(get_delay(test->start, *now));
+        if ((elapsed < test->next_ping_ms) || mosquitto_want_write(test->handle)) {
+            return 0;
+        }
+        test->sending = true;
+        test->next_ping_ms += (double) cfg->probe_interval;
+    }
+
+    rc = ping_send(test);
+    if (rc == -1) {
+        return -1;
+    }
+    if (rc == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &test->ping_time);
+        test->sending = false;
+        test->outstanding = true;
+        test->sent++;
+    }
+    return 0;
+}
+
+static int ping_report(struct ping_test *test) {
+    struct configuration *cfg = test->cfg;
+    double p50;
+    double p99;
+    int exit_code;
+
+    qsort((void *) test->rtt, test->received, sizeof(double), compare_double);
+    p50 = percentile(test->rtt, test->received, 50.0);
+    p99 = percentile(test->rtt, test->received, 99.0);
+
+    if (!test->received) {
+        exit_code = NAGIOS_CRITICAL;
+        fprintf(stdout, "No PINGRESP received for %lu PINGREQ packets |", test->sent);
+    } else {
+        if (p99 >= (double) cfg->critical) {
+            exit_code = NAGIOS_CRITICAL;
+        } else if ((p99 >= (double) cfg->warn) || test->lost) {
+            exit_code = NAGIOS_WARNING;
+        } else {
+            exit_code = NAGIOS_OK;
+        }
+        fprintf(stdout, "p99 ping RTT %.1fms, %lu of %lu PINGREQ packets answered |", p99, test->received, test->sent);
+    }
+
+    fprintf(stdout, " connect=%.3fms;;;0", test->connect_time);
+    if (test->received) {
+        fprintf(stdout, " ping_p50=%.3fms;;;0 ping_p99=%.3fms;%d;%d;0 ping_max=%.3fms;;;0",
+                p50, p99, cfg->warn, cfg->critical, test->rtt[test->received - 1]);
+    } else {
+        fprintf(stdout, " ping_p50=U;;;0 ping_p99=U;%d;%d;0 ping_max=U;;;0", cfg->warn, cfg->critical);
+    }
+    fprintf(stdout, " ping_loss=%lu;;;0;%lu\n", test->lost, test->sent);
+
+    return exit_code;
+}
+
+int ping_test(struct configuration *cfg) {
+    struct ping_test test;
+    char *mqttid;
+    int exit_code = NAGIOS_CRITICAL;
+    int rc;
+
+    memset((void *) &test, 0, sizeof(struct ping_test));
+    test.cfg = cfg;
+
+#ifndef HAVE_OPENSSL
+    if (cfg->ssl || cfg->cert) {
+        fprintf(stdout, "Ping mode over TLS requires OpenSSL support at build time | connect=U;;;0\n");
+        return NAGIOS_UNKNOWN;
+    }
+#endif /* HAVE_OPENSSL */
+
+    test.rtt = (double *) calloc(cfg->ping_count, sizeof(double));
+    if (!test.rtt) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for ping times\n", cfg->ping_count * sizeof(double));
+        return NAGIOS_CRITICAL;
+    }
+
+    mqttid = mqtt_client_id();
+    if (!mqttid) {
+        free(test.rtt);
+        return NAGIOS_CRITICAL;
+    }
+
+    mosquitto_lib_init();
+
+    test.handle = mqtt_new_handle(cfg, mqttid, true, (void *) &test);
+    free(mqttid);
+    if (!test.handle) {
+        fprintf(stdout, "%s | connect=U;;;0\n", mosquitto_strerror(cfg->mqtt_error));
+        goto leave;
+    }
+
+    mosquitto_connect_callback_set(test.handle, ping_connect_callback);
+    mosquitto_disconnect_callback_set(test.handle, ping_disconnect_callback);
+    mosquitto_log_callback_set(test.handle, ping_log_callback);
+
+    clock_gettime(CLOCK_MONOTONIC, &test.connect_start);
+    cfg->mqtt_error = mosquitto_connect_async(test.handle, cfg->host, cfg->port, cfg->keep_alive);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        fprintf(stdout, "%s | connect=U;;;0\n", mosquitto_strerror(cfg->mqtt_error));
+        goto leave;
+    }
+
+    // connecting and pinging share the timeout
+    rc = mqtt_loop_run(&test.handle, 1, remaining_ms(test.connect_start, cfg->timeout), 10, ping_connect_tick, (void *) &test);
+    if (rc != MQTT_LOOP_DONE) {
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds | connect=U;;;0\n", cfg->timeout);
+        } else if (test.connect_result) {
+            fprintf(stdout, "%s | connect=U;;;0\n", mosquitto_connack_string(test.connect_result));
+        } else {
+            fprintf(stdout, "%s | connect=U;;;0\n", mosquitto_strerror(cfg->mqtt_error));
+        }
+        goto leave;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &test.start);
+    rc = mqtt_loop_run(&test.handle, 1, remaining_ms(test.connect_start, cfg->timeout), 1, ping_run_tick, (void *) &test);
+    if (rc == MQTT_LOOP_TIMEOUT) {
+        fprintf(stdout, "Timeout after %d seconds, %lu PINGREQ packets sent | connect=%.3fms;;;0\n", cfg->timeout, test.sent, test.connect_time);
+        goto leave;
+    }
+    if (rc != MQTT_LOOP_DONE) {
+        fprintf(stdout, "%s after %lu PINGREQ packets | connect=%.3fms;;;0\n", mosquitto_strerror(cfg->mqtt_error), test.sent, test.connect_time);
+        goto leave;
+    }
+
+    exit_code = ping_report(&test);
+
+leave:
+    if (test.handle) {
+        mosquitto_destroy(test.handle);
+    }
+    free(test.rtt);
+    mosquitto_lib_cleanup();
+    return exit_code;
+}
+
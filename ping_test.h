@@ -0,0 +1,7 @@
+#ifndef __CHECK_MQTT_PING_TEST_H__
+#define __CHECK_MQTT_PING_TEST_H__
+
+int ping_test(struct configuration *);
+
+#endif /* __CHECK_MQTT_PING_TEST_H__ */
+
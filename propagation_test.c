@@ -0,0 +1,416 @@
+#include "check_mqtt.h"
+#include "propagation_test.h"
+#include "mqtt_functions.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// <uuid>:<phase>:<sequence>
+#define PROPAGATION_PAYLOAD_SIZE 64
+#define PROPAGATION_PHASE_WAIT 0
+#define PROPAGATION_PHASE_STEADY 1
+
+struct propagation_test;
+
+struct propagation_client {
+    struct propagation_test *test;
+    struct mosquitto *handle;
+    bool connected;
+    bool failed;
+};
+
+struct propagation_test {
+    struct configuration *cfg;
+    // index 0 subscribes, index 1 publishes. On a cluster both connections may end up on different nodes
+    struct propagation_client clients[2];
+    struct mosquitto *handles[2];
+    char *topic;
+    bool subscribe_sent;
+    bool subscribed;
+    struct timespec subscribe_time;
+    struct timespec suback_time;
+    struct timespec phase_start;
+    double next_probe_ms;
+    // propagation phase
+    struct timespec *wait_send_time;
+    unsigned long wait_max;
+    unsigned long wait_sent;
+    long first_seq;
+    double propagation;
+    double first_rtt;
+    // steady state
+    struct timespec *steady_send_time;
+    bool *steady_received;
+    double *rtt;
+    unsigned long steady_sent;
+    unsigned long steady_received_count;
+    int connect_result;
+};
+
+static void propagation_connect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct propagation_client *client = (struct propagation_client *) userdata;
+
+    if (result) {
+        client->test->connect_result = result;
+        client->failed = true;
+        return;
+    }
+    client->connected = true;
+}
+
+static void propagation_disconnect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct propagation_client *client = (struct propagation_client *) userdata;
+
+    client->test->cfg->mqtt_error = result;
+    client->failed = true;
+}
+
+static void propagation_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos) {
+    struct propagation_client *client = (struct propagation_client *) userdata;
+    struct propagation_test *test = client->test;
+
+    clock_gettime(CLOCK_MONOTONIC, &test->suback_time);
+
+    if ((qos_count > 0) && (granted_qos[0] == 0x80)) {
+        test->cfg->mqtt_error = MOSQ_ERR_ACL_DENIED;
+        client->failed = true;
+        return;
+    }
+    test->subscribed = true;
+}
+
+static void propagation_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg) {
+    struct propagation_client *client = (struct propagation_client *) userdata;
+    struct propagation_test *test = client->test;
+    struct timespec now;
+    char buffer[PROPAGATION_PAYLOAD_SIZE];
+    char *remain;
+    unsigned long phase;
+    unsigned long seq;
+    size_t prefix_len;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ((msg->payloadlen <= 0) || (msg->payloadlen >= PROPAGATION_PAYLOAD_SIZE)) {
+        return;
+    }
+    memcpy((void *) buffer, msg->payload, msg->payloadlen);
+    buffer[msg->payloadlen] = 0;
+
+    prefix_len = strlen(test->cfg->payload);
+    if (strncmp(buffer, test->cfg->payload, prefix_len) || (buffer[prefix_len] != ':')) {
+        return;
+    }
+    phase = strtoul(buffer + prefix_len + 1, &remain, 10);
+    if (*remain != ':') {
+        return;
+    }
+    seq = strtoul(remain + 1, &remain, 10);
+    if (*remain != 0) {
+        return;
+    }
+
+    if (phase == PROPAGATION_PHASE_WAIT) {
+        // the first delivered probe marks the point in time the subscription became active
+        if ((test->first_seq >= 0) || (seq >= test->wait_sent)) {
+            return;
+        }
+        test->first_seq = (long) seq;
+        test->propagation = timespec2double_ms(get_delay(test->suback_time, test->wait_send_time[seq]));
+        test->first_rtt = timespec2double_ms(get_delay(test->wait_send_time[seq], now));
+        return;
+    }
+
+    if ((phase != PROPAGATION_PHASE_STEADY) || (seq >= test->steady_sent) || test->steady_received[seq]) {
+        return;
+    }
+    test->steady_received[seq] = true;
+    test->rtt[test->steady_received_count] = timespec2double_ms(get_delay(test->steady_send_time[seq], now));
+    test->steady_received_count++;
+}
+
+static int propagation_subscribe_tick(void *userdata, const struct timespec *now) {
+    struct propagation_test *test = (struct propagation_test *) userdata;
+    struct configuration *cfg = test->cfg;
+
+    if (test->clients[0].failed || test->clients[1].failed) {
+        return -1;
+    }
+    if (!test->clients[0].connected || !test->clients[1].connected) {
+        return 0;
+    }
+
+    if (!test->subscribe_sent) {
+        cfg->mqtt_error = mosquitto_subscribe(test->clients[0].handle, NULL, test->topic, cfg->qos);
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &test->subscribe_time);
+        test->subscribe_sent = true;
+    }
+    return test->subscribed ? 1 : 0;
+}
+
+static int propagation_publish(struct propagation_test *test, int phase, unsigned long seq, struct timespec *send_time) {
+    struct configuration *cfg = test->cfg;
+    char payload[PROPAGATION_PAYLOAD_SIZE];
+    int len;
+
+    len = snprintf(payload, sizeof(payload), "%s:%d:%lu", cfg->payload, phase, seq);
+    cfg->mqtt_error = mosquitto_publish(test->clients[1].handle, NULL, test->topic, len, (void *) payload, cfg->qos, false);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, send_time);
+    return 0;
+}
+
+static int propagation_wait_tick(void *userdata, const struct timespec *now) {
+    struct propagation_test *test = (struct propagation_test *) userdata;
+
+    if (test->clients[0].failed || test->clients[1].failed) {
+        return -1;
+    }
+    if (test->first_seq >= 0) {
+        return 1;
+    }
+
+    // publish at a fast, fixed cadence until the first probe arrives
+    if ((test->wait_sent < test->wait_max) && (timespec2double_ms(get_delay(test->phase_start, *now)) >= test->next_probe_ms)) {
+        if (propagation_publish(test, PROPAGATION_PHASE_WAIT, test->wait_sent, &test->wait_send_time[test->wait_sent]) != 0) {
+            return -1;
+        }
+        test->wait_sent++;
+        test->next_probe_ms += (double) test->cfg->propagation_interval;
+    }
+    return 0;
+}
+
+static int propagation_steady_tick(void *userdata, const struct timespec *now) {
+    struct propagation_test *test = (struct propagation_test *) userdata;
+    struct configuration *cfg = test->cfg;
+    double elapsed;
+
+    if (test->clients[0].failed || test->clients[1].failed) {
+        return -1;
+    }
+
+    elapsed = timespec2double_ms(get_delay(test->phase_start, *now));
+
+    if (test->steady_sent < cfg->propagation_probes) {
+        if (elapsed >= test->next_probe_ms) {
+            if (propagation_publish(test, PROPAGATION_PHASE_STEADY, test->steady_sent, &test->steady_send_time[test->steady_sent]) != 0) {
+                return -1;
+            }
+            test->steady_sent++;
+            test->next_probe_ms += (double) cfg->probe_interval;
+        }
+        return 0;
+    }
+
+    // all probes have been published, wait for outstanding responses
+    if (test->steady_received_count == test->steady_sent) {
+        return 1;
+    }
+    return (elapsed >= test->next_probe_ms + (double) cfg->critical) ? 1 : 0;
+}
+
+static void propagation_free(struct propagation_test *test) {
+    size_t i;
+
+    for (i = 0; i < 2; i++) {
+        if (test->clients[i].handle) {
+            mosquitto_destroy(test->clients[i].handle);
+        }
+    }
+    if (test->topic) {
+        free(test->topic);
+    }
+    if (test->wait_send_time) {
+        free(test->wait_send_time);
+    }
+    if (test->steady_send_time) {
+        free(test->steady_send_time);
+    }
+    if (test->steady_received) {
+        free(test->steady_received);
+    }
+    if (test->rtt) {
+        free(test->rtt);
+    }
+}
+
+static int propagation_setup(struct propagation_test *test) {
+    struct configuration *cfg = test->cfg;
+    char *mqttid;
+    size_t topic_len;
+    size_t i;
+
+    // a probe is sent every --propagation-interval ms until the timeout
+    test->wait_max = (unsigned long) cfg->timeout * 1000 / cfg->propagation_interval + 1;
+    test->wait_send_time = (struct timespec *) calloc(test->wait_max, sizeof(struct timespec));
+    test->steady_send_time = (struct timespec *) calloc(cfg->propagation_probes, sizeof(struct timespec));
+    test->steady_received = (bool *) calloc(cfg->propagation_probes, sizeof(bool));
+    test->rtt = (double *) calloc(cfg->propagation_probes, sizeof(double));
+    if (!test->wait_send_time || !test->steady_send_time || !test->steady_received || !test->rtt) {
+        fprintf(stderr, "Unable to allocate memory for propagation test\n");
+        return -1;
+    }
+
+    // every run uses a new topic, so the subscription can't exist on any node yet: <topic>/propagation/<uuid>
+    topic_len = strlen(cfg->topic) + strlen(cfg->payload) + 14;
+    test->topic = (char *) malloc(topic_len);
+    if (!test->topic) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for propagation topic\n", topic_len);
+        return -1;
+    }
+    snprintf(test->topic, topic_len, "%s/propagation/%s", cfg->topic, cfg->payload);
+
+    for (i = 0; i < 2; i++) {
+        test->clients[i].test = test;
+
+        mqttid = mqtt_client_id();
+        if (!mqttid) {
+            return -1;
+        }
+        test->clients[i].handle = mqtt_new_handle(cfg, mqttid, true, (void *) &test->clients[i]);
+        free(mqttid);
+        if (!test->clients[i].handle) {
+            return -1;
+        }
+        test->handles[i] = test->clients[i].handle;
+
+        mosquitto_connect_callback_set(test->clients[i].handle, propagation_connect_callback);
+        mosquitto_disconnect_callback_set(test->clients[i].handle, propagation_disconnect_callback);
+
+        cfg->mqtt_error = mosquitto_connect_async(test->clients[i].handle, cfg->host, cfg->port, cfg->keep_alive);
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+    }
+
+    mosquitto_subscribe_callback_set(test->clients[0].handle, propagation_subscribe_callback);
+    mosquitto_message_callback_set(test->clients[0].handle, propagation_message_callback);
+
+    return 0;
+}
+
+static int propagation_state(struct configuration *cfg, double value) {
+    if (value >= (double) cfg->critical) {
+        return NAGIOS_CRITICAL;
+    }
+    if (value >= (double) cfg->warn) {
+        return NAGIOS_WARNING;
+    }
+    return NAGIOS_OK;
+}
+
+static int propagation_report(struct propagation_test *test) {
+    struct configuration *cfg = test->cfg;
+    double suback;
+    double p50;
+    double p99;
+    int exit_code;
+    int rtt_state;
+
+    suback = timespec2double_ms(get_delay(test->subscribe_time, test->suback_time));
+
+    qsort((void *) test->rtt, test->steady_received_count, sizeof(double), compare_double);
+    p50 = percentile(test->rtt, test->steady_received_count, 50.0);
+    p99 = percentile(test->rtt, test->steady_received_count, 99.0);
+
+    // the thresholds apply to the propagation delay and to the steady state round trip time
+    exit_code = propagation_state(cfg, test->propagation);
+    if (test->steady_received_count) {
+        rtt_state = propagation_state(cfg, p99);
+        if (rtt_state > exit_code) {
+            exit_code = rtt_state;
+        }
+    } else {
+        exit_code = NAGIOS_CRITICAL;
+    }
+
+    fprintf(stdout, "Subscription active %.1fms after SUBACK (%lu probes), steady state p99 RTT %.1fms |",
+            test->propagation, test->wait_sent, p99);
+    fprintf(stdout, " sub_propagation=%.3fms;%d;%d;0 suback=%.3fms;;;0 first_rtt=%.3fms;;;0 propagation_probes=%lu;;;0",
+            test->propagation, cfg->warn, cfg->critical, suback, test->first_rtt, test->wait_sent);
+    if (test->steady_received_count) {
+        fprintf(stdout, " mqtt_rtt=%.3fms;%d;%d;0 rtt_p50=%.3fms;;;0", p99, cfg->warn, cfg->critical, p50);
+    } else {
+        fprintf(stdout, " mqtt_rtt=U;%d;%d;0 rtt_p50=U;;;0", cfg->warn, cfg->critical);
+    }
+    fprintf(stdout, " probe_loss=%lu;;;0\n", test->steady_sent - test->steady_received_count);
+
+    return exit_code;
+}
+
+int propagation_test(struct configuration *cfg) {
+    struct propagation_test test;
+    struct timespec start;
+    int exit_code = NAGIOS_CRITICAL;
+    int rc;
+
+    memset((void *) &test, 0, sizeof(struct propagation_test));
+    test.cfg = cfg;
+    test.first_seq = -1;
+
+    // subscribing, waiting for the subscription and the steady state probes share the timeout
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mosquitto_lib_init();
+
+    if (propagation_setup(&test) != 0) {
+        fprintf(stdout, "%s | sub_propagation=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    rc = mqtt_loop_run(test.handles, 2, remaining_ms(start, cfg->timeout), 10, propagation_subscribe_tick, (void *) &test);
+    if (rc != MQTT_LOOP_DONE) {
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds while subscribing | sub_propagation=U;%d;%d;0\n", cfg->timeout, cfg->warn, cfg->critical);
+        } else if (test.connect_result) {
+            fprintf(stdout, "%s | sub_propagation=U;%d;%d;0\n", mosquitto_connack_string(test.connect_result), cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, "%s | sub_propagation=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        }
+        goto leave;
+    }
+
+    test.phase_start = test.suback_time;
+    test.next_probe_ms = 0.0;
+    rc = mqtt_loop_run(test.handles, 2, remaining_ms(start, cfg->timeout), 1, propagation_wait_tick, (void *) &test);
+    if (rc != MQTT_LOOP_DONE) {
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds, subscription not active after SUBACK, %lu probes lost | sub_propagation=U;%d;%d;0\n",
+                    cfg->timeout, test.wait_sent, cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, "%s | sub_propagation=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        }
+        goto leave;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &test.phase_start);
+    test.next_probe_ms = 0.0;
+    rc = mqtt_loop_run(test.handles, 2, remaining_ms(start, cfg->timeout), 1, propagation_steady_tick, (void *) &test);
+    if (rc == MQTT_LOOP_TIMEOUT) {
+        fprintf(stdout, "Timeout after %d seconds, %lu of %lu steady state probes sent | sub_propagation=U;%d;%d;0\n",
+                cfg->timeout, test.steady_sent, cfg->propagation_probes, cfg->warn, cfg->critical);
+        goto leave;
+    }
+    if (rc != MQTT_LOOP_DONE) {
+        fprintf(stdout, "%s | sub_propagation=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    exit_code = propagation_report(&test);
+
+leave:
+    propagation_free(&test);
+    mosquitto_lib_cleanup();
+    return exit_code;
+}
+
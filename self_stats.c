@@ -0,0 +1,57 @@
+#include "check_mqtt.h"
+#include "self_stats.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+
+static double timeval2double_ms(const struct timeval tv) {
+    return (double) tv.tv_sec * 1.0e+03 + (double) tv.tv_usec * 1.0e-03;
+}
+
+// Resource usage of the plugin itself, to separate the overhead of the poller from the latency of the broker.
+// cached is set if the result was taken from the cache, start_time is then the one of the process that probed the broker.
+void self_stats_collect(struct configuration *cfg, bool cached) {
+    struct rusage usage;
+    struct self_stat_values *v = &cfg->self_stat_values;
+
+    if (getrusage(RUSAGE_SELF, &usage) == -1) {
+        return;
+    }
+
+    v->user = timeval2double_ms(usage.ru_utime);
+    v->system = timeval2double_ms(usage.ru_stime);
+    v->voluntary_switches = usage.ru_nvcsw;
+    v->involuntary_switches = usage.ru_nivcsw;
+    // kilobytes on Linux and the BSDs
+    v->max_rss = usage.ru_maxrss;
+
+    // option parsing, UUID generation, library and TLS setup until mosquitto_connect is called
+    if (!cached && (cfg->start_time.tv_sec || cfg->start_time.tv_nsec)) {
+        v->setup = timespec2double_ms(get_delay(cfg->process_start, cfg->start_time));
+        v->setup_reached = true;
+    }
+
+    v->collected = true;
+}
+
+void self_stats_print_perfdata(const struct configuration *cfg, FILE *fd) {
+    const struct self_stat_values *v = &cfg->self_stat_values;
+
+    if (!v->collected) {
+        fprintf(fd, " self_user=U;;;0 self_sys=U;;;0 self_vcsw=U;;;0 self_ivcsw=U;;;0 self_maxrss=U;;;0 self_setup=U;;;0");
+        return;
+    }
+
+    fprintf(fd, " self_user=%.3fms;;;0 self_sys=%.3fms;;;0 self_vcsw=%ld;;;0 self_ivcsw=%ld;;;0 self_maxrss=%ldKB;;;0",
+            v->user, v->system, v->voluntary_switches, v->involuntary_switches, v->max_rss);
+    if (v->setup_reached) {
+        fprintf(fd, " self_setup=%.3fms;;;0", v->setup);
+    } else {
+        fprintf(fd, " self_setup=U;;;0");
+    }
+}
+
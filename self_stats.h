@@ -0,0 +1,10 @@
+#ifndef __CHECK_MQTT_SELF_STATS_H__
+#define __CHECK_MQTT_SELF_STATS_H__
+
+#include <stdio.h>
+
+void self_stats_collect(struct configuration *, bool);
+void self_stats_print_perfdata(const struct configuration *, FILE *);
+
+#endif /* __CHECK_MQTT_SELF_STATS_H__ */
+
@@ -0,0 +1,450 @@
+#include "check_mqtt.h"
+#include "session_test.h"
+#include "mqtt_functions.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// <uuid>:<sequence>
+#define SESSION_PAYLOAD_SIZE 64
+
+struct session_test;
+
+struct session_client {
+    struct session_test *test;
+    struct mosquitto *handle;
+    bool connected;
+    bool subscribed;
+    bool disconnected;
+    bool failed;
+    int session_present;
+};
+
+struct session_test {
+    struct configuration *cfg;
+    // the persistent session and the publisher filling its queue while it is offline
+    struct session_client session;
+    struct session_client publisher;
+    struct mosquitto *handles[2];
+    char *topic;
+    int qos;
+    unsigned long published;
+    unsigned long acked;
+    unsigned long received;
+    unsigned long duplicates;
+    bool *delivered;
+    bool subscribe_sent;
+    // all phases including the purge share the timeout
+    struct timespec start;
+    struct timespec reconnect;
+    double connack_ms;
+    double first_ms;
+    double last_ms;
+    int connect_result;
+};
+
+static void session_connect_callback(struct mosquitto *mosq, void *userdata, int result, int flags) {
+    struct session_client *client = (struct session_client *) userdata;
+    struct session_test *test = client->test;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (result) {
+        test->connect_result = result;
+        client->failed = true;
+        return;
+    }
+
+    client->connected = true;
+    client->disconnected = false;
+    // bit 0 of the CONNACK flags is the session present flag
+    client->session_present = flags & 0x01;
+
+    if (client == &test->session) {
+        test->connack_ms = timespec2double_ms(get_delay(test->reconnect, now));
+    }
+}
+
+static void session_disconnect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct session_client *client = (struct session_client *) userdata;
+
+    client->connected = false;
+    client->disconnected = true;
+
+    // result is 0 if the disconnect was requested by mosquitto_disconnect
+    if (result) {
+        client->test->cfg->mqtt_error = result;
+        client->failed = true;
+    }
+}
+
+static void session_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos) {
+    struct session_client *client = (struct session_client *) userdata;
+
+    if ((qos_count > 0) && (granted_qos[0] == 0x80)) {
+        client->test->cfg->mqtt_error = MOSQ_ERR_ACL_DENIED;
+        client->failed = true;
+        return;
+    }
+    client->subscribed = true;
+}
+
+static void session_publish_callback(struct mosquitto *mosq, void *userdata, int mid) {
+    struct session_client *client = (struct session_client *) userdata;
+
+    client->test->acked++;
+}
+
+static void session_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg) {
+    struct session_client *client = (struct session_client *) userdata;
+    struct session_test *test = client->test;
+    struct timespec now;
+    char buffer[SESSION_PAYLOAD_SIZE];
+    char *remain;
+    unsigned long seq;
+    size_t prefix_len;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ((msg->payloadlen <= 0) || (msg->payloadlen >= SESSION_PAYLOAD_SIZE)) {
+        return;
+    }
+    memcpy((void *) buffer, msg->payload, msg->payloadlen);
+    buffer[msg->payloadlen] = 0;
+
+    prefix_len = strlen(test->cfg->payload);
+    if (strncmp(buffer, test->cfg->payload, prefix_len) || (buffer[prefix_len] != ':')) {
+        return;
+    }
+    seq = strtoul(buffer + prefix_len + 1, &remain, 10);
+    if ((*remain != 0) || (seq >= test->published)) {
+        return;
+    }
+
+    // QoS 1 allows redelivery, count every message once
+    if (test->delivered[seq]) {
+        test->duplicates++;
+        return;
+    }
+    test->delivered[seq] = true;
+
+    test->last_ms = timespec2double_ms(get_delay(test->reconnect, now));
+    if (!test->received) {
+        test->first_ms = test->last_ms;
+    }
+    test->received++;
+}
+
+static int session_subscribe_tick(void *userdata, const struct timespec *now) {
+    struct session_test *test = (struct session_test *) userdata;
+    struct configuration *cfg = test->cfg;
+
+    if (test->session.failed || test->publisher.failed) {
+        return -1;
+    }
+
+    if (test->session.connected && !test->subscribe_sent) {
+        cfg->mqtt_error = mosquitto_subscribe(test->session.handle, NULL, test->topic, test->qos);
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+        test->subscribe_sent = true;
+    }
+    return (test->session.subscribed && test->publisher.connected) ? 1 : 0;
+}
+
+static int session_connected_tick(void *userdata, const struct timespec *now) {
+    struct session_test *test = (struct session_test *) userdata;
+
+    if (test->session.failed) {
+        return -1;
+    }
+    return test->session.connected ? 1 : 0;
+}
+
+static int session_disconnect_tick(void *userdata, const struct timespec *now) {
+    struct session_test *test = (struct session_test *) userdata;
+
+    if (test->session.failed || test->publisher.failed) {
+        return -1;
+    }
+    return test->session.disconnected ? 1 : 0;
+}
+
+static int session_publish_tick(void *userdata, const struct timespec *now) {
+    struct session_test *test = (struct session_test *) userdata;
+    struct configuration *cfg = test->cfg;
+    char payload[SESSION_PAYLOAD_SIZE];
+    int len;
+
+    if (test->publisher.failed) {
+        return -1;
+    }
+
+    // libmosquitto queues messages beyond its in-flight limit, so everything can be published at once
+    while (test->published < cfg->session_messages) {
+        len = snprintf(payload, sizeof(payload), "%s:%lu", cfg->payload, test->published);
+        cfg->mqtt_error = mosquitto_publish(test->publisher.handle, NULL, test->topic, len, (void *) payload, test->qos, false);
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+        test->published++;
+    }
+
+    return (test->acked == test->published) ? 1 : 0;
+}
+
+static int session_drain_tick(void *userdata, const struct timespec *now) {
+    struct session_test *test = (struct session_test *) userdata;
+
+    if (test->session.failed || test->publisher.failed) {
+        return -1;
+    }
+    if (test->session.connected && !test->session.session_present) {
+        return 1;
+    }
+    return (test->received == test->published) ? 1 : 0;
+}
+
+static void session_free(struct session_test *test) {
+    if (test->session.handle) {
+        mosquitto_destroy(test->session.handle);
+    }
+    if (test->publisher.handle) {
+        mosquitto_destroy(test->publisher.handle);
+    }
+    if (test->topic) {
+        free(test->topic);
+    }
+    if (test->delivered) {
+        free(test->delivered);
+    }
+}
+
+static int session_setup(struct session_test *test) {
+    struct configuration *cfg = test->cfg;
+    char *mqttid;
+    size_t topic_len;
+
+    test->delivered = (bool *) calloc(cfg->session_messages, sizeof(bool));
+    if (!test->delivered) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for message list\n", cfg->session_messages * sizeof(bool));
+        return -1;
+    }
+
+    // <topic>/session
+    topic_len = strlen(cfg->topic) + 9;
+    test->topic = (char *) malloc(topic_len);
+    if (!test->topic) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for session topic\n", topic_len);
+        return -1;
+    }
+    snprintf(test->topic, topic_len, "%s/session", cfg->topic);
+
+    // without --session-id a random client id is used, the session is removed again at the end
+    if (!cfg->session_id) {
+        cfg->session_id = mqtt_client_id();
+        if (!cfg->session_id) {
+            return -1;
+        }
+    }
+
+    test->session.test = test;
+    test->session.handle = mqtt_new_handle(cfg, cfg->session_id, false, (void *) &test->session);
+    if (!test->session.handle) {
+        return -1;
+    }
+
+    test->publisher.test = test;
+    mqttid = mqtt_client_id();
+    if (!mqttid) {
+        return -1;
+    }
+    test->publisher.handle = mqtt_new_handle(cfg, mqttid, true, (void *) &test->publisher);
+    free(mqttid);
+    if (!test->publisher.handle) {
+        return -1;
+    }
+
+    test->handles[0] = test->session.handle;
+    test->handles[1] = test->publisher.handle;
+
+    mosquitto_connect_with_flags_callback_set(test->session.handle, session_connect_callback);
+    mosquitto_disconnect_callback_set(test->session.handle, session_disconnect_callback);
+    mosquitto_subscribe_callback_set(test->session.handle, session_subscribe_callback);
+    mosquitto_message_callback_set(test->session.handle, session_message_callback);
+
+    mosquitto_connect_with_flags_callback_set(test->publisher.handle, session_connect_callback);
+    mosquitto_disconnect_callback_set(test->publisher.handle, session_disconnect_callback);
+    mosquitto_publish_callback_set(test->publisher.handle, session_publish_callback);
+
+    cfg->mqtt_error = mosquitto_connect_async(test->session.handle, cfg->host, cfg->port, cfg->keep_alive);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        return -1;
+    }
+    cfg->mqtt_error = mosquitto_connect_async(test->publisher.handle, cfg->host, cfg->port, cfg->keep_alive);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int session_report(struct session_test *test, bool timed_out) {
+    struct configuration *cfg = test->cfg;
+    double rate;
+    int exit_code;
+
+    // drain rate after the first queued message arrived
+    rate = (test->received > 1) && (test->last_ms > test->first_ms) ? (double) (test->received - 1) * 1000.0 / (test->last_ms - test->first_ms) : 0.0;
+
+    if (!test->session.connected) {
+        exit_code = NAGIOS_CRITICAL;
+        fprintf(stdout, "Timeout after %d seconds while resuming the session |", cfg->timeout);
+    } else if (!test->session.session_present) {
+        exit_code = NAGIOS_CRITICAL;
+        fprintf(stdout, "Session of client %s was not resumed by the broker |", cfg->session_id);
+    } else if (!test->received) {
+        exit_code = NAGIOS_CRITICAL;
+        fprintf(stdout, "None of %lu queued messages delivered after reconnect |", test->published);
+    } else if (timed_out || (test->received < test->published)) {
+        exit_code = NAGIOS_CRITICAL;
+        fprintf(stdout, "Timeout after %d seconds, %lu of %lu queued messages delivered |", cfg->timeout, test->received, test->published);
+    } else {
+        if (test->last_ms >= (double) cfg->critical) {
+            exit_code = NAGIOS_CRITICAL;
+        } else if (test->last_ms >= (double) cfg->warn) {
+            exit_code = NAGIOS_WARNING;
+        } else {
+            exit_code = NAGIOS_OK;
+        }
+        fprintf(stdout, "%lu queued messages drained in %.1fms (%.0f msg/s) |", test->received, test->last_ms, rate);
+    }
+
+    fprintf(stdout, " session_connack=%.3fms;;;0 session_present=%d;;;0;1", test->connack_ms, test->session.session_present);
+    if (test->received) {
+        fprintf(stdout, " first_message=%.3fms;;;0 drain=%.3fms;%d;%d;0", test->first_ms, test->last_ms, cfg->warn, cfg->critical);
+    } else {
+        fprintf(stdout, " first_message=U;;;0 drain=U;%d;%d;0", cfg->warn, cfg->critical);
+    }
+    fprintf(stdout, " drain_rate=%.1f;;;0 queued=%lu;;;0;%lu duplicates=%lu;;;0\n", rate, test->received, test->published, test->duplicates);
+
+    return exit_code;
+}
+
+// Remove the persistent session from the broker by connecting once with a clean session.
+// Only the time left of the timeout is used, after a timeout the session is left to expire on the broker.
+static void session_purge(struct session_test *test) {
+    struct configuration *cfg = test->cfg;
+
+    mosquitto_destroy(test->session.handle);
+    memset((void *) &test->session, 0, sizeof(struct session_client));
+    test->session.test = test;
+
+    test->session.handle = mqtt_new_handle(cfg, cfg->session_id, true, (void *) &test->session);
+    test->handles[0] = test->session.handle;
+    if (!test->session.handle) {
+        return;
+    }
+    mosquitto_connect_with_flags_callback_set(test->session.handle, session_connect_callback);
+    mosquitto_disconnect_callback_set(test->session.handle, session_disconnect_callback);
+
+    if (mosquitto_connect_async(test->session.handle, cfg->host, cfg->port, cfg->keep_alive) != MOSQ_ERR_SUCCESS) {
+        return;
+    }
+    if (mqtt_loop_run(test->handles, 1, remaining_ms(test->start, cfg->timeout), 10, session_connected_tick, (void *) test) != MQTT_LOOP_DONE) {
+        return;
+    }
+    if (mosquitto_disconnect(test->session.handle) == MOSQ_ERR_SUCCESS) {
+        mqtt_loop_run(test->handles, 1, remaining_ms(test->start, cfg->timeout), 10, session_disconnect_tick, (void *) test);
+    }
+}
+
+int session_test(struct configuration *cfg) {
+    struct session_test test;
+    bool created = false;
+    int exit_code = NAGIOS_CRITICAL;
+    int rc;
+
+    memset((void *) &test, 0, sizeof(struct session_test));
+    test.cfg = cfg;
+    // an offline queue only holds QoS 1 and 2 messages
+    test.qos = cfg->qos ? cfg->qos : 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &test.start);
+    mosquitto_lib_init();
+
+    if (session_setup(&test) != 0) {
+        fprintf(stdout, "%s | drain=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    // create the persistent session with its subscription
+    rc = mqtt_loop_run(test.handles, 2, remaining_ms(test.start, cfg->timeout), 10, session_subscribe_tick, (void *) &test);
+    if (rc != MQTT_LOOP_DONE) {
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds while creating the session | drain=U;%d;%d;0\n", cfg->timeout, cfg->warn, cfg->critical);
+        } else if (test.connect_result) {
+            fprintf(stdout, "%s | drain=U;%d;%d;0\n", mosquitto_connack_string(test.connect_result), cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, "%s | drain=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        }
+        goto leave;
+    }
+    created = true;
+
+    // take the session offline and fill its queue
+    cfg->mqtt_error = mosquitto_disconnect(test.session.handle);
+    if (cfg->mqtt_error == MOSQ_ERR_SUCCESS) {
+        rc = mqtt_loop_run(test.handles, 2, remaining_ms(test.start, cfg->timeout), 10, session_disconnect_tick, (void *) &test);
+    }
+    if ((cfg->mqtt_error != MOSQ_ERR_SUCCESS) || (rc != MQTT_LOOP_DONE)) {
+        fprintf(stdout, "Unable to disconnect the session: %s | drain=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    rc = mqtt_loop_run(test.handles, 2, remaining_ms(test.start, cfg->timeout), 1, session_publish_tick, (void *) &test);
+    if (rc != MQTT_LOOP_DONE) {
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds, %lu of %lu messages acknowledged | drain=U;%d;%d;0\n", cfg->timeout, test.acked, test.published, cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, "%s while publishing | drain=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        }
+        goto leave;
+    }
+
+    // resume the session, all times are relative to the reconnect
+    clock_gettime(CLOCK_MONOTONIC, &test.reconnect);
+    cfg->mqtt_error = mosquitto_connect_async(test.session.handle, cfg->host, cfg->port, cfg->keep_alive);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        fprintf(stdout, "%s | drain=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    rc = mqtt_loop_run(test.handles, 2, remaining_ms(test.start, cfg->timeout), 1, session_drain_tick, (void *) &test);
+    if (rc == MQTT_LOOP_ERROR) {
+        if (test.connect_result) {
+            fprintf(stdout, "%s | drain=U;%d;%d;0\n", mosquitto_connack_string(test.connect_result), cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, "%s after %lu queued messages | drain=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), test.received, cfg->warn, cfg->critical);
+        }
+        goto leave;
+    }
+
+    exit_code = session_report(&test, rc == MQTT_LOOP_TIMEOUT);
+
+leave:
+    if (created) {
+        session_purge(&test);
+    }
+    session_free(&test);
+    mosquitto_lib_cleanup();
+    return exit_code;
+}
+
@@ -0,0 +1,374 @@
+#include "check_mqtt.h"
+#include "shared_sub.h"
+#include "mqtt_functions.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// <uuid>:<sequence>
+#define SHARED_PAYLOAD_SIZE 64
+
+struct shared_test;
+
+struct shared_client {
+    struct shared_test *test;
+    struct mosquitto *handle;
+    bool subscribed;
+    bool failed;
+    unsigned long received;
+};
+
+struct shared_test {
+    struct configuration *cfg;
+    // index 0 is the publisher, the consumers follow
+    struct shared_client *clients;
+    struct mosquitto **handles;
+    size_t count;
+    char *filter;
+    struct timespec *send_time;
+    unsigned char *delivered;
+    double *latency;
+    unsigned long sent;
+    unsigned long received;
+    unsigned long duplicates;
+    struct timespec start;
+    double next_publish_ms;
+    int connect_result;
+};
+
+static void shared_connect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct shared_client *client = (struct shared_client *) userdata;
+    struct shared_test *test = client->test;
+
+    if (result) {
+        test->connect_result = result;
+        client->failed = true;
+        return;
+    }
+
+    // the publisher doesn't subscribe
+    if (client == &test->clients[0]) {
+        client->subscribed = true;
+        return;
+    }
+
+    test->cfg->mqtt_error = mosquitto_subscribe(mosq, NULL, test->filter, test->cfg->qos);
+    if (test->cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        client->failed = true;
+    }
+}
+
+static void shared_disconnect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct shared_client *client = (struct shared_client *) userdata;
+
+    client->test->cfg->mqtt_error = result;
+    client->failed = true;
+}
+
+static void shared_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos) {
+    struct shared_client *client = (struct shared_client *) userdata;
+
+    // 0x80 is the SUBACK failure code, e.g. if the broker doesn't support shared subscriptions
+    if ((qos_count > 0) && (granted_qos[0] == 0x80)) {
+        client->test->cfg->mqtt_error = MOSQ_ERR_NOT_SUPPORTED;
+        client->failed = true;
+        return;
+    }
+    client->subscribed = true;
+}
+
+static void shared_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg) {
+    struct shared_client *client = (struct shared_client *) userdata;
+    struct shared_test *test = client->test;
+    struct timespec now;
+    char buffer[SHARED_PAYLOAD_SIZE];
+    char *remain;
+    unsigned long seq;
+    size_t prefix_len;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ((msg->payloadlen <= 0) || (msg->payloadlen >= SHARED_PAYLOAD_SIZE)) {
+        return;
+    }
+    memcpy((void *) buffer, msg->payload, msg->payloadlen);
+    buffer[msg->payloadlen] = 0;
+
+    prefix_len = strlen(test->cfg->payload);
+    if (strncmp(buffer, test->cfg->payload, prefix_len) || (buffer[prefix_len] != ':')) {
+        return;
+    }
+    seq = strtoul(buffer + prefix_len + 1, &remain, 10);
+    if ((*remain != 0) || (seq >= test->sent)) {
+        return;
+    }
+
+    client->received++;
+
+    // a shared subscription delivers every message to exactly one member of the group
+    if (test->delivered[seq]) {
+        test->duplicates++;
+        return;
+    }
+    test->delivered[seq] = 1;
+    test->latency[test->received] = timespec2double_ms(get_delay(test->send_time[seq], now));
+    test->received++;
+}
+
+static int shared_connect_tick(void *userdata, const struct timespec *now) {
+    struct shared_test *test = (struct shared_test *) userdata;
+    bool done = true;
+    size_t i;
+
+    for (i = 0; i < test->count; i++) {
+        if (test->clients[i].failed) {
+            return -1;
+        }
+        if (!test->clients[i].subscribed) {
+            done = false;
+        }
+    }
+    return done ? 1 : 0;
+}
+
+static int shared_run_tick(void *userdata, const struct timespec *now) {
+    struct shared_test *test = (struct shared_test *) userdata;
+    struct configuration *cfg = test->cfg;
+    char payload[SHARED_PAYLOAD_SIZE];
+    double elapsed;
+    int len;
+    size_t i;
+
+    for (i = 0; i < test->count; i++) {
+        if (test->clients[i].failed) {
+            return -1;
+        }
+    }
+
+    elapsed = timespec2double_ms(get_delay(test->start, *now));
+
+    if (test->sent < cfg->shared_messages) {
+        if (elapsed >= test->next_publish_ms) {
+            len = snprintf(payload, sizeof(payload), "%s:%lu", cfg->payload, test->sent);
+            cfg->mqtt_error = mosquitto_publish(test->clients[0].handle, NULL, cfg->topic, len, (void *) payload, cfg->qos, false);
+            if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+                return -1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &test->send_time[test->sent]);
+            test->sent++;
+            test->next_publish_ms += (double) cfg->probe_interval;
+        }
+        return 0;
+    }
+
+    // all messages have been published, wait for outstanding deliveries
+    if (test->received == test->sent) {
+        return 1;
+    }
+    return (elapsed >= test->next_publish_ms + (double) cfg->critical) ? 1 : 0;
+}
+
+static void shared_free(struct shared_test *test) {
+    size_t i;
+
+    if (test->clients) {
+        for (i = 0; i < test->count; i++) {
+            if (test->clients[i].handle) {
+                mosquitto_destroy(test->clients[i].handle);
+            }
+        }
+        free(test->clients);
+    }
+    if (test->handles) {
+        free(test->handles);
+    }
+    if (test->filter) {
+        free(test->filter);
+    }
+    if (test->send_time) {
+        free(test->send_time);
+    }
+    if (test->delivered) {
+        free(test->delivered);
+    }
+    if (test->latency) {
+        free(test->latency);
+    }
+}
+
+static int shared_setup(struct shared_test *test) {
+    struct configuration *cfg = test->cfg;
+    char *mqttid;
+    size_t filter_len;
+    size_t i;
+
+    test->count = cfg->shared_consumers + 1;
+    test->clients = (struct shared_client *) calloc(test->count, sizeof(struct shared_client));
+    test->handles = (struct mosquitto **) calloc(test->count, sizeof(struct mosquitto *));
+    test->send_time = (struct timespec *) calloc(cfg->shared_messages, sizeof(struct timespec));
+    test->delivered = (unsigned char *) calloc(cfg->shared_messages, sizeof(unsigned char));
+    test->latency = (double *) calloc(cfg->shared_messages, sizeof(double));
+    if (!test->clients || !test->handles || !test->send_time || !test->delivered || !test->latency) {
+        fprintf(stderr, "Unable to allocate memory for shared subscription test\n");
+        return -1;
+    }
+
+    // $share/<group>/<topic>
+    filter_len = strlen(cfg->shared_group) + strlen(cfg->topic) + 9;
+    test->filter = (char *) malloc(filter_len);
+    if (!test->filter) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for subscription filter\n", filter_len);
+        return -1;
+    }
+    snprintf(test->filter, filter_len, "$share/%s/%s", cfg->shared_group, cfg->topic);
+
+    for (i = 0; i < test->count; i++) {
+        test->clients[i].test = test;
+
+        mqttid = mqtt_client_id();
+        if (!mqttid) {
+            return -1;
+        }
+        test->clients[i].handle = mqtt_new_handle(cfg, mqttid, true, (void *) &test->clients[i]);
+        free(mqttid);
+        if (!test->clients[i].handle) {
+            return -1;
+        }
+        test->handles[i] = test->clients[i].handle;
+
+        mosquitto_connect_callback_set(test->clients[i].handle, shared_connect_callback);
+        mosquitto_disconnect_callback_set(test->clients[i].handle, shared_disconnect_callback);
+        mosquitto_subscribe_callback_set(test->clients[i].handle, shared_subscribe_callback);
+        mosquitto_message_callback_set(test->clients[i].handle, shared_message_callback);
+
+        cfg->mqtt_error = mosquitto_connect_async(test->clients[i].handle, cfg->host, cfg->port, cfg->keep_alive);
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int shared_report(struct shared_test *test) {
+    struct configuration *cfg = test->cfg;
+    unsigned long min = 0;
+    unsigned long max = 0;
+    unsigned long lost;
+    double mean;
+    double skew;
+    double p50;
+    double p99;
+    int exit_code;
+    size_t i;
+
+    for (i = 1; i < test->count; i++) {
+        if ((i == 1) || (test->clients[i].received < min)) {
+            min = test->clients[i].received;
+        }
+        if (test->clients[i].received > max) {
+            max = test->clients[i].received;
+        }
+    }
+
+    // skew is the share of the busiest consumer relative to an even distribution, 1.0 is perfectly even
+    mean = (double) test->received / (double) cfg->shared_consumers;
+    skew = mean > 0.0 ? (double) max / mean : 0.0;
+    lost = test->sent - test->received;
+
+    qsort((void *) test->latency, test->received, sizeof(double), compare_double);
+    p50 = percentile(test->latency, test->received, 50.0);
+    p99 = percentile(test->latency, test->received, 99.0);
+
+    if (!test->received) {
+        exit_code = NAGIOS_CRITICAL;
+        fprintf(stdout, "No message received by the shared subscription group |");
+    } else {
+        if (p99 >= (double) cfg->critical) {
+            exit_code = NAGIOS_CRITICAL;
+        } else if ((p99 >= (double) cfg->warn) || lost || test->duplicates) {
+            exit_code = NAGIOS_WARNING;
+        } else {
+            exit_code = NAGIOS_OK;
+        }
+        fprintf(stdout, "%lu of %lu messages delivered to %u consumers, skew %.2f, p99 %.1fms |",
+                test->received, test->sent, cfg->shared_consumers, skew, p99);
+    }
+
+    if (test->received) {
+        fprintf(stdout, " delivery_p50=%.3fms;;;0 delivery_p99=%.3fms;%d;%d;0 delivery_p999=%.3fms;;;0 delivery_max=%.3fms;;;0",
+                p50, p99, cfg->warn, cfg->critical, percentile(test->latency, test->received, 99.9), test->latency[test->received - 1]);
+    } else {
+        fprintf(stdout, " delivery_p50=U;;;0 delivery_p99=U;%d;%d;0 delivery_p999=U;;;0 delivery_max=U;;;0", cfg->warn, cfg->critical);
+    }
+    fprintf(stdout, " skew=%.3f;;;0 lost=%lu;;;0 duplicates=%lu;;;0", skew, lost, test->duplicates);
+    for (i = 1; i < test->count; i++) {
+        fprintf(stdout, " consumer_%lu=%lu;;;0", (unsigned long) i, test->clients[i].received);
+    }
+    fprintf(stdout, "\n");
+
+    // long output: distribution over the consumers
+    for (i = 1; i < test->count; i++) {
+        fprintf(stdout, "consumer %lu: %lu messages (%.1f%%)\n", (unsigned long) i, test->clients[i].received,
+                test->received ? 100.0 * (double) test->clients[i].received / (double) test->received : 0.0);
+    }
+    fprintf(stdout, "min %lu, max %lu, mean %.1f messages per consumer\n", min, max, mean);
+
+    return exit_code;
+}
+
+int shared_subscription_test(struct configuration *cfg) {
+    struct shared_test test;
+    struct timespec start;
+    int exit_code = NAGIOS_CRITICAL;
+    int rc;
+
+    memset((void *) &test, 0, sizeof(struct shared_test));
+    test.cfg = cfg;
+
+    // subscribing and the distribution of the messages share the timeout
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    mosquitto_lib_init();
+
+    if (shared_setup(&test) != 0) {
+        fprintf(stdout, "%s | delivery_p99=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    rc = mqtt_loop_run(test.handles, test.count, remaining_ms(start, cfg->timeout), 10, shared_connect_tick, (void *) &test);
+    if (rc != MQTT_LOOP_DONE) {
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds while subscribing | delivery_p99=U;%d;%d;0\n", cfg->timeout, cfg->warn, cfg->critical);
+        } else if (test.connect_result) {
+            fprintf(stdout, "%s | delivery_p99=U;%d;%d;0\n", mosquitto_connack_string(test.connect_result), cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, "%s | delivery_p99=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        }
+        goto leave;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &test.start);
+    rc = mqtt_loop_run(test.handles, test.count, remaining_ms(start, cfg->timeout), 1, shared_run_tick, (void *) &test);
+    if (rc == MQTT_LOOP_TIMEOUT) {
+        fprintf(stdout, "Timeout after %d seconds, %lu messages published | delivery_p99=U;%d;%d;0\n", cfg->timeout, test.sent, cfg->warn, cfg->critical);
+        goto leave;
+    }
+    if (rc != MQTT_LOOP_DONE) {
+        fprintf(stdout, "Connection lost after %lu messages: %s | delivery_p99=U;%d;%d;0\n", test.sent, mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    exit_code = shared_report(&test);
+
+leave:
+    shared_free(&test);
+    mosquitto_lib_cleanup();
+    return exit_code;
+}
+
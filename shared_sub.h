@@ -0,0 +1,7 @@
+#ifndef __CHECK_MQTT_SHARED_SUB_H__
+#define __CHECK_MQTT_SHARED_SUB_H__
+
+int shared_subscription_test(struct configuration *);
+
+#endif /* __CHECK_MQTT_SHARED_SUB_H__ */
+
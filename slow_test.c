@@ -0,0 +1,512 @@
+#include "check_mqtt.h"
+#include "slow_test.h"
+#include "mqtt_functions.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// <uuid>:<sequence>
+#define SLOW_PAYLOAD_SIZE 64
+#define SLOW_SUBSCRIBER 0
+#define SLOW_PUBLISHER 1
+// messages are published round robin with QoS 0, 1 and 2, the sequence number modulo 3 is the QoS
+#define SLOW_QOS_LEVELS 3
+// the drain ends if no message has been received for this long
+#define SLOW_DRAIN_QUIET_MS 1000.0
+// receive buffer of the slow subscriber, so the broker notices the slow reads early
+#define SLOW_RCVBUF 4096
+
+struct slow_test;
+
+struct slow_client {
+    struct slow_test *test;
+    struct mosquitto *handle;
+    bool connected;
+    bool failed;
+};
+
+struct slow_test {
+    struct configuration *cfg;
+    struct slow_client clients[2];
+    struct mosquitto *handles[2];
+    char *topic;
+    char *topic_filter;
+    bool subscribe_sent;
+    bool subscribed;
+    int granted_qos;
+    int connect_result;
+    struct timespec start;
+    double next_publish_ms;
+    double next_read_ms;
+    bool draining;
+    double stream_end_ms;
+    double last_receive_ms;
+    // per message
+    double *lag;
+    bool *received;
+    unsigned long *backlog;
+    double *send_ms;
+    unsigned long sent;
+    unsigned long received_count;
+    unsigned long backlog_max;
+    unsigned long sent_qos[SLOW_QOS_LEVELS];
+    unsigned long received_qos[SLOW_QOS_LEVELS];
+    // linear regression of the delivery lag over the send time while the subscriber reads slowly
+    unsigned long slow_count;
+    double sum_x;
+    double sum_y;
+    double sum_xy;
+    double sum_xx;
+    // the broker closed the connection of the slow subscriber
+    bool disconnected;
+    double disconnect_ms;
+    unsigned long disconnect_received;
+};
+
+static void slow_connect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct slow_client *client = (struct slow_client *) userdata;
+
+    if (result) {
+        client->test->connect_result = result;
+        client->failed = true;
+        return;
+    }
+    client->connected = true;
+}
+
+static void slow_disconnect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct slow_client *client = (struct slow_client *) userdata;
+    struct slow_test *test = client->test;
+    struct timespec now;
+
+    // losing the slow subscriber after the subscription is a result, not an error
+    if ((client == &test->clients[SLOW_SUBSCRIBER]) && test->subscribed) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        test->disconnected = true;
+        test->disconnect_ms = timespec2double_ms(get_delay(test->start, now));
+        test->disconnect_received = test->received_count;
+        return;
+    }
+
+    test->cfg->mqtt_error = result;
+    client->failed = true;
+}
+
+static void slow_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos) {
+    struct slow_client *client = (struct slow_client *) userdata;
+    struct slow_test *test = client->test;
+
+    if ((qos_count > 0) && (granted_qos[0] == 0x80)) {
+        test->cfg->mqtt_error = MOSQ_ERR_ACL_DENIED;
+        client->failed = true;
+        return;
+    }
+    test->granted_qos = qos_count > 0 ? granted_qos[0] : 0;
+    test->subscribed = true;
+}
+
+static void slow_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg) {
+    struct slow_client *client = (struct slow_client *) userdata;
+    struct slow_test *test = client->test;
+    struct timespec now;
+    char buffer[SLOW_PAYLOAD_SIZE];
+    char *remain;
+    unsigned long seq;
+    size_t prefix_len;
+    double now_ms;
+    double lag;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ((msg->payloadlen <= 0) || (msg->payloadlen >= SLOW_PAYLOAD_SIZE)) {
+        return;
+    }
+    memcpy((void *) buffer, msg->payload, msg->payloadlen);
+    buffer[msg->payloadlen] = 0;
+
+    prefix_len = strlen(test->cfg->payload);
+    if (strncmp(buffer, test->cfg->payload, prefix_len) || (buffer[prefix_len] != ':')) {
+        return;
+    }
+    seq = strtoul(buffer + prefix_len + 1, &remain, 10);
+    if ((*remain != 0) || (seq >= test->sent) || test->received[seq]) {
+        return;
+    }
+
+    now_ms = timespec2double_ms(get_delay(test->start, now));
+    lag = now_ms - test->send_ms[seq];
+
+    test->received[seq] = true;
+    test->lag[test->received_count] = lag;
+    test->received_count++;
+    test->received_qos[seq % SLOW_QOS_LEVELS]++;
+    test->last_receive_ms = now_ms;
+
+    if (!test->draining) {
+        test->slow_count++;
+        test->sum_x += test->send_ms[seq] / 1000.0;
+        test->sum_y += lag;
+        test->sum_xy += test->send_ms[seq] / 1000.0 * lag;
+        test->sum_xx += test->send_ms[seq] / 1000.0 * test->send_ms[seq] / 1000.0;
+    }
+}
+
+static int slow_subscribe_tick(void *userdata, const struct timespec *now) {
+    struct slow_test *test = (struct slow_test *) userdata;
+    struct configuration *cfg = test->cfg;
+
+    if (test->clients[SLOW_SUBSCRIBER].failed || test->clients[SLOW_PUBLISHER].failed) {
+        return -1;
+    }
+    if (!test->clients[SLOW_SUBSCRIBER].connected || !test->clients[SLOW_PUBLISHER].connected) {
+        return 0;
+    }
+
+    if (!test->subscribe_sent) {
+        cfg->mqtt_error = mosquitto_subscribe(test->clients[SLOW_SUBSCRIBER].handle, NULL, test->topic_filter, 2);
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+        test->subscribe_sent = true;
+    }
+    return test->subscribed ? 1 : 0;
+}
+
+static int slow_publish(struct slow_test *test, double elapsed) {
+    struct configuration *cfg = test->cfg;
+    char payload[SLOW_PAYLOAD_SIZE];
+    unsigned long seq = test->sent;
+    int qos = (int) (seq % SLOW_QOS_LEVELS);
+    int len;
+
+    // the topic ends in the QoS of the message: <topic>/slow/<uuid>/<qos>
+    test->topic[strlen(test->topic) - 1] = '0' + qos;
+
+    len = snprintf(payload, sizeof(payload), "%s:%lu", cfg->payload, seq);
+    cfg->mqtt_error = mosquitto_publish(test->clients[SLOW_PUBLISHER].handle, NULL, test->topic, len, (void *) payload, qos, false);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        return -1;
+    }
+
+    test->send_ms[seq] = elapsed;
+    test->backlog[seq] = seq - test->received_count;
+    if (test->backlog[seq] > test->backlog_max) {
+        test->backlog_max = test->backlog[seq];
+    }
+    test->sent_qos[qos]++;
+    test->sent++;
+    return 0;
+}
+
+// The subscriber is not part of the poll loop while the messages are streamed, its socket is only
+// read --slow-read-rate times per second. Outgoing packets (acknowledgements, PINGREQ) are still
+// sent immediately, so the broker sees a live but slow client.
+static void slow_consume(struct slow_test *test, double elapsed) {
+    struct mosquitto *handle = test->clients[SLOW_SUBSCRIBER].handle;
+
+    while (!test->disconnected && (elapsed >= test->next_read_ms)) {
+        mosquitto_loop_read(handle, 1);
+        test->next_read_ms += 1000.0 / (double) test->cfg->slow_read_rate;
+    }
+
+    if (test->disconnected || (mosquitto_socket(handle) == -1)) {
+        return;
+    }
+    if (mosquitto_want_write(handle)) {
+        mosquitto_loop_write(handle, 1);
+    }
+    mosquitto_loop_misc(handle);
+}
+
+static int slow_stream_tick(void *userdata, const struct timespec *now) {
+    struct slow_test *test = (struct slow_test *) userdata;
+    struct configuration *cfg = test->cfg;
+    double elapsed;
+
+    if (test->clients[SLOW_PUBLISHER].failed) {
+        return -1;
+    }
+
+    elapsed = timespec2double_ms(get_delay(test->start, *now));
+
+    while ((test->sent < cfg->slow_messages) && (elapsed >= test->next_publish_ms)) {
+        if (slow_publish(test, elapsed) != 0) {
+            return -1;
+        }
+        test->next_publish_ms += 1000.0 / (double) cfg->slow_rate;
+    }
+
+    slow_consume(test, elapsed);
+
+    if (test->sent == cfg->slow_messages) {
+        test->stream_end_ms = elapsed;
+        return 1;
+    }
+    return 0;
+}
+
+static int slow_drain_tick(void *userdata, const struct timespec *now) {
+    struct slow_test *test = (struct slow_test *) userdata;
+    double elapsed;
+
+    if (test->clients[SLOW_PUBLISHER].failed) {
+        return -1;
+    }
+    if (test->disconnected || (test->received_count == test->sent)) {
+        return 1;
+    }
+
+    elapsed = timespec2double_ms(get_delay(test->start, *now));
+    if (test->last_receive_ms < test->stream_end_ms) {
+        return (elapsed - test->stream_end_ms >= SLOW_DRAIN_QUIET_MS) ? 1 : 0;
+    }
+    return (elapsed - test->last_receive_ms >= SLOW_DRAIN_QUIET_MS) ? 1 : 0;
+}
+
+static void slow_free(struct slow_test *test) {
+    size_t i;
+
+    for (i = 0; i < 2; i++) {
+        if (test->clients[i].handle) {
+            mosquitto_destroy(test->clients[i].handle);
+        }
+    }
+    if (test->topic) {
+        free(test->topic);
+    }
+    if (test->topic_filter) {
+        free(test->topic_filter);
+    }
+    if (test->lag) {
+        free(test->lag);
+    }
+    if (test->received) {
+        free(test->received);
+    }
+    if (test->backlog) {
+        free(test->backlog);
+    }
+    if (test->send_ms) {
+        free(test->send_ms);
+    }
+}
+
+static int slow_setup(struct slow_test *test) {
+    struct configuration *cfg = test->cfg;
+    char *mqttid;
+    size_t topic_len;
+    size_t i;
+
+    test->lag = (double *) calloc(cfg->slow_messages, sizeof(double));
+    test->received = (bool *) calloc(cfg->slow_messages, sizeof(bool));
+    test->backlog = (unsigned long *) calloc(cfg->slow_messages, sizeof(unsigned long));
+    test->send_ms = (double *) calloc(cfg->slow_messages, sizeof(double));
+    if (!test->lag || !test->received || !test->backlog || !test->send_ms) {
+        fprintf(stderr, "Unable to allocate memory for slow consumer test\n");
+        return -1;
+    }
+
+    // <topic>/slow/<uuid>/<qos> and <topic>/slow/<uuid>/+
+    topic_len = strlen(cfg->topic) + strlen(cfg->payload) + 9;
+    test->topic = (char *) malloc(topic_len);
+    test->topic_filter = (char *) malloc(topic_len);
+    if (!test->topic || !test->topic_filter) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for slow consumer topic\n", topic_len);
+        return -1;
+    }
+    snprintf(test->topic, topic_len, "%s/slow/%s/0", cfg->topic, cfg->payload);
+    snprintf(test->topic_filter, topic_len, "%s/slow/%s/+", cfg->topic, cfg->payload);
+
+    for (i = 0; i < 2; i++) {
+        test->clients[i].test = test;
+
+        mqttid = mqtt_client_id();
+        if (!mqttid) {
+            return -1;
+        }
+        test->clients[i].handle = mqtt_new_handle(cfg, mqttid, true, (void *) &test->clients[i]);
+        free(mqttid);
+        if (!test->clients[i].handle) {
+            return -1;
+        }
+        test->handles[i] = test->clients[i].handle;
+
+        mosquitto_connect_callback_set(test->clients[i].handle, slow_connect_callback);
+        mosquitto_disconnect_callback_set(test->clients[i].handle, slow_disconnect_callback);
+
+        cfg->mqtt_error = mosquitto_connect_async(test->clients[i].handle, cfg->host, cfg->port, cfg->keep_alive);
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+    }
+
+    mosquitto_subscribe_callback_set(test->clients[SLOW_SUBSCRIBER].handle, slow_subscribe_callback);
+    mosquitto_message_callback_set(test->clients[SLOW_SUBSCRIBER].handle, slow_message_callback);
+
+    // the publisher must not queue messages itself, every message goes to the broker right away
+    mosquitto_max_inflight_messages_set(test->clients[SLOW_PUBLISHER].handle, 0);
+
+    return 0;
+}
+
+// Shrink the receive buffer of the subscriber, otherwise the kernel would absorb a large part of
+// the stream and the broker would not have to queue anything
+static void slow_shrink_rcvbuf(struct slow_test *test) {
+    int sock;
+    int size = SLOW_RCVBUF;
+
+    sock = mosquitto_socket(test->clients[SLOW_SUBSCRIBER].handle);
+    if (sock != -1) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (void *) &size, sizeof(size));
+    }
+}
+
+static int slow_report(struct slow_test *test) {
+    struct configuration *cfg = test->cfg;
+    unsigned long first_lost;
+    unsigned long lost;
+    unsigned long lost_qos[SLOW_QOS_LEVELS];
+    double drain;
+    double growth;
+    double denominator;
+    double p50;
+    double max;
+    int exit_code;
+    int i;
+
+    lost = test->sent - test->received_count;
+    for (i = 0; i < SLOW_QOS_LEVELS; i++) {
+        lost_qos[i] = test->sent_qos[i] - test->received_qos[i];
+    }
+
+    for (first_lost = 0; first_lost < test->sent; first_lost++) {
+        if (!test->received[first_lost]) {
+            break;
+        }
+    }
+
+    // time after the end of the stream until the queued messages were delivered at full read speed
+    drain = test->last_receive_ms > test->stream_end_ms ? test->last_receive_ms - test->stream_end_ms : 0.0;
+
+    // growth of the delivery lag in ms per second of streaming, i.e. how fast the queue grows
+    growth = 0.0;
+    denominator = (double) test->slow_count * test->sum_xx - test->sum_x * test->sum_x;
+    if ((test->slow_count > 1) && (denominator > 0.0)) {
+        growth = ((double) test->slow_count * test->sum_xy - test->sum_x * test->sum_y) / denominator;
+    }
+
+    qsort((void *) test->lag, test->received_count, sizeof(double), compare_double);
+    p50 = percentile(test->lag, test->received_count, 50.0);
+    max = test->received_count ? test->lag[test->received_count - 1] : 0.0;
+
+    // the thresholds apply to the drain time, losing QoS 1/2 messages or the connection is a warning
+    if (!test->received_count) {
+        exit_code = NAGIOS_CRITICAL;
+    } else if (drain >= (double) cfg->critical) {
+        exit_code = NAGIOS_CRITICAL;
+    } else if ((drain >= (double) cfg->warn) || lost_qos[1] || lost_qos[2] || test->disconnected) {
+        exit_code = NAGIOS_WARNING;
+    } else {
+        exit_code = NAGIOS_OK;
+    }
+
+    fprintf(stdout, "%lu of %lu messages at %lu/s delivered to a consumer reading %lu/s, max backlog %lu",
+            test->received_count, test->sent, cfg->slow_rate, cfg->slow_read_rate, test->backlog_max);
+    if (first_lost < test->sent) {
+        fprintf(stdout, ", drops from %.1fms at backlog %lu", test->send_ms[first_lost], test->backlog[first_lost]);
+    }
+    fprintf(stdout, ", loss QoS 0/1/2 %lu/%lu/%lu", lost_qos[0], lost_qos[1], lost_qos[2]);
+    if (test->disconnected) {
+        fprintf(stdout, ", disconnected by the broker after %.1fms and %lu messages", test->disconnect_ms, test->disconnect_received);
+    }
+    if (test->granted_qos < 2) {
+        fprintf(stdout, " (subscription granted QoS %d)", test->granted_qos);
+    }
+
+    fprintf(stdout, " | drain=%.3fms;%d;%d;0", drain, cfg->warn, cfg->critical);
+    if (test->received_count) {
+        fprintf(stdout, " lag_p50=%.3fms;;;0 lag_max=%.3fms;;;0", p50, max);
+    } else {
+        fprintf(stdout, " lag_p50=U;;;0 lag_max=U;;;0");
+    }
+    fprintf(stdout, " lag_growth=%.3f;;; backlog_max=%lu;;;0", growth, test->backlog_max);
+    if (first_lost < test->sent) {
+        fprintf(stdout, " drop_onset=%.3fms;;;0 drop_backlog=%lu;;;0", test->send_ms[first_lost], test->backlog[first_lost]);
+    } else {
+        fprintf(stdout, " drop_onset=U;;;0 drop_backlog=U;;;0");
+    }
+    for (i = 0; i < SLOW_QOS_LEVELS; i++) {
+        fprintf(stdout, " loss_qos%d=%lu;;;0;%lu", i, lost_qos[i], test->sent_qos[i]);
+    }
+    fprintf(stdout, " loss=%lu;;;0;%lu slow_disconnect=%d;;;0;1\n", lost, test->sent, test->disconnected ? 1 : 0);
+
+    return exit_code;
+}
+
+int slow_test(struct configuration *cfg) {
+    struct slow_test test;
+    struct timespec start;
+    int exit_code = NAGIOS_CRITICAL;
+    int rc;
+
+    memset((void *) &test, 0, sizeof(struct slow_test));
+    test.cfg = cfg;
+
+    // subscribing, the stream and the drain share the timeout
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    mosquitto_lib_init();
+
+    if (slow_setup(&test) != 0) {
+        fprintf(stdout, "%s | drain=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    rc = mqtt_loop_run(test.handles, 2, remaining_ms(start, cfg->timeout), 10, slow_subscribe_tick, (void *) &test);
+    if (rc != MQTT_LOOP_DONE) {
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds while subscribing | drain=U;%d;%d;0\n", cfg->timeout, cfg->warn, cfg->critical);
+        } else if (test.connect_result) {
+            fprintf(stdout, "%s | drain=U;%d;%d;0\n", mosquitto_connack_string(test.connect_result), cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, "%s | drain=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        }
+        goto leave;
+    }
+
+    slow_shrink_rcvbuf(&test);
+
+    // only the publisher is polled, the subscriber is read from the tick function
+    clock_gettime(CLOCK_MONOTONIC, &test.start);
+    rc = mqtt_loop_run(&test.handles[SLOW_PUBLISHER], 1, remaining_ms(start, cfg->timeout), 1, slow_stream_tick, (void *) &test);
+    if (rc == MQTT_LOOP_TIMEOUT) {
+        fprintf(stdout, "Timeout after %d seconds, %lu of %lu messages published | drain=U;%d;%d;0\n", cfg->timeout, test.sent, cfg->slow_messages, cfg->warn, cfg->critical);
+        goto leave;
+    }
+    if (rc != MQTT_LOOP_DONE) {
+        fprintf(stdout, "%s after %lu messages | drain=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), test.sent, cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    // the subscriber catches up at full speed, a timeout ends the drain like a quiet period
+    test.draining = true;
+    rc = mqtt_loop_run(test.handles, 2, remaining_ms(start, cfg->timeout), 1, slow_drain_tick, (void *) &test);
+    if (rc == MQTT_LOOP_ERROR) {
+        fprintf(stdout, "%s while draining | drain=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    exit_code = slow_report(&test);
+
+leave:
+    slow_free(&test);
+    mosquitto_lib_cleanup();
+    return exit_code;
+}
+
@@ -0,0 +1,7 @@
+#ifndef __CHECK_MQTT_SLOW_TEST_H__
+#define __CHECK_MQTT_SLOW_TEST_H__
+
+int slow_test(struct configuration *);
+
+#endif /* __CHECK_MQTT_SLOW_TEST_H__ */
+
@@ -0,0 +1,400 @@
+#include "check_mqtt.h"
+#include "util.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_BENCH_RUNS 100
+#define DEFAULT_BENCH_BINARY "./check_mqtt"
+#define BENCH_BUFFER_SIZE 4096
+
+// MQTT control packet types
+#define MQTT_CONNECT 1
+#define MQTT_PUBLISH 3
+#define MQTT_SUBSCRIBE 8
+#define MQTT_PINGREQ 12
+#define MQTT_DISCONNECT 14
+
+struct bench_run {
+    bool first_byte;
+    double first_byte_ms;
+    double total_ms;
+    int exit_code;
+};
+
+const char *const short_opts = "hn:b:";
+const struct option long_opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "runs", required_argument, NULL, 'n' },
+    { "binary", required_argument, NULL, 'b' },
+    { NULL, 0, NULL, 0 },
+};
+
+static void bench_usage(void) {
+    fprintf(stdout, "check_mqtt-startup-bench version %s\n"
+            "Copyright (C) by Andreas Maus <maus@ypbind.de>\n"
+            "This program comes with ABSOLUTELY NO WARRANTY.\n"
+            "\n"
+            "check_mqtt-startup-bench is distributed under the terms of the GNU General\n"
+            "Public License Version 3. (http://www.gnu.org/copyleft/gpl.html)\n"
+            "\n"
+            "Usage: check_mqtt-startup-bench [-h|--help] [-n <runs>|--runs=<runs>] [-b <binary>|--binary=<binary>]\n"
+            "   [-- <additional check_mqtt arguments>]\n"
+            "\n"
+            "   -h                      This text\n"
+            "   --help\n"
+            "\n"
+            "   -n <runs>               Number of runs\n"
+            "   --runs=<runs>           Default: %d\n"
+            "\n"
+            "   -b <binary>             check_mqtt binary to benchmark\n"
+            "   --binary=<binary>       Default: %s\n"
+            "\n"
+            "The binary is started with -H 127.0.0.1 -p <port> -u bench and connects to a minimal\n"
+            "MQTT broker on the loopback interface which is part of the benchmark.\n"
+            "\n", CHECK_MQTT_VERSION, DEFAULT_BENCH_RUNS, DEFAULT_BENCH_BINARY);
+}
+
+static double bench_elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec2double_ms(get_delay(*start, now));
+}
+
+static int bench_send(int fd, const unsigned char *data, size_t len) {
+    ssize_t rc;
+
+    while (len > 0) {
+        rc = write(fd, (const void *) data, len);
+        if (rc == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += rc;
+        len -= (size_t) rc;
+    }
+    return 0;
+}
+
+// Answer a single complete MQTT packet, returns -1 if the connection should be closed
+static int bench_handle_packet(int fd, const unsigned char *packet, size_t header_len, size_t len) {
+    unsigned char reply[BENCH_BUFFER_SIZE];
+    const unsigned char *payload = packet + header_len;
+    size_t remaining = len - header_len;
+    size_t pos;
+    size_t topic_len;
+    size_t count = 0;
+
+    switch (packet[0] >> 4) {
+        case MQTT_CONNECT: {
+                               // CONNACK, session not present, accepted
+                               reply[0] = 0x20;
+                               reply[1] = 0x02;
+                               reply[2] = 0x00;
+                               reply[3] = 0x00;
+                               return bench_send(fd, reply, 4);
+                           }
+        case MQTT_SUBSCRIBE: {
+                                 if (remaining < 2) {
+                                     return -1;
+                                 }
+                                 // SUBACK with the requested QoS for every topic filter
+                                 reply[2] = payload[0];
+                                 reply[3] = payload[1];
+                                 for (pos = 2; (pos + 2 < remaining) && (count < sizeof(reply) - 4); count++) {
+                                     topic_len = ((size_t) payload[pos] << 8) | payload[pos + 1];
+                                     pos += 2 + topic_len;
+                                     if (pos >= remaining) {
+                                         return -1;
+                                     }
+                                     reply[4 + count] = payload[pos] & 0x03;
+                                     pos++;
+                                 }
+                                 if (count > 125) {
+                                     return -1;
+                                 }
+                                 reply[0] = 0x90;
+                                 reply[1] = (unsigned char) (2 + count);
+                                 return bench_send(fd, reply, 4 + count);
+                             }
+        case MQTT_PUBLISH: {
+                               // QoS 1 and 2 are acknowledged with PUBACK/PUBREC, the message is returned unchanged
+                               if (packet[0] & 0x06) {
+                                   topic_len = ((size_t) payload[0] << 8) | payload[1];
+                                   if (topic_len + 4 > remaining) {
+                                       return -1;
+                                   }
+                                   reply[0] = (packet[0] & 0x04) ? 0x50 : 0x40;
+                                   reply[1] = 0x02;
+                                   reply[2] = payload[2 + topic_len];
+                                   reply[3] = payload[3 + topic_len];
+                                   if (bench_send(fd, reply, 4) != 0) {
+                                       return -1;
+                                   }
+                               }
+                               return bench_send(fd, packet, len);
+                           }
+        case MQTT_PINGREQ: {
+                               reply[0] = 0xd0;
+                               reply[1] = 0x00;
+                               return bench_send(fd, reply, 2);
+                           }
+        case MQTT_DISCONNECT: {
+                                  return -1;
+                              }
+        default: {
+                     return 0;
+                 }
+    }
+}
+
+// Serve a single client until it disconnects, returns -1 if a packet doesn't fit into the buffer
+static int bench_serve(int fd) {
+    unsigned char buffer[BENCH_BUFFER_SIZE];
+    size_t filled = 0;
+    size_t header_len;
+    size_t remaining;
+    size_t multiplier;
+    size_t i;
+    ssize_t rc;
+
+    for (;;) {
+        rc = read(fd, (void *) (buffer + filled), sizeof(buffer) - filled);
+        if (rc == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            return 0;
+        }
+        filled += (size_t) rc;
+
+        for (;;) {
+            // fixed header: type/flags and 1 - 4 bytes of remaining length
+            remaining = 0;
+            multiplier = 1;
+            for (i = 1; (i < filled) && (i < 5); i++) {
+                remaining += (buffer[i] & 0x7f) * multiplier;
+                multiplier *= 128;
+                if (!(buffer[i] & 0x80)) {
+                    break;
+                }
+            }
+            if ((i >= filled) || (i == 5)) {
+                break;
+            }
+            header_len = i + 1;
+            if (header_len + remaining > sizeof(buffer)) {
+                return -1;
+            }
+            if (header_len + remaining > filled) {
+                break;
+            }
+
+            if (bench_handle_packet(fd, buffer, header_len, header_len + remaining) != 0) {
+                return 0;
+            }
+            memmove((void *) buffer, (void *) (buffer + header_len + remaining), filled - header_len - remaining);
+            filled -= header_len + remaining;
+        }
+    }
+}
+
+static int bench_run(int listen_fd, const char *binary, char **args, struct bench_run *run) {
+    struct timespec start;
+    struct pollfd pfd;
+    pid_t pid;
+    int status = 0;
+    int fd;
+    unsigned char first;
+    ssize_t rc;
+
+    memset((void *) run, 0, sizeof(struct bench_run));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "fork failed, errno=%d (%s)\n", errno, strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        execv(binary, args);
+        _exit(127);
+    }
+
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    // wait for the connection, the child may fail before connecting
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        if (poll(&pfd, 1, 1) != 1) {
+            continue;
+        }
+
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+
+        // exec to the first byte on the wire, i.e. the CONNECT packet
+        rc = recv(fd, (void *) &first, 1, MSG_PEEK);
+        if (rc == 1) {
+            run->first_byte = true;
+            run->first_byte_ms = bench_elapsed_ms(&start);
+            bench_serve(fd);
+        }
+        close(fd);
+
+        waitpid(pid, &status, 0);
+        break;
+    }
+
+    run->total_ms = bench_elapsed_ms(&start);
+    run->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return 0;
+}
+
+static void bench_print(const char *name, double *values, size_t count) {
+    if (!count) {
+        fprintf(stdout, "%-20s no samples\n", name);
+        return;
+    }
+
+    qsort((void *) values, count, sizeof(double), compare_double);
+    fprintf(stdout, "%-20s min=%.3fms p50=%.3fms p90=%.3fms p99=%.3fms max=%.3fms\n", name, values[0],
+            percentile(values, count, 50.0), percentile(values, count, 90.0), percentile(values, count, 99.0), values[count - 1]);
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    struct bench_run run;
+    char port[8];
+    char **args;
+    const char *binary = DEFAULT_BENCH_BINARY;
+    double *first_byte;
+    double *total;
+    size_t first_byte_count = 0;
+    size_t runs = DEFAULT_BENCH_RUNS;
+    size_t failed = 0;
+    size_t i;
+    long temp_long;
+    int listen_fd;
+    int opt_idx;
+    int opt_rc;
+    int nargs;
+    int one = 1;
+
+    for (;;) {
+        opt_rc = getopt_long(argc, argv, short_opts, long_opts, &opt_idx);
+        if (opt_rc == -1) {
+            break;
+        }
+        switch (opt_rc) {
+            case 'h': {
+                          bench_usage();
+                          exit(0);
+                      }
+            case 'n': {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              exit(1);
+                          }
+                          if (temp_long <= 0) {
+                              fprintf(stderr, "Invalid number of runs %ld (must be > 0)\n", temp_long);
+                              exit(1);
+                          }
+                          runs = (size_t) temp_long;
+                          break;
+                      }
+            case 'b': {
+                          binary = optarg;
+                          break;
+                      }
+            default: {
+                         fprintf(stderr, "Unknown argument\n");
+                         exit(1);
+                     }
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        fprintf(stderr, "Can't create socket, errno=%d (%s)\n", errno, strerror(errno));
+        exit(1);
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (void *) &one, sizeof(one));
+
+    memset((void *) &addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if ((bind(listen_fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) == -1) || (listen(listen_fd, 4) == -1)
+            || (getsockname(listen_fd, (struct sockaddr *) &addr, &addr_len) == -1)) {
+        fprintf(stderr, "Can't listen on the loopback interface, errno=%d (%s)\n", errno, strerror(errno));
+        exit(1);
+    }
+    snprintf(port, sizeof(port), "%u", ntohs(addr.sin_port));
+
+    // <binary> -H 127.0.0.1 -p <port> -u bench <additional arguments> NULL
+    nargs = argc - optind;
+    args = (char **) calloc((size_t) nargs + 8, sizeof(char *));
+    first_byte = (double *) calloc(runs, sizeof(double));
+    total = (double *) calloc(runs, sizeof(double));
+    if (!args || !first_byte || !total) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    args[0] = (char *) binary;
+    args[1] = "-H";
+    args[2] = "127.0.0.1";
+    args[3] = "-p";
+    args[4] = port;
+    args[5] = "-u";
+    args[6] = "bench";
+    for (i = 0; i < (size_t) nargs; i++) {
+        args[7 + i] = argv[optind + i];
+    }
+
+    for (i = 0; i < runs; i++) {
+        if (bench_run(listen_fd, binary, args, &run) != 0) {
+            exit(1);
+        }
+        if (run.first_byte) {
+            first_byte[first_byte_count++] = run.first_byte_ms;
+        }
+        if (run.exit_code != NAGIOS_OK) {
+            failed++;
+        }
+        total[i] = run.total_ms;
+    }
+
+    fprintf(stdout, "%s: %lu runs, %lu not OK\n", binary, (unsigned long) runs, (unsigned long) failed);
+    bench_print("exec to first byte", first_byte, first_byte_count);
+    bench_print("total wall time", total, runs);
+
+    close(listen_fd);
+    free(args);
+    free(first_byte);
+    free(total);
+    exit(failed ? 1 : 0);
+}
+
@@ -0,0 +1,508 @@
+#include "check_mqtt.h"
+#include "sub_scale.h"
+#include "mqtt_functions.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// maximal number of outstanding SUBSCRIBE requests per connection
+#define SUB_WINDOW 16
+// number of topic levels below <topic>/subs/m/ used to build distinct filters matching the probe topic,
+// every level is either a literal or a '+' wildcard which gives 2^SUB_MATCH_LEVELS matching filters
+#define SUB_MATCH_LEVELS 10
+#define SUB_FILTER_SIZE 1024
+// <uuid>:<step>:<sequence>
+#define SUB_PROBE_PAYLOAD_SIZE 64
+
+struct sub_test;
+
+struct sub_pending {
+    int mid;
+    struct timespec sent;
+};
+
+struct sub_client {
+    struct sub_test *test;
+    struct mosquitto *handle;
+    bool connected;
+    bool failed;
+    unsigned int outstanding;
+    struct sub_pending pending[SUB_WINDOW];
+};
+
+struct sub_step_result {
+    long subscriptions;
+    double suback_p50;
+    double suback_p99;
+    double suback_max;
+    double duration;
+    double rate;
+    unsigned long probes_sent;
+    unsigned long probes_received;
+    double rtt_p50;
+    double rtt_p99;
+};
+
+struct sub_test {
+    struct configuration *cfg;
+    // index 0 is the probe publisher, the subscribing connections follow
+    struct sub_client *clients;
+    struct mosquitto **handles;
+    size_t count;
+    char *probe_topic;
+    long installed;
+    long acked;
+    long target;
+    double *suback_latency;
+    size_t suback_count;
+    struct timespec *probe_send_time;
+    bool *probe_received;
+    double *rtt;
+    unsigned int step;
+    struct timespec step_start;
+    double next_probe_ms;
+    struct sub_step_result *results;
+    int connect_result;
+};
+
+// Filter <n> of the subscription tree. The first --sub-matching filters match the probe topic, all others
+// never match and are exact topics or end in a '+' or '#' wildcard according to the weights of --sub-shape.
+static void sub_filter(struct sub_test *test, long n, char *filter, size_t size) {
+    struct configuration *cfg = test->cfg;
+    long weight;
+    size_t len;
+    int level;
+
+    if (n < cfg->sub_matching) {
+        len = snprintf(filter, size, "%s/subs/m", cfg->topic);
+        for (level = 0; (level < SUB_MATCH_LEVELS) && (len < size); level++) {
+            if (n & (1 << level)) {
+                len += snprintf(filter + len, size - len, "/+");
+            } else {
+                len += snprintf(filter + len, size - len, "/l%d", level);
+            }
+        }
+        return;
+    }
+
+    weight = n % (cfg->sub_shape[0] + cfg->sub_shape[1] + cfg->sub_shape[2]);
+    if (weight < cfg->sub_shape[0]) {
+        snprintf(filter, size, "%s/subs/n/%ld", cfg->topic, n);
+    } else if (weight < cfg->sub_shape[0] + cfg->sub_shape[1]) {
+        snprintf(filter, size, "%s/subs/n/%ld/+", cfg->topic, n);
+    } else {
+        snprintf(filter, size, "%s/subs/n/%ld/#", cfg->topic, n);
+    }
+}
+
+static void sub_connect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct sub_client *client = (struct sub_client *) userdata;
+
+    if (result) {
+        client->test->connect_result = result;
+        client->failed = true;
+        return;
+    }
+    client->connected = true;
+}
+
+static void sub_disconnect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct sub_client *client = (struct sub_client *) userdata;
+
+    client->test->cfg->mqtt_error = result;
+    client->failed = true;
+}
+
+static void sub_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos) {
+    struct sub_client *client = (struct sub_client *) userdata;
+    struct sub_test *test = client->test;
+    struct timespec now;
+    unsigned int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ((qos_count > 0) && (granted_qos[0] == 0x80)) {
+        test->cfg->mqtt_error = MOSQ_ERR_ACL_DENIED;
+        client->failed = true;
+        return;
+    }
+
+    for (i = 0; i < client->outstanding; i++) {
+        if (client->pending[i].mid == mid) {
+            test->suback_latency[test->suback_count] = timespec2double_ms(get_delay(client->pending[i].sent, now));
+            test->suback_count++;
+            test->acked++;
+
+            client->outstanding--;
+            client->pending[i] = client->pending[client->outstanding];
+            return;
+        }
+    }
+}
+
+static void sub_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg) {
+    struct sub_client *client = (struct sub_client *) userdata;
+    struct sub_test *test = client->test;
+    struct sub_step_result *result = &test->results[test->step];
+    struct timespec now;
+    char buffer[SUB_PROBE_PAYLOAD_SIZE];
+    char *remain;
+    unsigned long step;
+    unsigned long seq;
+    size_t prefix_len;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ((msg->payloadlen <= 0) || (msg->payloadlen >= SUB_PROBE_PAYLOAD_SIZE)) {
+        return;
+    }
+    memcpy((void *) buffer, msg->payload, msg->payloadlen);
+    buffer[msg->payloadlen] = 0;
+
+    prefix_len = strlen(test->cfg->payload);
+    if (strncmp(buffer, test->cfg->payload, prefix_len) || (buffer[prefix_len] != ':')) {
+        return;
+    }
+    step = strtoul(buffer + prefix_len + 1, &remain, 10);
+    if ((*remain != ':') || (step != test->step)) {
+        return;
+    }
+    seq = strtoul(remain + 1, &remain, 10);
+    if ((*remain != 0) || (seq >= result->probes_sent)) {
+        return;
+    }
+
+    // with several matching filters the probe can be delivered more than once, the first delivery counts
+    if (test->probe_received[seq]) {
+        return;
+    }
+    test->probe_received[seq] = true;
+    test->rtt[result->probes_received] = timespec2double_ms(get_delay(test->probe_send_time[seq], now));
+    result->probes_received++;
+}
+
+static int sub_connect_tick(void *userdata, const struct timespec *now) {
+    struct sub_test *test = (struct sub_test *) userdata;
+    bool done = true;
+    size_t i;
+
+    for (i = 0; i < test->count; i++) {
+        if (test->clients[i].failed) {
+            return -1;
+        }
+        if (!test->clients[i].connected) {
+            done = false;
+        }
+    }
+    return done ? 1 : 0;
+}
+
+static int sub_subscribe_tick(void *userdata, const struct timespec *now) {
+    struct sub_test *test = (struct sub_test *) userdata;
+    struct configuration *cfg = test->cfg;
+    struct sub_client *client;
+    char filter[SUB_FILTER_SIZE];
+    int mid;
+    size_t i;
+
+    for (i = 0; i < test->count; i++) {
+        if (test->clients[i].failed) {
+            return -1;
+        }
+    }
+
+    // filters are distributed round robin over the subscribing connections
+    while (test->installed < test->target) {
+        client = &test->clients[1 + test->installed % cfg->sub_connections];
+        if (client->outstanding >= SUB_WINDOW) {
+            break;
+        }
+
+        sub_filter(test, test->installed, filter, sizeof(filter));
+        cfg->mqtt_error = mosquitto_subscribe(client->handle, &mid, filter, cfg->qos);
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+        client->pending[client->outstanding].mid = mid;
+        clock_gettime(CLOCK_MONOTONIC, &client->pending[client->outstanding].sent);
+        client->outstanding++;
+        test->installed++;
+    }
+
+    return (test->acked == test->target) ? 1 : 0;
+}
+
+static int sub_probe_tick(void *userdata, const struct timespec *now) {
+    struct sub_test *test = (struct sub_test *) userdata;
+    struct configuration *cfg = test->cfg;
+    struct sub_step_result *result = &test->results[test->step];
+    char payload[SUB_PROBE_PAYLOAD_SIZE];
+    double elapsed;
+    int len;
+    size_t i;
+
+    for (i = 0; i < test->count; i++) {
+        if (test->clients[i].failed) {
+            return -1;
+        }
+    }
+
+    elapsed = timespec2double_ms(get_delay(test->step_start, *now));
+
+    if (result->probes_sent < cfg->sub_probes) {
+        if (elapsed >= test->next_probe_ms) {
+            len = snprintf(payload, sizeof(payload), "%s:%u:%lu", cfg->payload, test->step, result->probes_sent);
+            cfg->mqtt_error = mosquitto_publish(test->clients[0].handle, NULL, test->probe_topic, len, (void *) payload, cfg->qos, false);
+            if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+                return -1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &test->probe_send_time[result->probes_sent]);
+            result->probes_sent++;
+            test->next_probe_ms += (double) cfg->probe_interval;
+        }
+        return 0;
+    }
+
+    // all probes have been published, wait for outstanding responses
+    if (result->probes_received == result->probes_sent) {
+        return 1;
+    }
+    return (elapsed >= test->next_probe_ms + (double) cfg->critical) ? 1 : 0;
+}
+
+static void sub_free(struct sub_test *test) {
+    size_t i;
+
+    if (test->clients) {
+        for (i = 0; i < test->count; i++) {
+            if (test->clients[i].handle) {
+                mosquitto_destroy(test->clients[i].handle);
+            }
+        }
+        free(test->clients);
+    }
+    if (test->handles) {
+        free(test->handles);
+    }
+    if (test->probe_topic) {
+        free(test->probe_topic);
+    }
+    if (test->suback_latency) {
+        free(test->suback_latency);
+    }
+    if (test->probe_send_time) {
+        free(test->probe_send_time);
+    }
+    if (test->probe_received) {
+        free(test->probe_received);
+    }
+    if (test->rtt) {
+        free(test->rtt);
+    }
+    if (test->results) {
+        free(test->results);
+    }
+}
+
+static int sub_setup(struct sub_test *test) {
+    struct configuration *cfg = test->cfg;
+    char *mqttid;
+    size_t i;
+
+    test->count = cfg->sub_connections + 1;
+    test->clients = (struct sub_client *) calloc(test->count, sizeof(struct sub_client));
+    test->handles = (struct mosquitto **) calloc(test->count, sizeof(struct mosquitto *));
+    // subscription counts are cumulative and ascending, the last step is the largest batch
+    test->suback_latency = (double *) calloc(cfg->sub_counts[cfg->sub_counts_count - 1], sizeof(double));
+    test->probe_send_time = (struct timespec *) calloc(cfg->sub_probes, sizeof(struct timespec));
+    test->probe_received = (bool *) calloc(cfg->sub_probes, sizeof(bool));
+    test->rtt = (double *) calloc(cfg->sub_probes, sizeof(double));
+    test->results = (struct sub_step_result *) calloc(cfg->sub_counts_count, sizeof(struct sub_step_result));
+    test->probe_topic = (char *) malloc(SUB_FILTER_SIZE);
+    if (!test->clients || !test->handles || !test->suback_latency || !test->probe_send_time || !test->probe_received
+            || !test->rtt || !test->results || !test->probe_topic) {
+        fprintf(stderr, "Unable to allocate memory for subscription scaling test\n");
+        return -1;
+    }
+
+    // the exact filter (all levels literal) is the probe topic
+    sub_filter(test, 0, test->probe_topic, SUB_FILTER_SIZE);
+
+    for (i = 0; i < test->count; i++) {
+        test->clients[i].test = test;
+
+        mqttid = mqtt_client_id();
+        if (!mqttid) {
+            return -1;
+        }
+        test->clients[i].handle = mqtt_new_handle(cfg, mqttid, true, (void *) &test->clients[i]);
+        free(mqttid);
+        if (!test->clients[i].handle) {
+            return -1;
+        }
+        test->handles[i] = test->clients[i].handle;
+
+        mosquitto_connect_callback_set(test->clients[i].handle, sub_connect_callback);
+        mosquitto_disconnect_callback_set(test->clients[i].handle, sub_disconnect_callback);
+        mosquitto_subscribe_callback_set(test->clients[i].handle, sub_subscribe_callback);
+        mosquitto_message_callback_set(test->clients[i].handle, sub_message_callback);
+
+        cfg->mqtt_error = mosquitto_connect_async(test->clients[i].handle, cfg->host, cfg->port, cfg->keep_alive);
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int sub_report(struct sub_test *test) {
+    struct configuration *cfg = test->cfg;
+    struct sub_step_result *result;
+    struct sub_step_result *worst = NULL;
+    unsigned int i;
+    int exit_code;
+
+    exit_code = NAGIOS_OK;
+    for (i = 0; i < cfg->sub_counts_count; i++) {
+        result = &test->results[i];
+        if (!result->probes_received) {
+            exit_code = NAGIOS_CRITICAL;
+            continue;
+        }
+        if (!worst || (result->rtt_p99 > worst->rtt_p99)) {
+            worst = result;
+        }
+    }
+
+    if (worst && (exit_code == NAGIOS_OK)) {
+        if (worst->rtt_p99 >= (double) cfg->critical) {
+            exit_code = NAGIOS_CRITICAL;
+        } else if (worst->rtt_p99 >= (double) cfg->warn) {
+            exit_code = NAGIOS_WARNING;
+        }
+    }
+
+    if (exit_code == NAGIOS_CRITICAL && (!worst || worst->rtt_p99 < (double) cfg->critical)) {
+        fprintf(stdout, "No probe response received for at least one subscription count |");
+    } else {
+        fprintf(stdout, "p99 probe RTT %.1fms with %ld subscriptions matching %ld filters |", worst->rtt_p99, worst->subscriptions, cfg->sub_matching);
+    }
+
+    for (i = 0; i < cfg->sub_counts_count; i++) {
+        result = &test->results[i];
+        fprintf(stdout, " suback_p50_%ld=%.3fms;;;0 suback_p99_%ld=%.3fms;;;0 sub_rate_%ld=%.1f;;;0",
+                result->subscriptions, result->suback_p50, result->subscriptions, result->suback_p99,
+                result->subscriptions, result->rate);
+        if (result->probes_received) {
+            fprintf(stdout, " rtt_p50_%ld=%.3fms;;;0 rtt_p99_%ld=%.3fms;%d;%d;0",
+                    result->subscriptions, result->rtt_p50, result->subscriptions, result->rtt_p99, cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, " rtt_p50_%ld=U;;;0 rtt_p99_%ld=U;%d;%d;0", result->subscriptions, result->subscriptions, cfg->warn, cfg->critical);
+        }
+        fprintf(stdout, " probe_loss_%ld=%lu;;;0", result->subscriptions, result->probes_sent - result->probes_received);
+    }
+    fprintf(stdout, "\n");
+
+    // long output: latency against subscription count
+    for (i = 0; i < cfg->sub_counts_count; i++) {
+        result = &test->results[i];
+        fprintf(stdout, "%ld subscriptions: suback p50=%.1fms p99=%.1fms max=%.1fms, probe rtt p50=%.1fms p99=%.1fms, %lu of %lu probes received\n",
+                result->subscriptions, result->suback_p50, result->suback_p99, result->suback_max,
+                result->rtt_p50, result->rtt_p99, result->probes_received, result->probes_sent);
+    }
+
+    return exit_code;
+}
+
+int sub_scale_test(struct configuration *cfg) {
+    struct sub_test test;
+    struct sub_step_result *result;
+    struct timespec start;
+    struct timespec step_start;
+    struct timespec end;
+    int exit_code = NAGIOS_CRITICAL;
+    int rc;
+
+    memset((void *) &test, 0, sizeof(struct sub_test));
+    test.cfg = cfg;
+
+    // connecting and all steps share the timeout
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mosquitto_lib_init();
+
+    if (sub_setup(&test) != 0) {
+        fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    rc = mqtt_loop_run(test.handles, test.count, remaining_ms(start, cfg->timeout), 10, sub_connect_tick, (void *) &test);
+    if (rc != MQTT_LOOP_DONE) {
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds while connecting | mqtt_rtt=U;%d;%d;0\n", cfg->timeout, cfg->warn, cfg->critical);
+        } else if (test.connect_result) {
+            fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_connack_string(test.connect_result), cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        }
+        goto leave;
+    }
+
+    for (test.step = 0; test.step < cfg->sub_counts_count; test.step++) {
+        result = &test.results[test.step];
+        result->subscriptions = cfg->sub_counts[test.step];
+
+        // grow the subscription tree to the next size
+        test.target = result->subscriptions;
+        test.suback_count = 0;
+        clock_gettime(CLOCK_MONOTONIC, &step_start);
+        rc = mqtt_loop_run(test.handles, test.count, remaining_ms(start, cfg->timeout), 1, sub_subscribe_tick, (void *) &test);
+        if (rc != MQTT_LOOP_DONE) {
+            if (rc == MQTT_LOOP_TIMEOUT) {
+                fprintf(stdout, "Timeout after %d seconds, %ld of %ld subscriptions acknowledged | mqtt_rtt=U;%d;%d;0\n",
+                        cfg->timeout, test.acked, test.target, cfg->warn, cfg->critical);
+            } else {
+                fprintf(stdout, "%s after %ld subscriptions | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), test.acked, cfg->warn, cfg->critical);
+            }
+            goto leave;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        result->duration = timespec2double_ms(get_delay(step_start, end));
+        result->rate = result->duration > 0.0 ? (double) test.suback_count * 1000.0 / result->duration : 0.0;
+        qsort((void *) test.suback_latency, test.suback_count, sizeof(double), compare_double);
+        result->suback_p50 = percentile(test.suback_latency, test.suback_count, 50.0);
+        result->suback_p99 = percentile(test.suback_latency, test.suback_count, 99.0);
+        result->suback_max = test.suback_count ? test.suback_latency[test.suback_count - 1] : 0.0;
+
+        memset((void *) test.probe_received, 0, cfg->sub_probes * sizeof(bool));
+        clock_gettime(CLOCK_MONOTONIC, &test.step_start);
+        test.next_probe_ms = 0.0;
+        rc = mqtt_loop_run(test.handles, test.count, remaining_ms(start, cfg->timeout), 1, sub_probe_tick, (void *) &test);
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds probing %ld subscriptions | mqtt_rtt=U;%d;%d;0\n", cfg->timeout, result->subscriptions, cfg->warn, cfg->critical);
+            goto leave;
+        }
+        if (rc != MQTT_LOOP_DONE) {
+            fprintf(stdout, "Connection lost with %ld subscriptions: %s | mqtt_rtt=U;%d;%d;0\n", result->subscriptions, mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+            goto leave;
+        }
+
+        qsort((void *) test.rtt, result->probes_received, sizeof(double), compare_double);
+        result->rtt_p50 = percentile(test.rtt, result->probes_received, 50.0);
+        result->rtt_p99 = percentile(test.rtt, result->probes_received, 99.0);
+    }
+
+    exit_code = sub_report(&test);
+
+leave:
+    sub_free(&test);
+    mosquitto_lib_cleanup();
+    return exit_code;
+}
+
@@ -0,0 +1,7 @@
+#ifndef __CHECK_MQTT_SUB_SCALE_H__
+#define __CHECK_MQTT_SUB_SCALE_H__
+
+int sub_scale_test(struct configuration *);
+
+#endif /* __CHECK_MQTT_SUB_SCALE_H__ */
+
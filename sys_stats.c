@@ -0,0 +1,180 @@
+#include "check_mqtt.h"
+#include "sys_stats.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYS_TOPIC_PREFIX "$SYS/"
+// $SYS payloads are short numbers, anything longer is not one of ours
+#define SYS_PAYLOAD_SIZE 64
+
+struct sys_stat {
+    const char *topic;
+    const char *name;
+    const char *uom;
+    int precision;
+};
+
+// Note: The order must not be changed, it is the index into configuration->sys_stat_values
+static const struct sys_stat sys_stats[SYS_STAT_COUNT] = {
+    { "$SYS/broker/load/messages/received/1min", "messages_received_1min", "", 2 },
+    { "$SYS/broker/load/messages/sent/1min", "messages_sent_1min", "", 2 },
+    { "$SYS/broker/load/connections/1min", "connections_1min", "", 2 },
+    { "$SYS/broker/clients/connected", "clients_connected", "", 0 },
+    { "$SYS/broker/heap/current", "heap_current", "B", 0 },
+    { "$SYS/broker/messages/inflight", "messages_inflight", "", 0 },
+    { "$SYS/broker/store/messages/count", "store_messages", "", 0 },
+    { "$SYS/broker/subscriptions/count", "subscriptions", "", 0 },
+};
+
+int sys_stats_subscribe(struct configuration *cfg, struct mosquitto *mosq) {
+    int i;
+
+    for (i = 0; i < SYS_STAT_COUNT; i++) {
+        cfg->mqtt_error = mosquitto_subscribe(mosq, NULL, sys_stats[i].topic, 0);
+
+#ifdef DEBUG
+        printf("DEBUG: sys_stats_subscribe: subscribe to %s returned %d (%s)\n", sys_stats[i].topic, cfg->mqtt_error, mosquitto_strerror(cfg->mqtt_error));
+#endif
+
+        if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// returns true if the message was a broker statistic, values are parsed on the stack without allocating memory
+bool sys_stats_message(struct configuration *cfg, const struct mosquitto_message *msg) {
+    char buffer[SYS_PAYLOAD_SIZE];
+    char *remain;
+    double value;
+    int i;
+
+    if (strncmp(msg->topic, SYS_TOPIC_PREFIX, strlen(SYS_TOPIC_PREFIX))) {
+        return false;
+    }
+
+    for (i = 0; i < SYS_STAT_COUNT; i++) {
+        if (!strcmp(msg->topic, sys_stats[i].topic)) {
+            break;
+        }
+    }
+    if ((i == SYS_STAT_COUNT) || (msg->payloadlen <= 0) || (msg->payloadlen >= SYS_PAYLOAD_SIZE)) {
+        return true;
+    }
+
+    memcpy((void *) buffer, msg->payload, msg->payloadlen);
+    buffer[msg->payloadlen] = 0;
+
+    // some broker versions append the unit, e.g. "1234 bytes"
+    value = strtod(buffer, &remain);
+    if (remain == buffer) {
+        return true;
+    }
+
+#ifdef DEBUG
+    printf("DEBUG: sys_stats_message: %s = %f\n", sys_stats[i].name, value);
+#endif
+
+    cfg->sys_stat_values[i].value = value;
+    cfg->sys_stat_values[i].received = true;
+    return true;
+}
+
+// <name>,<warn>,<critical>
+int sys_stats_set_threshold(struct configuration *cfg, const char *str) {
+    const char *sep;
+    char *remain;
+    size_t name_len;
+    double warn;
+    double critical;
+    int i;
+
+    sep = strchr(str, ',');
+    if (!sep) {
+        fprintf(stderr, "Invalid threshold %s, expected <name>,<warn>,<critical>\n", str);
+        return -1;
+    }
+    name_len = (size_t) (sep - str);
+
+    for (i = 0; i < SYS_STAT_COUNT; i++) {
+        if ((strlen(sys_stats[i].name) == name_len) && !strncmp(sys_stats[i].name, str, name_len)) {
+            break;
+        }
+    }
+    if (i == SYS_STAT_COUNT) {
+        fprintf(stderr, "Unknown broker statistic %.*s\n", (int) name_len, str);
+        return -1;
+    }
+
+    warn = strtod(sep + 1, &remain);
+    if ((remain == sep + 1) || (*remain != ',')) {
+        fprintf(stderr, "Invalid threshold %s, expected <name>,<warn>,<critical>\n", str);
+        return -1;
+    }
+    sep = remain + 1;
+    critical = strtod(sep, &remain);
+    if ((remain == sep) || (*remain != 0)) {
+        fprintf(stderr, "Invalid threshold %s, expected <name>,<warn>,<critical>\n", str);
+        return -1;
+    }
+    if (warn > critical) {
+        fprintf(stderr, "Critical threshold must be greater or equal than warning threshold for %s\n", sys_stats[i].name);
+        return -1;
+    }
+
+    cfg->sys_stat_values[i].threshold = true;
+    cfg->sys_stat_values[i].warn = warn;
+    cfg->sys_stat_values[i].critical = critical;
+    return 0;
+}
+
+int sys_stats_state(const struct configuration *cfg) {
+    int state = NAGIOS_OK;
+    int i;
+
+    for (i = 0; i < SYS_STAT_COUNT; i++) {
+        if (!cfg->sys_stat_values[i].threshold || !cfg->sys_stat_values[i].received) {
+            continue;
+        }
+        if (cfg->sys_stat_values[i].value >= cfg->sys_stat_values[i].critical) {
+            state = NAGIOS_CRITICAL;
+        } else if ((cfg->sys_stat_values[i].value >= cfg->sys_stat_values[i].warn) && (state == NAGIOS_OK)) {
+            state = NAGIOS_WARNING;
+        }
+    }
+    return state;
+}
+
+void sys_stats_print_perfdata(const struct configuration *cfg, FILE *fd) {
+    const struct sys_stat_value *v;
+    int i;
+
+    for (i = 0; i < SYS_STAT_COUNT; i++) {
+        v = &cfg->sys_stat_values[i];
+
+        if (v->received) {
+            fprintf(fd, " sys_%s=%.*f%s;", sys_stats[i].name, sys_stats[i].precision, v->value, sys_stats[i].uom);
+        } else {
+            fprintf(fd, " sys_%s=U;", sys_stats[i].name);
+        }
+
+        if (v->threshold) {
+            fprintf(fd, "%g;%g;0", v->warn, v->critical);
+        } else {
+            fprintf(fd, ";;0");
+        }
+    }
+}
+
+const char *sys_stats_name(int index) {
+    if ((index < 0) || (index >= SYS_STAT_COUNT)) {
+        return NULL;
+    }
+    return sys_stats[index].name;
+}
+
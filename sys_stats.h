@@ -0,0 +1,15 @@
+#ifndef __CHECK_MQTT_SYS_STATS_H__
+#define __CHECK_MQTT_SYS_STATS_H__
+
+#include <mosquitto.h>
+#include <stdio.h>
+
+int sys_stats_subscribe(struct configuration *, struct mosquitto *);
+bool sys_stats_message(struct configuration *, const struct mosquitto_message *);
+int sys_stats_set_threshold(struct configuration *, const char *);
+int sys_stats_state(const struct configuration *);
+void sys_stats_print_perfdata(const struct configuration *, FILE *);
+const char *sys_stats_name(int);
+
+#endif /* __CHECK_MQTT_SYS_STATS_H__ */
+
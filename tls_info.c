@@ -0,0 +1,89 @@
+#include "check_mqtt.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#endif /* HAVE_OPENSSL */
+
+#include "tls_info.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_OPENSSL
+static void tls_info_callback(const SSL *ssl, int where, int ret) {
+    struct configuration *cfg;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    cfg = (struct configuration *) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    if (!cfg) {
+        return;
+    }
+
+    // only the first handshake is reported, with TLS 1.3 session tickets can trigger the callback again
+    if (cfg->tls_handshake_done) {
+        return;
+    }
+
+    if ((where & SSL_CB_HANDSHAKE_START) && !cfg->tls_handshake_start.tv_sec && !cfg->tls_handshake_start.tv_nsec) {
+        cfg->tls_handshake_start = now;
+    }
+
+    if (where & SSL_CB_HANDSHAKE_DONE) {
+        cfg->tls_handshake = timespec2double_ms(get_delay(cfg->tls_handshake_start, now));
+        snprintf(cfg->tls_protocol, sizeof(cfg->tls_protocol), "%s", SSL_get_version(ssl));
+        snprintf(cfg->tls_cipher, sizeof(cfg->tls_cipher), "%s", SSL_get_cipher_name(ssl));
+        cfg->tls_handshake_done = true;
+    }
+}
+#endif /* HAVE_OPENSSL */
+
+// Install our own SSL context to time the handshake and to select the key exchange groups.
+// libmosquitto still applies CA, certificate, PSK, TLS version and ciphers to this context.
+int tls_info_setup(struct configuration *cfg, struct mosquitto *handle) {
+#ifdef HAVE_OPENSSL
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
+        cfg->mqtt_error = MOSQ_ERR_TLS;
+        return -1;
+    }
+
+    SSL_CTX_set_app_data(ctx, (void *) cfg);
+    SSL_CTX_set_info_callback(ctx, tls_info_callback);
+
+    if (cfg->curves && (SSL_CTX_set1_groups_list(ctx, cfg->curves) != 1)) {
+        fprintf(stderr, "Invalid list of curves %s\n", cfg->curves);
+        SSL_CTX_free(ctx);
+        cfg->mqtt_error = MOSQ_ERR_TLS;
+        return -1;
+    }
+
+    cfg->mqtt_error = mosquitto_void_option(handle, MOSQ_OPT_SSL_CTX, (void *) ctx);
+    if (cfg->mqtt_error == MOSQ_ERR_SUCCESS) {
+        cfg->mqtt_error = mosquitto_int_option(handle, MOSQ_OPT_SSL_CTX_WITH_DEFAULTS, 1);
+    }
+
+    // libmosquitto holds its own reference to the context
+    SSL_CTX_free(ctx);
+
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        return -1;
+    }
+#endif /* HAVE_OPENSSL */
+    return 0;
+}
+
+void tls_info_print_perfdata(const struct configuration *cfg, FILE *fd) {
+    if (cfg->tls_handshake_done) {
+        fprintf(fd, " tls_handshake=%.3fms;;;0", cfg->tls_handshake);
+    } else {
+        fprintf(fd, " tls_handshake=U;;;0");
+    }
+}
+
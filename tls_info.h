@@ -0,0 +1,11 @@
+#ifndef __CHECK_MQTT_TLS_INFO_H__
+#define __CHECK_MQTT_TLS_INFO_H__
+
+#include <mosquitto.h>
+#include <stdio.h>
+
+int tls_info_setup(struct configuration *, struct mosquitto *);
+void tls_info_print_perfdata(const struct configuration *, FILE *);
+
+#endif /* __CHECK_MQTT_TLS_INFO_H__ */
+
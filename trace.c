@@ -0,0 +1,141 @@
+#include "check_mqtt.h"
+#include "trace.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// FNV-1a
+uint32_t trace_host_hash(const char *host) {
+    uint32_t hash = 2166136261U;
+
+    while (*host) {
+        hash ^= (unsigned char) *host++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static uint32_t trace_offset(const struct timespec start, const struct timespec ts) {
+    double us;
+
+    if (!ts.tv_sec && !ts.tv_nsec) {
+        return TRACE_NOT_REACHED;
+    }
+
+    us = timespec2double_ms(get_delay(start, ts)) * 1000.0;
+    if ((us < 0.0) || (us >= (double) TRACE_NOT_REACHED)) {
+        return TRACE_NOT_REACHED;
+    }
+    return (uint32_t) us;
+}
+
+// <file>.<n-1> -> <file>.<n>, ..., <file> -> <file>.1
+static void trace_rotate(const char *file) {
+    char *from;
+    char *to;
+    size_t len = strlen(file) + 12;
+    int i;
+
+    from = (char *) malloc(len);
+    to = (char *) malloc(len);
+    if (!from || !to) {
+        free(from);
+        free(to);
+        return;
+    }
+
+    for (i = TRACE_ROTATE_COUNT; i > 0; i--) {
+        if (i == 1) {
+            snprintf(from, len, "%s", file);
+        } else {
+            snprintf(from, len, "%s.%d", file, i - 1);
+        }
+        snprintf(to, len, "%s.%d", file, i);
+        rename(from, to);
+    }
+
+    free(from);
+    free(to);
+}
+
+// Append the record of the finished probe. This is called after the result has been
+// printed, so neither the rotation nor the write are part of the measurement.
+int trace_write(const struct configuration *cfg, int result) {
+    struct trace_record record;
+    struct timespec now;
+    struct timespec start;
+    struct timespec wall;
+    struct stat st;
+    struct stat current;
+    ssize_t written;
+    int fd;
+
+    memset((void *) &record, 0, sizeof(struct trace_record));
+    record.magic = TRACE_MAGIC;
+    record.version = TRACE_VERSION;
+    record.result = (uint16_t) result;
+    record.host_hash = trace_host_hash(cfg->host);
+    record.port = (uint16_t) cfg->port;
+    record.qos = (uint16_t) cfg->qos;
+    record.payload_size = cfg->payload ? (uint32_t) strlen(cfg->payload) + 1 : 0;
+    record.mqtt_error = cfg->mqtt_error;
+    record.connect_result = cfg->mqtt_connect_result;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    start = cfg->start_time;
+    wall = cfg->start_wall_time;
+    // connection setup has not been started
+    if (!start.tv_sec && !start.tv_nsec) {
+        start = now;
+        clock_gettime(CLOCK_REALTIME, &wall);
+    }
+    record.wall_time_ns = (int64_t) wall.tv_sec * 1000000000LL + wall.tv_nsec;
+
+    record.connack_us = trace_offset(start, cfg->connack_time);
+    record.suback_us = trace_offset(start, cfg->suback_time);
+    record.publish_us = trace_offset(start, cfg->send_time);
+    record.receive_us = trace_offset(start, cfg->receive_time);
+    record.total_us = trace_offset(start, now);
+
+    fd = open(cfg->trace_file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd == -1) {
+        return errno;
+    }
+
+    if ((fstat(fd, &st) == 0) && (st.st_size + (off_t) sizeof(struct trace_record) > (off_t) cfg->trace_max_size)) {
+        // another instance may rotate at the same time, only rotate if the file hasn't been replaced yet
+        if (flock(fd, LOCK_EX) == 0) {
+            if ((stat(cfg->trace_file, &current) == 0) && (current.st_ino == st.st_ino) && (current.st_dev == st.st_dev)) {
+                trace_rotate(cfg->trace_file);
+            }
+            flock(fd, LOCK_UN);
+        }
+        close(fd);
+
+        fd = open(cfg->trace_file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd == -1) {
+            return errno;
+        }
+    }
+
+    // a single write of a complete record is atomic with O_APPEND, concurrent checks don't interleave
+    written = write(fd, (void *) &record, sizeof(struct trace_record));
+    if (written != (ssize_t) sizeof(struct trace_record)) {
+        close(fd);
+        return written == -1 ? errno : EIO;
+    }
+
+    if (close(fd) == -1) {
+        return errno;
+    }
+    return 0;
+}
+
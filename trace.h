@@ -0,0 +1,42 @@
+#ifndef __CHECK_MQTT_TRACE_H__
+#define __CHECK_MQTT_TRACE_H__
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x5154434d
+#define TRACE_VERSION 1
+// phase offset of a phase that has not been reached
+#define TRACE_NOT_REACHED UINT32_MAX
+// number of rotated trace files kept (<file>.1 ... <file>.<n>)
+#define TRACE_ROTATE_COUNT 4
+
+// Fixed size record appended for every probe. All fields are naturally aligned and
+// in host byte order, the file can be mapped and read as an array of records.
+// Phase offsets are microseconds after the start of the connection.
+struct trace_record {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t result;
+    uint32_t host_hash;
+    uint32_t payload_size;
+    int64_t wall_time_ns;
+    uint32_t connack_us;
+    uint32_t suback_us;
+    uint32_t publish_us;
+    uint32_t receive_us;
+    uint32_t total_us;
+    int32_t mqtt_error;
+    int32_t connect_result;
+    uint16_t port;
+    uint16_t qos;
+    uint8_t reserved[8];
+};
+
+// the on-disk format must not change by accident
+typedef char trace_record_size_check[(sizeof(struct trace_record) == 64) ? 1 : -1];
+
+uint32_t trace_host_hash(const char *);
+int trace_write(const struct configuration *, int);
+
+#endif /* __CHECK_MQTT_TRACE_H__ */
+
@@ -0,0 +1,520 @@
+#include "check_mqtt.h"
+#include "trace.h"
+#include "util.h"
+
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_READ_RECORDS 1024
+#define DEFAULT_TRACE_WORST 10
+
+static const double trace_buckets[] = { 1.0, 2.0, 5.0, 10.0, 20.0, 50.0, 100.0, 200.0, 500.0, 1000.0 };
+#define TRACE_BUCKET_COUNT (sizeof(trace_buckets) / sizeof(double))
+
+struct trace_host {
+    uint32_t hash;
+    uint16_t port;
+    unsigned long probes;
+    unsigned long failed;
+    double *rtt;
+    double *connack;
+    size_t rtt_count;
+    size_t connack_count;
+    size_t size;
+    unsigned long histogram[TRACE_BUCKET_COUNT + 1];
+    // sorted, worst probe first
+    struct trace_record *worst;
+    double *worst_score;
+    size_t worst_count;
+};
+
+// records only contain a hash of the host name, known names are matched against it
+struct trace_name {
+    char *name;
+    uint32_t hash;
+};
+
+struct trace_filter {
+    bool host;
+    uint32_t host_hash;
+    struct trace_name *names;
+    size_t name_count;
+    unsigned int port;
+    int64_t start_ns;
+    int64_t end_ns;
+    size_t worst;
+};
+
+const char *const short_opts = "hH:N:p:s:e:n:";
+const struct option long_opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "host", required_argument, NULL, 'H' },
+    { "names", required_argument, NULL, 'N' },
+    { "port", required_argument, NULL, 'p' },
+    { "start", required_argument, NULL, 's' },
+    { "end", required_argument, NULL, 'e' },
+    { "worst", required_argument, NULL, 'n' },
+    { NULL, 0, NULL, 0 },
+};
+
+static void trace_usage(void) {
+    fprintf(stdout, "check_mqtt-trace version %s\n"
+            "Copyright (C) by Andreas Maus <maus@ypbind.de>\n"
+            "This program comes with ABSOLUTELY NO WARRANTY.\n"
+            "\n"
+            "check_mqtt-trace is distributed under the terms of the GNU General\n"
+            "Public License Version 3. (http://www.gnu.org/copyleft/gpl.html)\n"
+            "\n"
+            "Usage: check_mqtt-trace [-h|--help] [-H <host>|--host=<host>] [-N <host>,...|--names=<host>,...]\n"
+            "   [-p <port>|--port=<port>] [-s <epoch>|--start=<epoch>] [-e <epoch>|--end=<epoch>]\n"
+            "   [-n <n>|--worst=<n>]\n"
+            "   <file> [<file> ...]\n"
+            "\n"
+            "   -h                      This text\n"
+            "   --help\n"
+            "\n"
+            "   -H <host>               Only report probes against <host>\n"
+            "   --host=<host>\n"
+            "\n"
+            "   -N <host>,...           Comma separated list of host names to label the hosts in the\n"
+            "   --names=<host>,...      report with, the trace records only contain a hash of the name\n"
+            "\n"
+            "   -p <port>               Only report probes against <port>\n"
+            "   --port=<port>\n"
+            "\n"
+            "   -s <epoch>              Only report probes started at or after <epoch> (seconds since 1970-01-01)\n"
+            "   --start=<epoch>\n"
+            "\n"
+            "   -e <epoch>              Only report probes started before <epoch> (seconds since 1970-01-01)\n"
+            "   --end=<epoch>\n"
+            "\n"
+            "   -n <n>                  Number of worst probes to list for each host\n"
+            "   --worst=<n>             Default: %d\n"
+            "\n"
+            "Trace files are written by check_mqtt --trace=<file>\n"
+            "\n", CHECK_MQTT_VERSION, DEFAULT_TRACE_WORST);
+}
+
+static int trace_add_names(struct trace_filter *filter, const char *list) {
+    struct trace_name *new_names;
+    char *copy;
+    char *token;
+    char *saveptr;
+
+    copy = strdup(list);
+    if (!copy) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for host name list\n", strlen(list) + 1);
+        return -1;
+    }
+
+    for (token = strtok_r(copy, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        new_names = (struct trace_name *) realloc((void *) filter->names, (filter->name_count + 1) * sizeof(struct trace_name));
+        if (!new_names) {
+            fprintf(stderr, "Unable to allocate memory for host name list\n");
+            free(copy);
+            return -1;
+        }
+        filter->names = new_names;
+
+        filter->names[filter->name_count].name = strdup(token);
+        if (!filter->names[filter->name_count].name) {
+            fprintf(stderr, "Unable to allocate %ld bytes of memory for host name\n", strlen(token) + 1);
+            free(copy);
+            return -1;
+        }
+        filter->names[filter->name_count].hash = trace_host_hash(token);
+        filter->name_count++;
+    }
+
+    free(copy);
+    return 0;
+}
+
+static const char *trace_host_name(const struct trace_filter *filter, uint32_t hash) {
+    size_t i;
+
+    for (i = 0; i < filter->name_count; i++) {
+        if (filter->names[i].hash == hash) {
+            return filter->names[i].name;
+        }
+    }
+    return NULL;
+}
+
+static const char *trace_result_name(uint16_t result) {
+    switch (result) {
+        case NAGIOS_OK: {
+                            return "OK";
+                        }
+        case NAGIOS_WARNING: {
+                                 return "WARNING";
+                             }
+        case NAGIOS_CRITICAL: {
+                                  return "CRITICAL";
+                              }
+        default: {
+                     return "UNKNOWN";
+                 }
+    }
+}
+
+static struct trace_host *trace_find_host(struct trace_host **hosts, size_t *count, const struct trace_record *record, size_t worst) {
+    struct trace_host *new_hosts;
+    struct trace_host *host;
+    size_t i;
+
+    for (i = 0; i < *count; i++) {
+        if (((*hosts)[i].hash == record->host_hash) && ((*hosts)[i].port == record->port)) {
+            return &(*hosts)[i];
+        }
+    }
+
+    new_hosts = (struct trace_host *) realloc((void *) *hosts, (*count + 1) * sizeof(struct trace_host));
+    if (!new_hosts) {
+        return NULL;
+    }
+    *hosts = new_hosts;
+
+    host = &(*hosts)[*count];
+    memset((void *) host, 0, sizeof(struct trace_host));
+    host->hash = record->host_hash;
+    host->port = record->port;
+    host->worst = (struct trace_record *) calloc(worst + 1, sizeof(struct trace_record));
+    host->worst_score = (double *) calloc(worst + 1, sizeof(double));
+    if (!host->worst || !host->worst_score) {
+        free(host->worst);
+        free(host->worst_score);
+        return NULL;
+    }
+
+    (*count)++;
+    return host;
+}
+
+static int trace_add(struct trace_host *host, const struct trace_record *record, size_t worst) {
+    double *new_rtt;
+    double *new_connack;
+    double rtt;
+    double score;
+    size_t new_size;
+    size_t i;
+
+    // every probe adds at most one value to each list
+    if (host->probes == host->size) {
+        new_size = host->size ? 2 * host->size : 1024;
+        new_rtt = (double *) realloc((void *) host->rtt, new_size * sizeof(double));
+        if (!new_rtt) {
+            return -1;
+        }
+        host->rtt = new_rtt;
+        new_connack = (double *) realloc((void *) host->connack, new_size * sizeof(double));
+        if (!new_connack) {
+            return -1;
+        }
+        host->connack = new_connack;
+        host->size = new_size;
+    }
+
+    host->probes++;
+
+    if (record->connack_us != TRACE_NOT_REACHED) {
+        host->connack[host->connack_count++] = (double) record->connack_us / 1000.0;
+    }
+
+    if ((record->receive_us != TRACE_NOT_REACHED) && (record->publish_us != TRACE_NOT_REACHED)) {
+        rtt = (double) (record->receive_us - record->publish_us) / 1000.0;
+        host->rtt[host->rtt_count++] = rtt;
+
+        for (i = 0; i < TRACE_BUCKET_COUNT; i++) {
+            if (rtt < trace_buckets[i]) {
+                break;
+            }
+        }
+        host->histogram[i]++;
+
+        // failed probes are always worse than answered ones
+        score = record->result == NAGIOS_OK ? rtt : rtt + 1.0e+12;
+    } else {
+        score = 2.0e+12 + (double) record->total_us;
+    }
+
+    if (record->result != NAGIOS_OK) {
+        host->failed++;
+    }
+
+    if (!worst) {
+        return 0;
+    }
+
+    // insertion into the sorted list of the worst probes
+    if ((host->worst_count == worst) && (score <= host->worst_score[worst - 1])) {
+        return 0;
+    }
+    i = host->worst_count < worst ? host->worst_count : worst - 1;
+    while ((i > 0) && (host->worst_score[i - 1] < score)) {
+        host->worst[i] = host->worst[i - 1];
+        host->worst_score[i] = host->worst_score[i - 1];
+        i--;
+    }
+    host->worst[i] = *record;
+    host->worst_score[i] = score;
+    if (host->worst_count < worst) {
+        host->worst_count++;
+    }
+
+    return 0;
+}
+
+static void trace_print_phase(const char *name, uint32_t us) {
+    if (us == TRACE_NOT_REACHED) {
+        fprintf(stdout, " %s=-", name);
+    } else {
+        fprintf(stdout, " %s=%.3fms", name, (double) us / 1000.0);
+    }
+}
+
+static void trace_print_host(const struct trace_filter *filter, struct trace_host *host) {
+    const struct trace_record *r;
+    const char *name;
+    struct tm tm;
+    time_t t;
+    char buffer[32];
+    size_t i;
+
+    qsort((void *) host->rtt, host->rtt_count, sizeof(double), compare_double);
+    qsort((void *) host->connack, host->connack_count, sizeof(double), compare_double);
+
+    name = trace_host_name(filter, host->hash);
+    if (name) {
+        fprintf(stdout, "host %s port %u: %lu probes, %lu not OK\n", name, host->port, host->probes, host->failed);
+    } else {
+        fprintf(stdout, "host 0x%08x (unknown name, see --names) port %u: %lu probes, %lu not OK\n", host->hash, host->port, host->probes, host->failed);
+    }
+    if (host->rtt_count) {
+        fprintf(stdout, "  rtt: p50=%.3fms p90=%.3fms p99=%.3fms p999=%.3fms max=%.3fms\n",
+                percentile(host->rtt, host->rtt_count, 50.0), percentile(host->rtt, host->rtt_count, 90.0),
+                percentile(host->rtt, host->rtt_count, 99.0), percentile(host->rtt, host->rtt_count, 99.9),
+                host->rtt[host->rtt_count - 1]);
+    }
+    if (host->connack_count) {
+        fprintf(stdout, "  connack: p50=%.3fms p99=%.3fms max=%.3fms\n",
+                percentile(host->connack, host->connack_count, 50.0), percentile(host->connack, host->connack_count, 99.0),
+                host->connack[host->connack_count - 1]);
+    }
+
+    if (host->rtt_count) {
+        fprintf(stdout, "  rtt histogram:\n");
+        for (i = 0; i <= TRACE_BUCKET_COUNT; i++) {
+            if (i < TRACE_BUCKET_COUNT) {
+                fprintf(stdout, "    < %gms: %lu\n", trace_buckets[i], host->histogram[i]);
+            } else {
+                fprintf(stdout, "    >= %gms: %lu\n", trace_buckets[i - 1], host->histogram[i]);
+            }
+        }
+    }
+
+    if (host->worst_count) {
+        fprintf(stdout, "  worst %lu probes:\n", (unsigned long) host->worst_count);
+    }
+    for (i = 0; i < host->worst_count; i++) {
+        r = &host->worst[i];
+        t = (time_t) (r->wall_time_ns / 1000000000LL);
+        gmtime_r(&t, &tm);
+        strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
+
+        fprintf(stdout, "    %s.%03d UTC %s", buffer, (int) ((r->wall_time_ns / 1000000LL) % 1000LL), trace_result_name(r->result));
+        trace_print_phase("connack", r->connack_us);
+        trace_print_phase("suback", r->suback_us);
+        trace_print_phase("publish", r->publish_us);
+        trace_print_phase("receive", r->receive_us);
+        trace_print_phase("total", r->total_us);
+        fprintf(stdout, " qos=%u payload=%u mqtt_error=%d connect_result=%d\n", r->qos, r->payload_size, r->mqtt_error, r->connect_result);
+    }
+}
+
+static int trace_read_file(const char *file, const struct trace_filter *filter, struct trace_host **hosts, size_t *count, unsigned long *skipped) {
+    struct trace_record *records;
+    struct trace_host *host;
+    FILE *fd;
+    size_t n;
+    size_t i;
+
+    records = (struct trace_record *) malloc(TRACE_READ_RECORDS * sizeof(struct trace_record));
+    if (!records) {
+        fprintf(stderr, "Unable to allocate read buffer\n");
+        return -1;
+    }
+
+    fd = fopen(file, "r");
+    if (!fd) {
+        fprintf(stderr, "Can't open %s\n", file);
+        free(records);
+        return -1;
+    }
+
+    // stream over the file, only the values needed for the statistics are kept
+    while ((n = fread((void *) records, sizeof(struct trace_record), TRACE_READ_RECORDS, fd)) > 0) {
+        for (i = 0; i < n; i++) {
+            if ((records[i].magic != TRACE_MAGIC) || (records[i].version != TRACE_VERSION)) {
+                (*skipped)++;
+                continue;
+            }
+            if (filter->host && (records[i].host_hash != filter->host_hash)) {
+                continue;
+            }
+            if (filter->port && (records[i].port != filter->port)) {
+                continue;
+            }
+            if ((records[i].wall_time_ns < filter->start_ns) || (records[i].wall_time_ns >= filter->end_ns)) {
+                continue;
+            }
+
+            host = trace_find_host(hosts, count, &records[i], filter->worst);
+            if (!host || (trace_add(host, &records[i], filter->worst) != 0)) {
+                fprintf(stderr, "Memory allocation failed\n");
+                fclose(fd);
+                free(records);
+                return -1;
+            }
+        }
+    }
+
+    if (ferror(fd)) {
+        fprintf(stderr, "Can't read from %s\n", file);
+        fclose(fd);
+        free(records);
+        return -1;
+    }
+
+    fclose(fd);
+    free(records);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct trace_filter filter;
+    struct trace_host *hosts = NULL;
+    size_t count = 0;
+    unsigned long skipped = 0;
+    long temp_long;
+    int opt_idx;
+    int opt_rc;
+    int exit_code = 1;
+    size_t i;
+
+    memset((void *) &filter, 0, sizeof(struct trace_filter));
+    filter.start_ns = INT64_MIN;
+    filter.end_ns = INT64_MAX;
+    filter.worst = DEFAULT_TRACE_WORST;
+
+    for (;;) {
+        opt_rc = getopt_long(argc, argv, short_opts, long_opts, &opt_idx);
+        if (opt_rc == -1) {
+            break;
+        }
+        switch (opt_rc) {
+            case 'h': {
+                          trace_usage();
+                          exit(0);
+                      }
+            case 'H': {
+                          filter.host = true;
+                          filter.host_hash = trace_host_hash(optarg);
+                          if (trace_add_names(&filter, optarg) != 0) {
+                              goto leave;
+                          }
+                          break;
+                      }
+            case 'N': {
+                          if (trace_add_names(&filter, optarg) != 0) {
+                              goto leave;
+                          }
+                          break;
+                      }
+            case 'p': {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              exit(1);
+                          }
+                          if ((temp_long <= 0) || (temp_long > 65535)) {
+                              fprintf(stderr, "Invalid port %ld\n", temp_long);
+                              exit(1);
+                          }
+                          filter.port = (unsigned int) temp_long;
+                          break;
+                      }
+            case 's': {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              exit(1);
+                          }
+                          filter.start_ns = (int64_t) temp_long * 1000000000LL;
+                          break;
+                      }
+            case 'e': {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              exit(1);
+                          }
+                          filter.end_ns = (int64_t) temp_long * 1000000000LL;
+                          break;
+                      }
+            case 'n': {
+                          temp_long = str2long(optarg);
+                          if (temp_long == LONG_MIN) {
+                              exit(1);
+                          }
+                          if (temp_long < 0) {
+                              fprintf(stderr, "Invalid number of probes %ld (must be >= 0)\n", temp_long);
+                              exit(1);
+                          }
+                          filter.worst = (size_t) temp_long;
+                          break;
+                      }
+            default: {
+                         fprintf(stderr, "Unknown argument\n");
+                         exit(1);
+                     }
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "At least one trace file is required\n\n");
+        trace_usage();
+        exit(1);
+    }
+
+    for (i = (size_t) optind; i < (size_t) argc; i++) {
+        if (trace_read_file(argv[i], &filter, &hosts, &count, &skipped) != 0) {
+            goto leave;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        trace_print_host(&filter, &hosts[i]);
+    }
+    if (skipped) {
+        fprintf(stdout, "%lu invalid records skipped\n", skipped);
+    }
+    exit_code = 0;
+
+leave:
+    for (i = 0; i < count; i++) {
+        free(hosts[i].rtt);
+        free(hosts[i].connack);
+        free(hosts[i].worst);
+        free(hosts[i].worst_score);
+    }
+    free(hosts);
+    for (i = 0; i < filter.name_count; i++) {
+        free(filter.names[i].name);
+    }
+    free(filter.names);
+    exit(exit_code);
+}
+
@@ -17,7 +17,22 @@ void usage(void) {
             "   [-T <topic>|--topic=<topic>] [-t <sec> | --timeout=<sec>] [-s|--ssl]\n"
             "   [-u <user>|--user=<user>] [-P <pass>|--password=<pass>] \n"
             "   [-f <file>|--password-file=<file>] [-w <ms>|--warn=<ms>] \n"
-            "   [-W <ms>|--critical=<ms>] [-K <s>|--keepalive=<s>]\n"
+            "   [-W <ms>|--critical=<ms>] [-K <s>|--keepalive=<s>] [-m <mode>|--mode=<mode>]\n"
+            "   [--load-connections=<n>] [--load-rates=<r>[,<r>,...]] [--load-payload-size=<bytes>]\n"
+            "   [--load-step=<sec>] [--probe-interval=<ms>] [--sys-stats]\n"
+            "   [--sys-threshold=<name>,<warn>,<crit>] [--inflight-window=<n>]\n"
+            "   [--inflight-messages=<n>] [--trace=<file>] [--trace-max-size=<bytes>]\n"
+            "   [--all-addresses] [--bind=<addr>[,<addr>,...]] [--shared-consumers=<n>]\n"
+            "   [--shared-group=<name>] [--shared-messages=<n>] [--sub-counts=<k>[,<k>,...]]\n"
+            "   [--sub-shape=<exact>,<single>,<multi>] [--sub-connections=<n>]\n"
+            "   [--sub-matching=<m>] [--sub-probes=<n>] [--session-id=<id>]\n"
+            "   [--session-messages=<n>] [--will-keepalive=<s>] [--will-silent]\n"
+            "   [--propagation-interval=<ms>] [--propagation-probes=<n>] [--ping-count=<n>]\n"
+            "   [--output=<format>] [--textfile=<file>] [--v5-probes=<n>]\n"
+            "   [--self-stats] [--psk-identity=<id>] [--psk-file=<file>]\n"
+            "   [--tls-version=<version>] [--ciphers=<list>] [--curves=<list>]\n"
+            "   [--cache-ttl=<s>] [--cache-dir=<dir>] [--slow-rate=<n>]\n"
+            "   [--slow-read-rate=<n>] [--slow-messages=<n>]\n"
             "\n"
             "   -h                      This text\n"
             "   --help\n"
@@ -73,8 +88,163 @@ void usage(void) {
             "   -K <s>                  Send MQTT PING message after <s> if no messages are exchanged\n"
             "   --keapalive=<s>         Default: %d\n"
             "\n"
+            "   -m <mode>               Measurement mode. Supported modes are:\n"
+            "   --mode=<mode>             rtt      - round trip time of a single probe message\n"
+            "                             load     - percentiles of the probe round trip time under\n"
+            "                                        background load generated by additional connections\n"
+            "                             inflight - throughput and acknowledge latency of QoS 1/2 messages\n"
+            "                                        published with a window of outstanding messages\n"
+            "                             shared   - distribution and delivery latency of probe messages\n"
+            "                                        to the members of a shared subscription group\n"
+            "                             subscriptions - SUBACK latency and probe round trip time\n"
+            "                                        for a growing number of subscriptions\n"
+            "                             session  - resume of a persistent session and delivery of the\n"
+            "                                        messages queued while it was offline\n"
+            "                             will     - delivery latency of the last will after the\n"
+            "                                        connection of a client has been killed\n"
+            "                             propagation - delay until a new subscription is active after\n"
+            "                                        SUBACK and steady state round trip time\n"
+            "                             ping     - connect time and round trip time of MQTT PINGREQ\n"
+            "                                        packets, doesn't require access to a topic\n"
+            "                             v5       - MQTT v5 request/response round trip time matched on\n"
+            "                                        correlation data, CONNACK properties and packet sizes\n"
+            "                             slow     - queueing, drops and disconnect of a subscriber\n"
+            "                                        that reads slower than messages are published\n"
+            "                           Default: rtt\n"
+            "\n"
+            "   --load-connections=<n>  Number of additional connections generating background load\n"
+            "                           Default: %d\n"
+            "\n"
+            "   --load-rates=<r>,...    Comma separated list of load steps in messages per second\n"
+            "                           Default: %s\n"
+            "\n"
+            "   --load-payload-size=<bytes>\n"
+            "                           Payload size of load messages. Default: %d\n"
+            "\n"
+            "   --load-step=<sec>       Duration of a single load step. Default: %d\n"
+            "\n"
+            "   --probe-interval=<ms>   Interval between probe messages in load mode. Default: %d\n"
+            "\n"
+            "   --sys-stats             Report broker statistics from $SYS/broker/ as performance data in\n"
+            "                           rtt mode\n"
+            "\n"
+            "   --sys-threshold=<name>,<warn>,<crit>\n"
+            "                           Warning and critical threshold for broker statistic <name>,\n"
+            "                           can be repeated. Valid names are messages_received_1min,\n"
+            "                           messages_sent_1min, connections_1min, clients_connected,\n"
+            "                           heap_current, messages_inflight, store_messages, subscriptions\n"
+            "\n"
+            "   --inflight-window=<n>   Number of outstanding QoS 1/2 messages in inflight mode\n"
+            "                           Default: %d\n"
+            "\n"
+            "   --inflight-messages=<n> Number of messages to publish in inflight mode. Default: %d\n"
+            "\n"
+            "   --trace=<file>          Append a binary trace record of the probe to <file>,\n"
+            "                           use check_mqtt-trace to analyse trace files (rtt mode only)\n"
+            "\n"
+            "   --trace-max-size=<bytes>\n"
+            "                           Rotate the trace file if it would grow beyond <bytes>\n"
+            "                           Default: %d\n"
+            "\n"
+            "   --all-addresses         Probe every address <host> resolves to in parallel, the worst\n"
+            "                           address determines the result. The host name of a TLS server\n"
+            "                           certificate isn't verified\n"
+            "\n"
+            "   --bind=<addr>,...       Probe in parallel through every local source address in the\n"
+            "                           comma separated list, the worst path determines the result\n"
+            "\n"
+            "   --shared-consumers=<n>  Number of subscribers in the shared subscription group in shared\n"
+            "                           mode. Default: %d\n"
+            "\n"
+            "   --shared-group=<name>   Name of the shared subscription group. Default: %s\n"
+            "\n"
+            "   --shared-messages=<n>   Number of probe messages to publish in shared mode, messages are\n"
+            "                           sent every --probe-interval milliseconds. Default: %d\n"
+            "\n"
+            "   --sub-counts=<k>,...    Ascending list of subscription counts in subscriptions mode\n"
+            "                           Default: %s\n"
+            "\n"
+            "   --sub-shape=<exact>,<single>,<multi>\n"
+            "                           Weights of exact filters and filters ending in a + or #\n"
+            "                           wildcard. Default: %s\n"
+            "\n"
+            "   --sub-connections=<n>   Number of connections the subscriptions are distributed over\n"
+            "                           Default: %d\n"
+            "\n"
+            "   --sub-matching=<m>      Number of filters matching the probe topic (at most 1024)\n"
+            "                           Default: %d\n"
+            "\n"
+            "   --sub-probes=<n>        Number of probe messages per subscription count. Default: %d\n"
+            "\n"
+            "   --session-id=<id>       Client id of the persistent session in session mode\n"
+            "                           Default: random client id\n"
+            "\n"
+            "   --session-messages=<n>  Number of messages queued while the session is offline\n"
+            "                           Default: %d\n"
+            "\n"
+            "   --will-keepalive=<s>    Keepalive of the connection registering the last will in will mode\n"
+            "                           Default: %d\n"
+            "\n"
+            "   --will-silent           Stop serving the connection in will mode instead of closing\n"
+            "                           its socket, the broker must detect the loss by the keepalive\n"
+            "\n"
+            "   --propagation-interval=<ms>\n"
+            "                           Interval between probe messages while waiting for the\n"
+            "                           subscription to become active in propagation mode. Default: %d\n"
+            "\n"
+            "   --propagation-probes=<n>\n"
+            "                           Number of probe messages for the steady state round trip time\n"
+            "                           in propagation mode. Default: %d\n"
+            "\n"
+            "   --ping-count=<n>        Number of PINGREQ packets sent every --probe-interval\n"
+            "                           milliseconds in ping mode. Default: %d\n"
+            "\n"
+            "   --output=<format>       Output format of the round trip probe. Default: nagios\n"
+            "                           nagios      - Nagios plugin output with performance data\n"
+            "                           openmetrics - OpenMetrics text exposition format\n"
+            "                           json        - single JSON object\n"
+            "\n"
+            "   --textfile=<file>       Write the metrics of the round trip probe atomically to <file>\n"
+            "                           for the node_exporter textfile collector\n"
+            "\n"
+            "   --v5-probes=<n>         Number of requests sent every --probe-interval milliseconds\n"
+            "                           in v5 mode. Default: %d\n"
+            "\n"
+            "   --self-stats            Report CPU time, context switches, peak RSS and setup time of\n"
+            "                           the check itself as performance data in rtt mode\n"
+            "\n"
+            "   --psk-identity=<id>     Identity for TLS-PSK, requires --psk-file\n"
+            "\n"
+            "   --psk-file=<file>       Read the pre-shared key for TLS-PSK as hexadecimal string from\n"
+            "                           the first line of the file, implies --ssl\n"
+            "\n"
+            "   --tls-version=<version> TLS version to use: tlsv1.1, tlsv1.2 or tlsv1.3\n"
+            "                           Default: negotiated\n"
+            "\n"
+            "   --ciphers=<list>        OpenSSL cipher list to offer\n"
+            "\n"
+            "   --curves=<list>         Colon separated list of key exchange groups to offer, e.g. X25519:P-256\n"
+            "\n"
+            "   --cache-ttl=<s>         Reuse the result of a round trip probe for up to <s> seconds\n"
+            "                           for checks of the same broker. Default: 0 (disabled)\n"
+            "\n"
+            "   --cache-dir=<dir>       Directory for the result cache. Default: %s\n"
+            "\n"
+            "   --slow-rate=<n>         Publish rate in messages per second in slow mode. Default: %d\n"
+            "\n"
+            "   --slow-read-rate=<n>    Packets per second read by the slow subscriber. Default: %d\n"
+            "\n"
+            "   --slow-messages=<n>     Number of messages published in slow mode. Default: %d\n"
+            "\n"
             "\n"
             "Note: If SSL/TLS is used (--ssl) the CA certificate MUST be present in either <cadir> or <cafile>.\n"
-            "\n", CHECK_MQTT_VERSION, DEFAULT_PORT, DEFAULT_CADIR, DEFAULT_QOS, DEFAULT_TOPIC, DEFAULT_TIMEOUT, DEFAULT_WARN_MS, DEFAULT_CRITICAL_MS, DEFAULT_KEEP_ALIVE);
+            "\n", CHECK_MQTT_VERSION, DEFAULT_PORT, DEFAULT_CADIR, DEFAULT_QOS, DEFAULT_TOPIC, DEFAULT_TIMEOUT, DEFAULT_WARN_MS, DEFAULT_CRITICAL_MS, DEFAULT_KEEP_ALIVE,
+            DEFAULT_LOAD_CONNECTIONS, DEFAULT_LOAD_RATES, DEFAULT_LOAD_PAYLOAD_SIZE, DEFAULT_LOAD_STEP, DEFAULT_PROBE_INTERVAL,
+            DEFAULT_INFLIGHT_WINDOW, DEFAULT_INFLIGHT_MESSAGES, DEFAULT_TRACE_MAX_SIZE,
+            DEFAULT_SHARED_CONSUMERS, DEFAULT_SHARED_GROUP, DEFAULT_SHARED_MESSAGES,
+            DEFAULT_SUB_COUNTS, DEFAULT_SUB_SHAPE, DEFAULT_SUB_CONNECTIONS, DEFAULT_SUB_MATCHING, DEFAULT_SUB_PROBES,
+            DEFAULT_SESSION_MESSAGES, DEFAULT_WILL_KEEP_ALIVE, DEFAULT_PROPAGATION_INTERVAL, DEFAULT_PROPAGATION_PROBES,
+            DEFAULT_PING_COUNT, DEFAULT_V5_PROBES, DEFAULT_CACHE_DIR,
+            DEFAULT_SLOW_RATE, DEFAULT_SLOW_READ_RATE, DEFAULT_SLOW_MESSAGES);
 }
 
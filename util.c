@@ -2,11 +2,11 @@
 #include "util.h"
 
 #include <mosquitto.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <uuid.h>
 #include <limits.h>
-#include <errno.h>
 #include <stdio.h>
 #include <time.h>
 
@@ -99,6 +99,51 @@ void free_configuration(struct configuration *cfg) {
         mosquitto_destroy(cfg->mqtt_handle);
     }
 
+    if (cfg->load_rates) {
+        free(cfg->load_rates);
+    }
+
+    if (cfg->trace_file) {
+        free(cfg->trace_file);
+    }
+
+    if (cfg->bind) {
+        free(cfg->bind);
+    }
+    if (cfg->textfile) {
+        free(cfg->textfile);
+    }
+    if (cfg->psk) {
+        free(cfg->psk);
+    }
+    if (cfg->psk_identity) {
+        free(cfg->psk_identity);
+    }
+    if (cfg->tls_version) {
+        free(cfg->tls_version);
+    }
+    if (cfg->ciphers) {
+        free(cfg->ciphers);
+    }
+    if (cfg->curves) {
+        free(cfg->curves);
+    }
+    if (cfg->cache_dir) {
+        free(cfg->cache_dir);
+    }
+    if (cfg->shared_group) {
+        free(cfg->shared_group);
+    }
+    if (cfg->sub_counts) {
+        free(cfg->sub_counts);
+    }
+    if (cfg->sub_shape) {
+        free(cfg->sub_shape);
+    }
+    if (cfg->session_id) {
+        free(cfg->session_id);
+    }
+
     memset((void *) cfg, 0, sizeof(struct configuration));
 }
 
@@ -141,6 +186,151 @@ double timespec2double_ms(const struct timespec ts) {
     return (double) (1.0e+09 * ts.tv_sec + ts.tv_nsec)*1.0e-06;
 }
 
+// Milliseconds left of a timeout of timeout_s seconds started at start. Never 0, because
+// mqtt_loop_run treats a timeout of 0 as no timeout.
+unsigned int remaining_ms(const struct timespec start, unsigned int timeout_s) {
+    struct timespec now;
+    double left;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = (double) timeout_s * 1000.0 - timespec2double_ms(get_delay(start, now));
+    return left >= 1.0 ? (unsigned int) left : 1;
+}
+
+int parse_mode(const char *str) {
+    if (!strcmp(str, "rtt")) {
+        return MODE_RTT;
+    }
+    if (!strcmp(str, "load")) {
+        return MODE_LOAD;
+    }
+    if (!strcmp(str, "inflight")) {
+        return MODE_INFLIGHT;
+    }
+    if (!strcmp(str, "shared")) {
+        return MODE_SHARED;
+    }
+    if (!strcmp(str, "subscriptions")) {
+        return MODE_SUBSCRIPTIONS;
+    }
+    if (!strcmp(str, "session")) {
+        return MODE_SESSION;
+    }
+    if (!strcmp(str, "will")) {
+        return MODE_WILL;
+    }
+    if (!strcmp(str, "propagation")) {
+        return MODE_PROPAGATION;
+    }
+    if (!strcmp(str, "ping")) {
+        return MODE_PING;
+    }
+    if (!strcmp(str, "v5")) {
+        return MODE_V5;
+    }
+    if (!strcmp(str, "slow")) {
+        return MODE_SLOW;
+    }
+    return -1;
+}
+
+int parse_output_format(const char *str) {
+    if (!strcmp(str, "nagios")) {
+        return OUTPUT_NAGIOS;
+    }
+    if (!strcmp(str, "openmetrics")) {
+        return OUTPUT_OPENMETRICS;
+    }
+    if (!strcmp(str, "json")) {
+        return OUTPUT_JSON;
+    }
+    return -1;
+}
+
+long *str2long_list(const char *str, size_t *count) {
+    char *copy;
+    char *token;
+    char *saveptr;
+    long *result;
+    size_t elements = 1;
+    size_t i;
+
+    for (i = 0; str[i] != 0; i++) {
+        if (str[i] == ',') {
+            elements++;
+        }
+    }
+
+    result = (long *) malloc(elements * sizeof(long));
+    if (!result) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for list of values\n", elements * sizeof(long));
+        return NULL;
+    }
+
+    copy = strdup(str);
+    if (!copy) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for list of values\n", strlen(str) + 1);
+        free(result);
+        return NULL;
+    }
+
+    *count = 0;
+    for (token = strtok_r(copy, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        result[*count] = str2long(token);
+        if (result[*count] == LONG_MIN) {
+            free(copy);
+            free(result);
+            return NULL;
+        }
+        (*count)++;
+    }
+    free(copy);
+
+    if (*count == 0) {
+        fprintf(stderr, "ERROR: Empty list of values\n");
+        free(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+int compare_double(const void *a, const void *b) {
+    double da = *(const double *) a;
+    double db = *(const double *) b;
+
+    if (da < db) {
+        return -1;
+    }
+    if (da > db) {
+        return 1;
+    }
+    return 0;
+}
+
+// nearest-rank percentile, values must be sorted in ascending order
+double percentile(const double *sorted, size_t count, double pct) {
+    size_t rank;
+    double exact;
+
+    if (!count) {
+        return 0.0;
+    }
+
+    exact = pct / 100.0 * (double) count;
+    rank = (size_t) exact;
+    if ((double) rank < exact) {
+        rank++;
+    }
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > count) {
+        rank = count;
+    }
+    return sorted[rank - 1];
+}
+
 #ifdef DEBUG
 void print_configuration(const struct configuration *cfg) {
     if (cfg->host) {
@@ -229,6 +419,60 @@ void print_configuration(const struct configuration *cfg) {
 };
 #endif
 
+// The pre-shared key is read from the first line of the file as a hexadecimal string
+int read_psk_from_file(const char *file, struct configuration *cfg) {
+    char *buffer;
+    FILE *fd;
+    char *token;
+    size_t i;
+
+    buffer = (char *) malloc(READ_BUFFER_SIZE);
+    if (!buffer) {
+        fprintf(stderr, "Unable to allocate read buffer\n");
+        return ENOMEM;
+    }
+    memset((void *) buffer, 0, READ_BUFFER_SIZE);
+
+    fd = fopen(file, "r");
+    if (!fd) {
+        free(buffer);
+        return errno;
+    }
+
+    fread((void *) buffer, sizeof(char), READ_BUFFER_SIZE - 1, fd);
+    if (ferror(fd)) {
+        fprintf(stderr, "Can't read from %s\n", file);
+        free(buffer);
+        fclose(fd);
+        return EIO;
+    }
+    fclose(fd);
+
+    token = strtok(buffer, "\r\n");
+    if (!token) {
+        free(buffer);
+        return EINVAL;
+    }
+
+    for (i = 0; token[i]; i++) {
+        if (!isxdigit((unsigned char) token[i])) {
+            free(buffer);
+            return EINVAL;
+        }
+    }
+
+    if (cfg->psk) {
+        free(cfg->psk);
+    }
+    cfg->psk = strdup(token);
+    free(buffer);
+    if (!cfg->psk) {
+        return ENOMEM;
+    }
+
+    return 0;
+}
+
 int read_password_from_file(const char *file, struct configuration *cfg) {
     char *buffer;
     FILE *fd;
@@ -1,6 +1,8 @@
 #ifndef __CHECK_MQTT_UTIL_H__
 #define __CHECK_MQTT_UTIL_H__
 
+#include <stddef.h>
+
 char *uuidgen(void);
 void free_configuration(struct configuration *);
 long str2long(const char *);
@@ -22,12 +24,20 @@ void *memcpy(void *, const void *, size_t);
 #include <time.h>
 struct timespec get_delay(const struct timespec, const struct timespec);
 double timespec2double_ms(const struct timespec);
+unsigned int remaining_ms(const struct timespec, unsigned int);
+
+int parse_mode(const char *);
+int parse_output_format(const char *);
+long *str2long_list(const char *, size_t *);
+int compare_double(const void *, const void *);
+double percentile(const double *, size_t, double);
 
 #ifdef DEBUG
 void print_configuration(const struct configuration *);
 #endif
 
 int read_password_from_file(const char *, struct configuration *);
+int read_psk_from_file(const char *, struct configuration *);
 
 #endif /* __CHECK_MQTT_UTIL_H__ */
 
@@ -0,0 +1,521 @@
+#include "check_mqtt.h"
+#include "v5_test.h"
+#include "mqtt_functions.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define V5_ALIAS_REQUEST 1
+#define V5_ALIAS_RESPONSE 2
+
+// sequence number of the probe, big endian
+#define V5_CORRELATION_SIZE 4
+
+struct v5_test {
+    struct configuration *cfg;
+    struct mosquitto *handle;
+    bool connected;
+    bool subscribed;
+    bool failed;
+    int connect_result;
+    struct timespec connect_start;
+    double connect_time;
+    char *filter;
+    char *request_topic;
+    char *response_topic;
+    // CONNACK properties, receive maximum defaults to 65535 and maximum packet size to unlimited (0)
+    uint16_t receive_maximum;
+    uint32_t maximum_packet_size;
+    uint16_t topic_alias_maximum;
+    bool request_alias;
+    bool response_alias;
+    struct timespec start;
+    double next_probe_ms;
+    bool outstanding;
+    // the request of the outstanding probe has reached the responder, QoS 1 may deliver it twice
+    bool request_received;
+    uint32_t seq;
+    struct timespec send_time;
+    double *rtt;
+    double *request_rtt;
+    unsigned long sent;
+    unsigned long received;
+    unsigned long requests;
+    unsigned long lost;
+    // PUBLISH packets written per probe and the same exchange in MQTT 3.1.1
+    unsigned long bytes_v5;
+    unsigned long bytes_v311;
+};
+
+static size_t v5_varint_size(size_t value) {
+    if (value < 128) {
+        return 1;
+    }
+    if (value < 16384) {
+        return 2;
+    }
+    if (value < 2097152) {
+        return 3;
+    }
+    return 4;
+}
+
+// Size of a PUBLISH packet on the wire: fixed header, topic, packet identifier (QoS > 0),
+// properties (MQTT v5 only) and payload
+static size_t v5_publish_size(size_t topic_len, int qos, bool v5, size_t properties_len, size_t payload_len) {
+    size_t remaining;
+
+    remaining = 2 + topic_len + payload_len;
+    if (qos) {
+        remaining += 2;
+    }
+    if (v5) {
+        remaining += v5_varint_size(properties_len) + properties_len;
+    }
+    return 1 + v5_varint_size(remaining) + remaining;
+}
+
+// MQTT 3.1.1 has no correlation data, the probe is identified by a <uuid>:<seq> payload as in the other modes
+static size_t v5_publish_size_v311(const struct v5_test *test, const char *topic) {
+    char payload[64];
+    int len;
+
+    len = snprintf(payload, sizeof(payload), "%s:%lu", test->cfg->payload, (unsigned long) test->seq);
+    return v5_publish_size(strlen(topic), test->cfg->qos, false, 0, (size_t) len);
+}
+
+static void v5_encode_seq(uint32_t seq, unsigned char *data) {
+    data[0] = (seq >> 24) & 0xff;
+    data[1] = (seq >> 16) & 0xff;
+    data[2] = (seq >> 8) & 0xff;
+    data[3] = seq & 0xff;
+}
+
+static uint32_t v5_decode_seq(const unsigned char *data) {
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | (uint32_t) data[3];
+}
+
+static void v5_connect_callback(struct mosquitto *mosq, void *userdata, int result, int flags, const mosquitto_property *props) {
+    struct v5_test *test = (struct v5_test *) userdata;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (result) {
+        test->connect_result = result;
+        test->failed = true;
+        return;
+    }
+    test->connect_time = timespec2double_ms(get_delay(test->connect_start, now));
+
+    test->receive_maximum = 65535;
+    mosquitto_property_read_int16(props, MQTT_PROP_RECEIVE_MAXIMUM, &test->receive_maximum, false);
+    mosquitto_property_read_int32(props, MQTT_PROP_MAXIMUM_PACKET_SIZE, &test->maximum_packet_size, false);
+    mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &test->topic_alias_maximum, false);
+
+    test->cfg->mqtt_error = mosquitto_subscribe(mosq, NULL, test->filter, test->cfg->qos);
+    if (test->cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        test->failed = true;
+        return;
+    }
+    test->connected = true;
+}
+
+static void v5_disconnect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct v5_test *test = (struct v5_test *) userdata;
+
+    test->cfg->mqtt_error = result;
+    test->failed = true;
+}
+
+static void v5_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos) {
+    struct v5_test *test = (struct v5_test *) userdata;
+
+    // MQTT v5 SUBACK reason codes >= 0x80 are failures
+    if ((qos_count > 0) && (granted_qos[0] >= 0x80)) {
+        test->cfg->mqtt_error = MOSQ_ERR_ACL_DENIED;
+        test->failed = true;
+        return;
+    }
+    test->subscribed = true;
+}
+
+// Answer a request like a responder would: publish to the response topic of the request with the
+// correlation data of the request
+static void v5_respond(struct v5_test *test, const mosquitto_property *props) {
+    struct configuration *cfg = test->cfg;
+    mosquitto_property *response = NULL;
+    char *response_topic = NULL;
+    void *correlation = NULL;
+    uint16_t correlation_len = 0;
+    const char *topic;
+    size_t properties_len;
+    bool alias = false;
+
+    if (!mosquitto_property_read_string(props, MQTT_PROP_RESPONSE_TOPIC, &response_topic, false)) {
+        return;
+    }
+    if (!mosquitto_property_read_binary(props, MQTT_PROP_CORRELATION_DATA, &correlation, &correlation_len, false)) {
+        free(response_topic);
+        return;
+    }
+
+    properties_len = 3 + correlation_len;
+    cfg->mqtt_error = mosquitto_property_add_binary(&response, MQTT_PROP_CORRELATION_DATA, correlation, correlation_len);
+
+    // the response topic of our own probes is always the same, so it can use a topic alias
+    topic = response_topic;
+    if ((cfg->mqtt_error == MOSQ_ERR_SUCCESS) && (test->topic_alias_maximum >= V5_ALIAS_RESPONSE) && !strcmp(response_topic, test->response_topic)) {
+        cfg->mqtt_error = mosquitto_property_add_int16(&response, MQTT_PROP_TOPIC_ALIAS, V5_ALIAS_RESPONSE);
+        properties_len += 3;
+        alias = true;
+        if (test->response_alias) {
+            topic = NULL;
+        }
+    }
+
+    if (cfg->mqtt_error == MOSQ_ERR_SUCCESS) {
+        cfg->mqtt_error = mosquitto_publish_v5(test->handle, NULL, topic, 0, NULL, cfg->qos, false, response);
+    }
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        test->failed = true;
+    } else {
+        if (topic && alias) {
+            test->response_alias = true;
+        }
+        test->bytes_v5 += v5_publish_size(topic ? strlen(topic) : 0, cfg->qos, true, properties_len, 0);
+        test->bytes_v311 += v5_publish_size_v311(test, test->response_topic);
+    }
+
+    mosquitto_property_free_all(&response);
+    free(correlation);
+    free(response_topic);
+}
+
+static void v5_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg, const mosquitto_property *props) {
+    struct v5_test *test = (struct v5_test *) userdata;
+    struct timespec now;
+    void *correlation = NULL;
+    uint16_t correlation_len = 0;
+    uint32_t seq;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!msg->topic) {
+        return;
+    }
+
+    // the probe is matched on its correlation data, the payload is empty
+    if (!mosquitto_property_read_binary(props, MQTT_PROP_CORRELATION_DATA, &correlation, &correlation_len, false)) {
+        return;
+    }
+    if (correlation_len != V5_CORRELATION_SIZE) {
+        free(correlation);
+        return;
+    }
+    seq = v5_decode_seq((const unsigned char *) correlation);
+    free(correlation);
+
+    if (!strcmp(msg->topic, test->request_topic)) {
+        if (test->outstanding && (seq == test->seq) && !test->request_received && (test->requests < test->cfg->v5_probes)) {
+            test->request_rtt[test->requests] = timespec2double_ms(get_delay(test->send_time, now));
+            test->requests++;
+            test->request_received = true;
+        }
+        v5_respond(test, props);
+        return;
+    }
+
+    if (!strcmp(msg->topic, test->response_topic) && test->outstanding && (seq == test->seq)) {
+        test->rtt[test->received] = timespec2double_ms(get_delay(test->send_time, now));
+        test->received++;
+        test->outstanding = false;
+    }
+}
+
+static int v5_publish_request(struct v5_test *test) {
+    struct configuration *cfg = test->cfg;
+    mosquitto_property *props = NULL;
+    unsigned char correlation[V5_CORRELATION_SIZE];
+    const char *topic = test->request_topic;
+    size_t properties_len;
+    int rc;
+
+    v5_encode_seq(test->seq, correlation);
+
+    properties_len = 3 + strlen(test->response_topic) + 3 + V5_CORRELATION_SIZE;
+    rc = mosquitto_property_add_string(&props, MQTT_PROP_RESPONSE_TOPIC, test->response_topic);
+    if (rc == MOSQ_ERR_SUCCESS) {
+        rc = mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA, (const void *) correlation, V5_CORRELATION_SIZE);
+    }
+
+    // the first request establishes the alias, all further requests only send the alias
+    if ((rc == MOSQ_ERR_SUCCESS) && (test->topic_alias_maximum >= V5_ALIAS_REQUEST)) {
+        rc = mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, V5_ALIAS_REQUEST);
+        properties_len += 3;
+        if (test->request_alias) {
+            topic = NULL;
+        }
+    }
+
+    if (rc == MOSQ_ERR_SUCCESS) {
+        clock_gettime(CLOCK_MONOTONIC, &test->send_time);
+        rc = mosquitto_publish_v5(test->handle, NULL, topic, 0, NULL, cfg->qos, false, props);
+    }
+    mosquitto_property_free_all(&props);
+
+    if (rc != MOSQ_ERR_SUCCESS) {
+        cfg->mqtt_error = rc;
+        return -1;
+    }
+
+    if (topic && (test->topic_alias_maximum >= V5_ALIAS_REQUEST)) {
+        test->request_alias = true;
+    }
+    test->bytes_v5 += v5_publish_size(topic ? strlen(topic) : 0, cfg->qos, true, properties_len, 0);
+    test->bytes_v311 += v5_publish_size_v311(test, test->request_topic);
+    return 0;
+}
+
+static int v5_connect_tick(void *userdata, const struct timespec *now) {
+    struct v5_test *test = (struct v5_test *) userdata;
+
+    if (test->failed) {
+        return -1;
+    }
+    return test->subscribed ? 1 : 0;
+}
+
+static int v5_run_tick(void *userdata, const struct timespec *now) {
+    struct v5_test *test = (struct v5_test *) userdata;
+    struct configuration *cfg = test->cfg;
+    double elapsed;
+
+    if (test->failed) {
+        return -1;
+    }
+
+    // a response not received within the critical threshold is lost
+    if (test->outstanding && (timespec2double_ms(get_delay(test->send_time, *now)) >= (double) cfg->critical)) {
+        test->outstanding = false;
+        test->lost++;
+    }
+
+    if (test->outstanding) {
+        return 0;
+    }
+    if (test->sent == cfg->v5_probes) {
+        return 1;
+    }
+
+    elapsed = timespec2double_ms(get_delay(test->start, *now));
+    if (elapsed >= test->next_probe_ms) {
+        test->seq++;
+        if (v5_publish_request(test) != 0) {
+            return -1;
+        }
+        test->outstanding = true;
+        test->request_received = false;
+        test->sent++;
+        test->next_probe_ms += (double) cfg->probe_interval;
+    }
+    return 0;
+}
+
+static void v5_free(struct v5_test *test) {
+    if (test->handle) {
+        mosquitto_destroy(test->handle);
+    }
+    if (test->filter) {
+        free(test->filter);
+    }
+    if (test->request_topic) {
+        free(test->request_topic);
+    }
+    if (test->response_topic) {
+        free(test->response_topic);
+    }
+    if (test->rtt) {
+        free(test->rtt);
+    }
+    if (test->request_rtt) {
+        free(test->request_rtt);
+    }
+}
+
+static int v5_setup(struct v5_test *test) {
+    struct configuration *cfg = test->cfg;
+    char *mqttid;
+    size_t topic_len;
+
+    test->rtt = (double *) calloc(cfg->v5_probes, sizeof(double));
+    test->request_rtt = (double *) calloc(cfg->v5_probes, sizeof(double));
+    if (!test->rtt || !test->request_rtt) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for round trip times\n", 2 * cfg->v5_probes * sizeof(double));
+        cfg->mqtt_error = MOSQ_ERR_NOMEM;
+        return -1;
+    }
+
+    // <topic>/v5/<uuid>/request and <topic>/v5/<uuid>/response, subscribed as <topic>/v5/<uuid>/+
+    topic_len = strlen(cfg->topic) + strlen(cfg->payload) + 14;
+    test->filter = (char *) malloc(topic_len);
+    test->request_topic = (char *) malloc(topic_len);
+    test->response_topic = (char *) malloc(topic_len);
+    if (!test->filter || !test->request_topic || !test->response_topic) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for request/response topics\n", 3 * topic_len);
+        cfg->mqtt_error = MOSQ_ERR_NOMEM;
+        return -1;
+    }
+    snprintf(test->filter, topic_len, "%s/v5/%s/+", cfg->topic, cfg->payload);
+    snprintf(test->request_topic, topic_len, "%s/v5/%s/request", cfg->topic, cfg->payload);
+    snprintf(test->response_topic, topic_len, "%s/v5/%s/response", cfg->topic, cfg->payload);
+
+    mqttid = mqtt_client_id();
+    if (!mqttid) {
+        cfg->mqtt_error = MOSQ_ERR_NOMEM;
+        return -1;
+    }
+    test->handle = mqtt_new_handle(cfg, mqttid, true, (void *) test);
+    free(mqttid);
+    if (!test->handle) {
+        return -1;
+    }
+
+    cfg->mqtt_error = mosquitto_int_option(test->handle, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        return -1;
+    }
+
+    mosquitto_connect_v5_callback_set(test->handle, v5_connect_callback);
+    mosquitto_disconnect_callback_set(test->handle, v5_disconnect_callback);
+    mosquitto_subscribe_callback_set(test->handle, v5_subscribe_callback);
+    mosquitto_message_v5_callback_set(test->handle, v5_message_callback);
+
+    clock_gettime(CLOCK_MONOTONIC, &test->connect_start);
+    cfg->mqtt_error = mosquitto_connect_async(test->handle, cfg->host, cfg->port, cfg->keep_alive);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        return -1;
+    }
+    return 0;
+}
+
+static void v5_print_connack(struct v5_test *test) {
+    fprintf(stdout, " receive_maximum=%u;;;0", test->receive_maximum);
+    if (test->maximum_packet_size) {
+        fprintf(stdout, " maximum_packet_size=%uB;;;0", test->maximum_packet_size);
+    } else {
+        fprintf(stdout, " maximum_packet_size=U;;;0");
+    }
+    fprintf(stdout, " topic_alias_maximum=%u;;;0", test->topic_alias_maximum);
+}
+
+static int v5_report(struct v5_test *test) {
+    struct configuration *cfg = test->cfg;
+    double p50;
+    double p99;
+    double request_p50;
+    double bytes_v5;
+    double bytes_v311;
+    int exit_code;
+
+    qsort((void *) test->rtt, test->received, sizeof(double), compare_double);
+    qsort((void *) test->request_rtt, test->requests, sizeof(double), compare_double);
+    p50 = percentile(test->rtt, test->received, 50.0);
+    p99 = percentile(test->rtt, test->received, 99.0);
+    request_p50 = percentile(test->request_rtt, test->requests, 50.0);
+
+    bytes_v5 = test->sent ? (double) test->bytes_v5 / (double) test->sent : 0.0;
+    bytes_v311 = test->sent ? (double) test->bytes_v311 / (double) test->sent : 0.0;
+
+    if (!test->received) {
+        exit_code = NAGIOS_CRITICAL;
+        fprintf(stdout, "No response received for %lu MQTT v5 requests |", test->sent);
+    } else {
+        if (p99 >= (double) cfg->critical) {
+            exit_code = NAGIOS_CRITICAL;
+        } else if ((p99 >= (double) cfg->warn) || test->lost) {
+            exit_code = NAGIOS_WARNING;
+        } else {
+            exit_code = NAGIOS_OK;
+        }
+        fprintf(stdout, "p99 request/response RTT %.1fms, %lu of %lu responses received, %.1f bytes per probe (%.1f with MQTT 3.1.1) |",
+                p99, test->received, test->sent, bytes_v5, bytes_v311);
+    }
+
+    fprintf(stdout, " connect=%.3fms;;;0", test->connect_time);
+    if (test->received) {
+        fprintf(stdout, " rtt_p50=%.3fms;;;0 mqtt_rtt=%.3fms;%d;%d;0", p50, p99, cfg->warn, cfg->critical);
+    } else {
+        fprintf(stdout, " rtt_p50=U;;;0 mqtt_rtt=U;%d;%d;0", cfg->warn, cfg->critical);
+    }
+    if (test->requests) {
+        fprintf(stdout, " request_p50=%.3fms;;;0", request_p50);
+    } else {
+        fprintf(stdout, " request_p50=U;;;0");
+    }
+    fprintf(stdout, " probe_loss=%lu;;;0;%lu", test->lost, test->sent);
+    v5_print_connack(test);
+    fprintf(stdout, " bytes_v5=%.1fB;;;0 bytes_v311=%.1fB;;;0\n", bytes_v5, bytes_v311);
+
+    return exit_code;
+}
+
+int v5_test(struct configuration *cfg) {
+    struct v5_test test;
+    int exit_code = NAGIOS_CRITICAL;
+    int rc;
+
+    memset((void *) &test, 0, sizeof(struct v5_test));
+    test.cfg = cfg;
+
+    mosquitto_lib_init();
+
+    if (v5_setup(&test) != 0) {
+        fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    // connecting and probing share the timeout
+    rc = mqtt_loop_run(&test.handle, 1, remaining_ms(test.connect_start, cfg->timeout), 10, v5_connect_tick, (void *) &test);
+    if (rc != MQTT_LOOP_DONE) {
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds | mqtt_rtt=U;%d;%d;0\n", cfg->timeout, cfg->warn, cfg->critical);
+        } else if (test.connect_result) {
+            fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_reason_string(test.connect_result), cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, "%s | mqtt_rtt=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        }
+        goto leave;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &test.start);
+    rc = mqtt_loop_run(&test.handle, 1, remaining_ms(test.connect_start, cfg->timeout), 1, v5_run_tick, (void *) &test);
+    if (rc == MQTT_LOOP_TIMEOUT) {
+        fprintf(stdout, "Timeout after %d seconds, %lu requests sent | connect=%.3fms;;;0 mqtt_rtt=U;%d;%d;0", cfg->timeout, test.sent,
+                test.connect_time, cfg->warn, cfg->critical);
+        v5_print_connack(&test);
+        fprintf(stdout, "\n");
+        goto leave;
+    }
+    if (rc != MQTT_LOOP_DONE) {
+        fprintf(stdout, "%s after %lu requests | connect=%.3fms;;;0 mqtt_rtt=U;%d;%d;0", mosquitto_strerror(cfg->mqtt_error), test.sent,
+                test.connect_time, cfg->warn, cfg->critical);
+        v5_print_connack(&test);
+        fprintf(stdout, "\n");
+        goto leave;
+    }
+
+    exit_code = v5_report(&test);
+
+leave:
+    v5_free(&test);
+    mosquitto_lib_cleanup();
+    return exit_code;
+}
+
@@ -0,0 +1,7 @@
+#ifndef __CHECK_MQTT_V5_TEST_H__
+#define __CHECK_MQTT_V5_TEST_H__
+
+int v5_test(struct configuration *);
+
+#endif /* __CHECK_MQTT_V5_TEST_H__ */
+
@@ -0,0 +1,285 @@
+#include "check_mqtt.h"
+#include "will_test.h"
+#include "mqtt_functions.h"
+#include "mqtt_loop.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+struct will_test;
+
+struct will_client {
+    struct will_test *test;
+    struct mosquitto *handle;
+    bool connected;
+    bool subscribed;
+    bool failed;
+};
+
+struct will_test {
+    struct configuration *cfg;
+    // index 0 registers the will and is killed, index 1 subscribes to the will topic
+    struct will_client clients[2];
+    struct mosquitto *handles[2];
+    char *topic;
+    bool killed;
+    bool delivered;
+    struct timespec kill_time;
+    double latency;
+    int connect_result;
+};
+
+static void will_connect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct will_client *client = (struct will_client *) userdata;
+    struct will_test *test = client->test;
+
+    if (result) {
+        test->connect_result = result;
+        client->failed = true;
+        return;
+    }
+    client->connected = true;
+
+    if (client == &test->clients[1]) {
+        test->cfg->mqtt_error = mosquitto_subscribe(mosq, NULL, test->topic, test->cfg->qos);
+        if (test->cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+            client->failed = true;
+        }
+    }
+}
+
+static void will_disconnect_callback(struct mosquitto *mosq, void *userdata, int result) {
+    struct will_client *client = (struct will_client *) userdata;
+
+    // the connection of the will client is expected to go away
+    if (client->test->killed && (client == &client->test->clients[0])) {
+        return;
+    }
+    client->test->cfg->mqtt_error = result;
+    client->failed = true;
+}
+
+static void will_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos) {
+    struct will_client *client = (struct will_client *) userdata;
+
+    if ((qos_count > 0) && (granted_qos[0] == 0x80)) {
+        client->test->cfg->mqtt_error = MOSQ_ERR_ACL_DENIED;
+        client->failed = true;
+        return;
+    }
+    client->subscribed = true;
+}
+
+static void will_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg) {
+    struct will_client *client = (struct will_client *) userdata;
+    struct will_test *test = client->test;
+    struct timespec now;
+    size_t len;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!test->killed || test->delivered) {
+        return;
+    }
+
+    len = strlen(test->cfg->payload);
+    if ((msg->payloadlen != (int) len) || memcmp(msg->payload, test->cfg->payload, len)) {
+        return;
+    }
+
+    test->latency = timespec2double_ms(get_delay(test->kill_time, now));
+    test->delivered = true;
+}
+
+static int will_connect_tick(void *userdata, const struct timespec *now) {
+    struct will_test *test = (struct will_test *) userdata;
+
+    if (test->clients[0].failed || test->clients[1].failed) {
+        return -1;
+    }
+    return (test->clients[0].connected && test->clients[1].subscribed) ? 1 : 0;
+}
+
+static int will_wait_tick(void *userdata, const struct timespec *now) {
+    struct will_test *test = (struct will_test *) userdata;
+
+    if (test->clients[1].failed) {
+        return -1;
+    }
+    return test->delivered ? 1 : 0;
+}
+
+static void will_free(struct will_test *test) {
+    size_t i;
+
+    for (i = 0; i < 2; i++) {
+        if (test->clients[i].handle) {
+            mosquitto_destroy(test->clients[i].handle);
+        }
+    }
+    if (test->topic) {
+        free(test->topic);
+    }
+}
+
+static int will_setup(struct will_test *test) {
+    struct configuration *cfg = test->cfg;
+    char *mqttid;
+    size_t topic_len;
+    size_t i;
+
+    // <topic>/will
+    topic_len = strlen(cfg->topic) + 6;
+    test->topic = (char *) malloc(topic_len);
+    if (!test->topic) {
+        fprintf(stderr, "Unable to allocate %ld bytes of memory for will topic\n", topic_len);
+        return -1;
+    }
+    snprintf(test->topic, topic_len, "%s/will", cfg->topic);
+
+    for (i = 0; i < 2; i++) {
+        test->clients[i].test = test;
+
+        mqttid = mqtt_client_id();
+        if (!mqttid) {
+            return -1;
+        }
+        test->clients[i].handle = mqtt_new_handle(cfg, mqttid, true, (void *) &test->clients[i]);
+        free(mqttid);
+        if (!test->clients[i].handle) {
+            return -1;
+        }
+        test->handles[i] = test->clients[i].handle;
+
+        mosquitto_connect_callback_set(test->clients[i].handle, will_connect_callback);
+        mosquitto_disconnect_callback_set(test->clients[i].handle, will_disconnect_callback);
+    }
+
+    mosquitto_subscribe_callback_set(test->clients[1].handle, will_subscribe_callback);
+    mosquitto_message_callback_set(test->clients[1].handle, will_message_callback);
+
+    // the will must be set before connecting
+    cfg->mqtt_error = mosquitto_will_set(test->clients[0].handle, test->topic, strlen(cfg->payload), (void *) cfg->payload, cfg->qos, false);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        return -1;
+    }
+
+    cfg->mqtt_error = mosquitto_connect_async(test->clients[0].handle, cfg->host, cfg->port, cfg->will_keep_alive);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        return -1;
+    }
+    cfg->mqtt_error = mosquitto_connect_async(test->clients[1].handle, cfg->host, cfg->port, cfg->keep_alive);
+    if (cfg->mqtt_error != MOSQ_ERR_SUCCESS) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Kill the connection of the will client without sending DISCONNECT. Unless --will-silent is set
+// the socket is shut down, so the broker sees the connection loss at once. In any case the handle
+// is no longer serviced, so no PINGREQ is sent and the broker has to rely on the keepalive timeout.
+static void will_kill(struct will_test *test) {
+    int sock;
+
+    test->killed = true;
+    clock_gettime(CLOCK_MONOTONIC, &test->kill_time);
+
+    if (!test->cfg->will_silent) {
+        sock = mosquitto_socket(test->clients[0].handle);
+        if (sock != -1) {
+            shutdown(sock, SHUT_RDWR);
+        }
+    }
+    test->handles[0] = NULL;
+}
+
+static int will_report(struct will_test *test) {
+    struct configuration *cfg = test->cfg;
+    struct timespec now;
+    double bound;
+    double offset;
+    int exit_code;
+
+    // MQTT 3.1.1 section 3.1.2.10: the server disconnects a client after 1.5 times the keepalive
+    bound = 1.5 * 1000.0 * (double) cfg->will_keep_alive;
+
+    if (!test->delivered) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        fprintf(stdout, "Timeout after %d seconds, last will not delivered within %.0fms after the connection was killed | will_latency=U;%d;%d;0 will_bound=%.0fms;;;0\n",
+                cfg->timeout, timespec2double_ms(get_delay(test->kill_time, now)), cfg->warn, cfg->critical, bound);
+        return NAGIOS_CRITICAL;
+    }
+
+    // an abandoned connection can only be detected by the keepalive timeout, so the thresholds apply
+    // to the time the broker needed beyond the keepalive bound
+    offset = cfg->will_silent ? bound : 0.0;
+    if (!cfg->will_silent && (test->latency > bound)) {
+        exit_code = NAGIOS_CRITICAL;
+    } else if (test->latency - offset >= (double) cfg->critical) {
+        exit_code = NAGIOS_CRITICAL;
+    } else if (test->latency - offset >= (double) cfg->warn) {
+        exit_code = NAGIOS_WARNING;
+    } else {
+        exit_code = NAGIOS_OK;
+    }
+
+    fprintf(stdout, "Last will delivered %.1fms after the connection was %s (keepalive bound %.0fms) | will_latency=%.3fms;%.0f;%.0f;0 will_bound=%.0fms;;;0\n",
+            test->latency, cfg->will_silent ? "abandoned" : "closed", bound, test->latency,
+            offset + (double) cfg->warn, offset + (double) cfg->critical, bound);
+
+    return exit_code;
+}
+
+int will_test(struct configuration *cfg) {
+    struct will_test test;
+    struct timespec start;
+    int exit_code = NAGIOS_CRITICAL;
+    int rc;
+
+    memset((void *) &test, 0, sizeof(struct will_test));
+    test.cfg = cfg;
+
+    // connecting and waiting for the will share the timeout
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mosquitto_lib_init();
+
+    if (will_setup(&test) != 0) {
+        fprintf(stdout, "%s | will_latency=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    rc = mqtt_loop_run(test.handles, 2, remaining_ms(start, cfg->timeout), 10, will_connect_tick, (void *) &test);
+    if (rc != MQTT_LOOP_DONE) {
+        if (rc == MQTT_LOOP_TIMEOUT) {
+            fprintf(stdout, "Timeout after %d seconds while connecting | will_latency=U;%d;%d;0\n", cfg->timeout, cfg->warn, cfg->critical);
+        } else if (test.connect_result) {
+            fprintf(stdout, "%s | will_latency=U;%d;%d;0\n", mosquitto_connack_string(test.connect_result), cfg->warn, cfg->critical);
+        } else {
+            fprintf(stdout, "%s | will_latency=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        }
+        goto leave;
+    }
+
+    will_kill(&test);
+
+    // the keepalive bound fits into the timeout, see the option checks
+    rc = mqtt_loop_run(test.handles, 2, remaining_ms(start, cfg->timeout), 1, will_wait_tick, (void *) &test);
+    if (rc == MQTT_LOOP_ERROR) {
+        fprintf(stdout, "%s while waiting for the last will | will_latency=U;%d;%d;0\n", mosquitto_strerror(cfg->mqtt_error), cfg->warn, cfg->critical);
+        goto leave;
+    }
+
+    exit_code = will_report(&test);
+
+leave:
+    will_free(&test);
+    mosquitto_lib_cleanup();
+    return exit_code;
+}
+
@@ -0,0 +1,7 @@
+#ifndef __CHECK_MQTT_WILL_TEST_H__
+#define __CHECK_MQTT_WILL_TEST_H__
+
+int will_test(struct configuration *);
+
+#endif /* __CHECK_MQTT_WILL_TEST_H__ */
+